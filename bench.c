@@ -0,0 +1,696 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Frank Hunleth
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+#include "libmmccopy.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <linux/loop.h>
+
+// Regression benchmarks for the copy engine. Each case runs a job
+// through libmmccopy a few times and reports the median throughput and
+// the write latencies from its telemetry as one JSON line. Lines have a
+// name so that the output of two builds can be compared with --compare.
+
+#define ONE_MiB (1024 * 1024)
+#define MAX_DEVICES 8
+#define DEFAULT_SIZE (64 * ONE_MiB)
+#define THROTTLED_SIZE (16 * ONE_MiB)
+#define DEFAULT_RUNS 3
+#define MAX_RUNS 15
+#define MAX_CASE_ARGS 24
+#define SPARSE_RUN (ONE_MiB)
+
+// The throttled device adds this much to every write like a slow SD card
+#define THROTTLE_LATENCY_US 2000
+#define THROTTLE_BYTES_PER_SECOND (20 * 1000 * 1000)
+#define DELAY_DEVICE_NAME "mmccopy-bench-delay"
+
+struct bench_device
+{
+    const char *name;       // What kind of device for the results
+    char path[64];
+    bool readable;          // Reads return what was written
+    bool throttled;
+};
+
+struct bench_result
+{
+    bool ok;
+    double mbps;
+    double p50_ms;
+    double p99_ms;
+    char error[256];
+};
+
+static const char *work_dir = NULL;
+static size_t image_size = DEFAULT_SIZE;
+static int runs = DEFAULT_RUNS;
+
+static struct bench_device devices[MAX_DEVICES];
+static int device_count = 0;
+static int loop_fd = -1;
+static bool delay_device = false;
+
+// Writes to the throttled file are slowed down in pwrite, which the copy
+// engine calls on the job threads in this program. This is the fallback
+// when dm-delay isn't available. 32-bit systems pass 64-bit offsets to
+// the system call differently, so it's only done on 64-bit ones.
+static dev_t throttle_dev;
+static ino_t throttle_ino;
+static bool throttle_file = false;
+
+#if __SIZEOF_LONG__ == 8
+#define HAVE_THROTTLED_FILE 1
+
+ssize_t pwrite(int fd, const void *buffer, size_t len, off_t offset)
+{
+    struct stat st;
+    if (throttle_file && fstat(fd, &st) == 0 && st.st_dev == throttle_dev && st.st_ino == throttle_ino) {
+        uint64_t us = THROTTLE_LATENCY_US + (uint64_t) len * 1000000 / THROTTLE_BYTES_PER_SECOND;
+        struct timespec delay = { (time_t) (us / 1000000), (long) (us % 1000000) * 1000 };
+        while (nanosleep(&delay, &delay) < 0 && errno == EINTR)
+            ;
+    }
+    return syscall(SYS_pwrite64, fd, buffer, len, offset);
+}
+#endif
+
+static void print_usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv0);
+    fprintf(stderr, "       %s --compare <old.json> <new.json>\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -d <dir>  Where to put the images and file devices (default $TMPDIR or /var/tmp)\n");
+    fprintf(stderr, "  -n <runs> How many times to run each case (default %d)\n", DEFAULT_RUNS);
+    fprintf(stderr, "  -s <MiB>  Image size (default %d MiB)\n", DEFAULT_SIZE / ONE_MiB);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Loop, null_blk and dm-delay devices are used when running as root.\n");
+}
+
+static void work_path(const char *name, char *out, size_t len)
+{
+    snprintf(out, len, "%s/mmccopy-bench-%s", work_dir, name);
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void create_image(const char *path, size_t size, bool sparse)
+{
+    // Half of each MiB is random and half is text so that the image
+    // compresses about as well as a root file system. Sparse images have
+    // data in one MiB out of four and zeros everywhere else.
+    static const char text[] = "mmccopy benchmark image with some text for compressors to find\n";
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        err(EXIT_FAILURE, "%s", path);
+
+    char *buffer = (char *) malloc(ONE_MiB);
+    if (!buffer)
+        err(EXIT_FAILURE, "malloc");
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    size_t offset;
+    for (offset = 0; offset < size; offset += ONE_MiB) {
+        size_t i;
+        if (sparse && (offset / SPARSE_RUN) % 4 != 0)
+            memset(buffer, 0, ONE_MiB);
+        else {
+            for (i = 0; i < ONE_MiB / 2; i += sizeof(uint64_t)) {
+                uint64_t r = next_random(&state);
+                memcpy(buffer + i, &r, sizeof(r));
+            }
+            for (; i < ONE_MiB; i++)
+                buffer[i] = text[i % (sizeof(text) - 1)];
+        }
+        size_t len = size - offset < ONE_MiB ? size - offset : ONE_MiB;
+        if (write(fd, buffer, len) != (ssize_t) len)
+            err(EXIT_FAILURE, "%s", path);
+    }
+    free(buffer);
+    close(fd);
+}
+
+static void create_file(const char *path, size_t size)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) < 0)
+        err(EXIT_FAILURE, "%s", path);
+    close(fd);
+}
+
+static struct bench_device *add_device(const char *name, const char *path, bool readable)
+{
+    struct bench_device *device = &devices[device_count++];
+    device->name = name;
+    snprintf(device->path, sizeof(device->path), "%s", path);
+    device->readable = readable;
+    return device;
+}
+
+static bool run_command(char *const argv[])
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool setup_loop(const char *backing, char *path, size_t len)
+{
+    int control = open("/dev/loop-control", O_RDWR);
+    if (control < 0)
+        return false;
+    int n = ioctl(control, LOOP_CTL_GET_FREE);
+    close(control);
+    if (n < 0)
+        return false;
+
+    snprintf(path, len, "/dev/loop%d", n);
+    loop_fd = open(path, O_RDWR);
+    int backing_fd = open(backing, O_RDWR);
+    bool ok = loop_fd >= 0 && backing_fd >= 0 && ioctl(loop_fd, LOOP_SET_FD, backing_fd) == 0;
+    if (backing_fd >= 0)
+        close(backing_fd);
+    if (!ok && loop_fd >= 0) {
+        close(loop_fd);
+        loop_fd = -1;
+    }
+    return ok;
+}
+
+static void setup_devices()
+{
+    // A regular file always works. Block devices need root.
+    char path[PATH_MAX];
+    work_path("file.img", path, sizeof(path));
+    create_file(path, image_size);
+    add_device("file", path, true);
+
+    char loop_path[64];
+    work_path("loop.img", path, sizeof(path));
+    create_file(path, image_size);
+    if (geteuid() == 0 && setup_loop(path, loop_path, sizeof(loop_path)))
+        add_device("loop", loop_path, true);
+    else
+        unlink(path);
+
+    if (geteuid() == 0 && access("/dev/nullb0", W_OK) == 0)
+        add_device("null_blk", "/dev/nullb0", false);
+
+    // The throttled device is dm-delay on the loop device if possible and
+    // a file that's slowed down in pwrite otherwise.
+    if (loop_fd >= 0) {
+        char table[128];
+        snprintf(table, sizeof(table), "0 %llu delay %s 0 %d", (unsigned long long) image_size / 512,
+                 loop_path, THROTTLE_LATENCY_US / 1000);
+        char *argv[] = { (char *) "dmsetup", (char *) "create", (char *) DELAY_DEVICE_NAME,
+                         (char *) "--table", table, NULL };
+        delay_device = run_command(argv);
+    }
+    if (delay_device)
+        add_device("dm-delay", "/dev/mapper/" DELAY_DEVICE_NAME, true)->throttled = true;
+#ifdef HAVE_THROTTLED_FILE
+    else {
+        work_path("throttled.img", path, sizeof(path));
+        create_file(path, image_size);
+        add_device("throttled-file", path, true)->throttled = true;
+
+        struct stat st;
+        if (stat(path, &st) < 0)
+            err(EXIT_FAILURE, "%s", path);
+        throttle_dev = st.st_dev;
+        throttle_ino = st.st_ino;
+        throttle_file = true;
+    }
+#endif
+}
+
+static void cleanup_devices()
+{
+    char path[PATH_MAX];
+    if (delay_device) {
+        char *argv[] = { (char *) "dmsetup", (char *) "remove", (char *) DELAY_DEVICE_NAME, NULL };
+        run_command(argv);
+    }
+    if (loop_fd >= 0) {
+        ioctl(loop_fd, LOOP_CLR_FD, 0);
+        close(loop_fd);
+    }
+
+    static const char *names[] = {
+        "file.img", "file2.img", "loop.img", "throttled.img", "image.img", "sparse.img", "image.img.gz",
+        "image.img.xz", "image.img.zst", "readback.img", "zeros.img"
+    };
+    size_t i;
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        work_path(names[i], path, sizeof(path));
+        unlink(path);
+    }
+}
+
+static bool run_job(const char *image, const char *device, const char *const *args,
+                    struct mmccopy_progress *progress, char *error, size_t error_len)
+{
+    struct mmccopy_job_options options = { image, device, args, NULL, NULL, NULL };
+    struct mmccopy_job *job = mmccopy_start(&options);
+    if (!job) {
+        snprintf(error, error_len, "%s", strerror(errno));
+        return false;
+    }
+    bool ok = mmccopy_wait(job) == MMCCOPY_SUCCEEDED;
+    mmccopy_poll(job, progress);
+    snprintf(error, error_len, "%s", mmccopy_error(job));
+    mmccopy_free(job);
+    return ok;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void print_json_string(const char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char) *s < ' ')
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+static void run_case(const char *test, const struct bench_device *device, const char *image,
+                     const char *chunk, int depth, int readers, const char *const *extra)
+{
+    // Build "<test>/<device>/b=<chunk>/qd=<depth>" and the job's options
+    char name[128];
+    int len = snprintf(name, sizeof(name), "%s/%s/b=%s/qd=%d", test, device->name, chunk, depth);
+    if (readers)
+        snprintf(name + len, sizeof(name) - len, "/readers=%d", readers);
+
+    char depth_arg[16];
+    char readers_arg[16];
+    char size_arg[32];
+    snprintf(depth_arg, sizeof(depth_arg), "%d", depth);
+    snprintf(readers_arg, sizeof(readers_arg), "%d", readers);
+    snprintf(size_arg, sizeof(size_arg), "%llu", (unsigned long long) image_size);
+
+    const char *args[MAX_CASE_ARGS];
+    int argc = 0;
+    args[argc++] = "-b";
+    args[argc++] = chunk;
+    if (readers) {
+        args[argc++] = "-r";
+        args[argc++] = "-s";
+        args[argc++] = size_arg;
+        args[argc++] = "--readers";
+        args[argc++] = readers_arg;
+    } else {
+        args[argc++] = "--queue-depth";
+        args[argc++] = depth_arg;
+    }
+    for (; extra && *extra; extra++) {
+        if (argc == MAX_CASE_ARGS - 1)
+            errx(EXIT_FAILURE, "%s: too many arguments", name);
+        args[argc++] = *extra;
+    }
+    args[argc] = NULL;
+
+    // Report the median run
+    struct bench_result results[MAX_RUNS];
+    double speeds[MAX_RUNS];
+    int i;
+    int good = 0;
+    char error[256] = "";
+    for (i = 0; i < runs; i++) {
+        struct mmccopy_progress progress;
+        memset(&progress, 0, sizeof(progress));
+        if (!run_job(image, device->path, args, &progress, error, sizeof(error)))
+            break;
+        results[good].mbps = progress.avg_mbps;
+        results[good].p50_ms = progress.p50_ms;
+        results[good].p99_ms = progress.p99_ms;
+        speeds[good++] = progress.avg_mbps;
+    }
+
+    printf("{\"name\":\"%s\",\"test\":\"%s\",\"device\":\"%s\",\"chunk\":\"%s\",\"queue_depth\":%d,"
+           "\"readers\":%d,", name, test, device->name, chunk, depth, readers);
+    if (good < runs) {
+        printf("\"error\":");
+        print_json_string(error[0] ? error : "failed");
+        printf("}\n");
+    } else {
+        qsort(speeds, good, sizeof(double), compare_doubles);
+        double median = speeds[good / 2];
+        const struct bench_result *r = &results[0];
+        for (i = 0; i < good; i++) {
+            if (results[i].mbps == median)
+                r = &results[i];
+        }
+        printf("\"runs\":%d,\"mbps\":%.2f,\"min_mbps\":%.2f,\"max_mbps\":%.2f,\"p50_ms\":%.3f,\"p99_ms\":%.3f}\n",
+               good, median, speeds[0], speeds[good - 1], r->p50_ms, r->p99_ms);
+    }
+    fflush(stdout);
+}
+
+static bool compress_image(const char *image, char *out, size_t len)
+{
+    // Compressed images are made by reading the image back with
+    // --compress, so whichever compressor is built in gets used.
+    static const char *formats[][2] = { { "gzip", "gz" }, { "xz", "xz" }, { "zstd", "zst" } };
+    char size_arg[32];
+    snprintf(size_arg, sizeof(size_arg), "%llu", (unsigned long long) image_size);
+    size_t i;
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "image.img.%s", formats[i][1]);
+        work_path(name, out, len);
+
+        const char *args[] = { "-r", "-s", size_arg, "--compress", formats[i][0], NULL };
+        struct mmccopy_progress progress;
+        char error[256];
+        if (run_job(out, image, args, &progress, error, sizeof(error)))
+            return true;
+        unlink(out);
+    }
+    return false;
+}
+
+static bool same_contents(const char *a, const char *b)
+{
+    int fd_a = open(a, O_RDONLY);
+    int fd_b = open(b, O_RDONLY);
+    char *buffer_a = (char *) malloc(ONE_MiB);
+    char *buffer_b = (char *) malloc(ONE_MiB);
+    bool same = fd_a >= 0 && fd_b >= 0 && buffer_a && buffer_b;
+    while (same) {
+        ssize_t len = read(fd_a, buffer_a, ONE_MiB);
+        same = len >= 0 && read(fd_b, buffer_b, ONE_MiB) == len && memcmp(buffer_a, buffer_b, len) == 0;
+        if (len <= 0)
+            break;
+    }
+    free(buffer_a);
+    free(buffer_b);
+    if (fd_a >= 0)
+        close(fd_a);
+    if (fd_b >= 0)
+        close(fd_b);
+    return same;
+}
+
+static void check_round_trip(const char *test, const char *image, const char *format)
+{
+    // Compress the image with -r --compress, write it back and check
+    // that the same bytes come out. The zero image has runs long enough
+    // that zstd splits them into several RLE frames.
+    char compressed[PATH_MAX];
+    char restored[PATH_MAX];
+    work_path("round-trip.img.cmp", compressed, sizeof(compressed));
+    work_path("round-trip.img", restored, sizeof(restored));
+
+    char size_arg[32];
+    snprintf(size_arg, sizeof(size_arg), "%llu", (unsigned long long) image_size);
+    const char *read_args[] = { "-r", "-s", size_arg, "--compress", format, NULL };
+    const char *write_args[] = { NULL };
+    struct mmccopy_progress progress;
+    char error[256] = "";
+    bool ok = run_job(compressed, image, read_args, &progress, error, sizeof(error));
+    if (ok) {
+        create_file(restored, 0);
+        ok = run_job(compressed, restored, write_args, &progress, error, sizeof(error));
+        if (ok && !same_contents(image, restored)) {
+            snprintf(error, sizeof(error), "The image changed after compressing it with %s", format);
+            ok = false;
+        }
+    }
+    unlink(compressed);
+    unlink(restored);
+
+    printf("{\"name\":\"round-trip/%s/%s\",\"test\":\"round-trip\",\"format\":\"%s\",", test, format, format);
+    if (ok)
+        printf("\"ok\":true}\n");
+    else {
+        printf("\"error\":");
+        print_json_string(error[0] ? error : "failed");
+        printf("}\n");
+    }
+    fflush(stdout);
+}
+
+static void run_benchmarks()
+{
+    static const char *chunks[] = { "128K", "1M", "4M" };
+    static const int depths[] = { 0, 4, 16 };
+    static const char *const sparse[] = { "--sparse", NULL };
+    static const char *formats[] = { "gzip", "xz", "zstd" };
+
+    char image[PATH_MAX];
+    char sparse_image[PATH_MAX];
+    char compressed[PATH_MAX];
+    char readback[PATH_MAX];
+    char zeros[PATH_MAX];
+    work_path("image.img", image, sizeof(image));
+    work_path("sparse.img", sparse_image, sizeof(sparse_image));
+    work_path("readback.img", readback, sizeof(readback));
+    work_path("zeros.img", zeros, sizeof(zeros));
+    create_image(image, image_size, false);
+    create_image(sparse_image, image_size, true);
+    create_file(zeros, image_size);
+    bool have_compressed = compress_image(image, compressed, sizeof(compressed));
+
+    printf("{\"version\":\"%s\",\"size\":%llu,\"runs\":%d}\n", PACKAGE_VERSION,
+           (unsigned long long) image_size, runs);
+
+    size_t j, k;
+    for (j = 0; j < sizeof(formats) / sizeof(formats[0]); j++) {
+        check_round_trip("sparse", sparse_image, formats[j]);
+        check_round_trip("zeros", zeros, formats[j]);
+    }
+
+    // Depth 0 is the read/write pipeline without io_uring
+    int i;
+    for (i = 0; i < device_count; i++) {
+        const struct bench_device *device = &devices[i];
+        if (device->throttled)
+            continue;
+        for (j = 0; j < sizeof(chunks) / sizeof(chunks[0]); j++) {
+            for (k = 0; k < sizeof(depths) / sizeof(depths[0]); k++)
+                run_case("write", device, image, chunks[j], depths[k], 0, NULL);
+        }
+        for (k = 0; k < 2; k++)
+            run_case("sparse", device, sparse_image, "1M", depths[k], 0, sparse);
+        for (k = 0; have_compressed && k < 2; k++)
+            run_case("compressed", device, compressed, "1M", depths[k], 0, NULL);
+    }
+
+    // Read back what the last write left on the memory card
+    for (i = 0; i < device_count; i++) {
+        const struct bench_device *device = &devices[i];
+        if (!device->readable || device->throttled)
+            continue;
+        for (j = 0; j < sizeof(chunks) / sizeof(chunks[0]); j++)
+            run_case("readback", device, readback, chunks[j], 0, 1, NULL);
+        run_case("readback", device, readback, "1M", 0, 4, NULL);
+    }
+
+    // Write two files at once. Several memory cards always use the
+    // read/write pipeline.
+    char second[PATH_MAX];
+    work_path("file2.img", second, sizeof(second));
+    create_file(second, image_size);
+    const char *const fan_out[] = { "-d", second, NULL };
+    for (j = 0; j < sizeof(chunks) / sizeof(chunks[0]); j++)
+        run_case("fan-out", &devices[0], image, chunks[j], 0, 0, fan_out);
+
+    // Slowing down pwrite doesn't affect io_uring, so only the dm-delay
+    // device tries queue depths.
+    for (i = 0; i < device_count; i++) {
+        const struct bench_device *device = &devices[i];
+        if (!device->throttled)
+            continue;
+        char size_arg[32];
+        snprintf(size_arg, sizeof(size_arg), "%d", THROTTLED_SIZE);
+        const char *const small[] = { "-s", size_arg, NULL };
+        for (j = 0; j < 2; j++) {
+            for (k = 0; k < (delay_device ? 2 : 1); k++)
+                run_case("throttled", device, image, chunks[j], delay_device ? depths[k + 1] : 0, 0, small);
+        }
+    }
+}
+
+static char *json_string(const char *line, const char *name, char *out, size_t len)
+{
+    char key[32];
+    snprintf(key, sizeof(key), "\"%s\":\"", name);
+    const char *p = strstr(line, key);
+    if (!p)
+        return NULL;
+    p += strlen(key);
+    const char *end = strchr(p, '"');
+    if (!end || (size_t) (end - p) >= len)
+        return NULL;
+    memcpy(out, p, end - p);
+    out[end - p] = '\0';
+    return out;
+}
+
+static bool json_number(const char *line, const char *name, double *value)
+{
+    char key[32];
+    snprintf(key, sizeof(key), "\"%s\":", name);
+    const char *p = strstr(line, key);
+    if (!p)
+        return false;
+    *value = strtod(p + strlen(key), NULL);
+    return true;
+}
+
+static int compare_results(const char *old_path, const char *new_path)
+{
+    // Print the change in throughput and p99 latency of every case in both
+    // files
+    FILE *old_fp = fopen(old_path, "r");
+    if (!old_fp)
+        err(EXIT_FAILURE, "%s", old_path);
+    FILE *new_fp = fopen(new_path, "r");
+    if (!new_fp)
+        err(EXIT_FAILURE, "%s", new_path);
+
+    printf("%-40s %10s %10s %8s %10s %10s\n", "case", "old MB/s", "new MB/s", "change", "old p99", "new p99");
+    char line[1024];
+    while (fgets(line, sizeof(line), new_fp)) {
+        char name[128];
+        double new_mbps, new_p99;
+        if (!json_string(line, "name", name, sizeof(name)) || !json_number(line, "mbps", &new_mbps) ||
+                !json_number(line, "p99_ms", &new_p99))
+            continue;
+
+        char old_line[1024];
+        char old_name[128];
+        double old_mbps = 0, old_p99 = 0;
+        bool found = false;
+        rewind(old_fp);
+        while (!found && fgets(old_line, sizeof(old_line), old_fp)) {
+            found = json_string(old_line, "name", old_name, sizeof(old_name)) &&
+                    strcmp(name, old_name) == 0 && json_number(old_line, "mbps", &old_mbps) &&
+                    json_number(old_line, "p99_ms", &old_p99);
+        }
+        if (!found)
+            continue;
+
+        double change = old_mbps > 0 ? (new_mbps - old_mbps) / old_mbps * 100 : 0;
+        printf("%-40s %10.2f %10.2f %+7.1f%% %10.3f %10.3f\n", name, old_mbps, new_mbps, change,
+               old_p99, new_p99);
+    }
+    fclose(old_fp);
+    fclose(new_fp);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"compare", no_argument, 0, 'c'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    bool compare = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:n:s:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            compare = true;
+            break;
+        case 'd':
+            work_dir = optarg;
+            break;
+        case 'n':
+            runs = strtol(optarg, NULL, 10);
+            if (runs < 1 || runs > MAX_RUNS)
+                errx(EXIT_FAILURE, "-n must be between 1 and %d", MAX_RUNS);
+            break;
+        case 's':
+            image_size = strtoul(optarg, NULL, 10) * ONE_MiB;
+            if (image_size < THROTTLED_SIZE)
+                errx(EXIT_FAILURE, "-s must be at least %d MiB", THROTTLED_SIZE / ONE_MiB);
+            break;
+        case 'h':
+        default:
+            print_usage(argv[0]);
+            exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if (compare) {
+        if (argc - optind != 2) {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        return compare_results(argv[optind], argv[optind + 1]);
+    }
+
+    if (!work_dir)
+        work_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/var/tmp";
+
+    setup_devices();
+    run_benchmarks();
+    cleanup_devices();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,396 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Frank Hunleth
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+#include "compress.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define COMPRESS_BUFFER_SIZE (256 * 1024)
+
+static bool write_output(struct compressor *c, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t amount_written = write(c->fd, data, len);
+        if (amount_written < 0) {
+            if (errno == EINTR)
+                continue;
+            return fail_errno(c->failure, "write");
+        }
+        data += amount_written;
+        len -= amount_written;
+    }
+    return true;
+}
+
+static int thread_count()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int) count : 1;
+}
+
+#ifdef HAVE_ZLIB
+static bool gzip_deflate(struct compressor *c, const char *data, size_t len, int flush)
+{
+    z_stream *z = (z_stream *) c->state;
+    z->next_in = (Bytef *) data;
+    z->avail_in = len;
+
+    int rc;
+    do {
+        z->next_out = (Bytef *) c->out;
+        z->avail_out = COMPRESS_BUFFER_SIZE;
+        rc = deflate(z, flush);
+        if (rc == Z_STREAM_ERROR)
+            return fail(c->failure, "gzip: compression failed");
+        if (!write_output(c, c->out, COMPRESS_BUFFER_SIZE - z->avail_out))
+            return false;
+    } while (z->avail_in > 0 || z->avail_out == 0 || (flush == Z_FINISH && rc != Z_STREAM_END));
+    return true;
+}
+
+static bool gzip_write(struct compressor *c, const char *data, size_t len)
+{
+    return gzip_deflate(c, data, len, Z_NO_FLUSH);
+}
+
+static bool gzip_finish(struct compressor *c, bool flush)
+{
+    bool ok = !flush || gzip_deflate(c, NULL, 0, Z_FINISH);
+    deflateEnd((z_stream *) c->state);
+    free(c->state);
+    return ok;
+}
+
+static bool gzip_open(struct compressor *c)
+{
+    z_stream *z = (z_stream *) calloc(1, sizeof(z_stream));
+    if (!z || deflateInit2(z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                           Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(z);
+        return fail(c->failure, "gzip: can't initialize compressor");
+    }
+
+    c->state = z;
+    c->write = gzip_write;
+    c->finish = gzip_finish;
+    return true;
+}
+#endif
+
+#ifdef HAVE_LZMA
+static bool xz_code(struct compressor *c, const char *data, size_t len, lzma_action action)
+{
+    lzma_stream *strm = (lzma_stream *) c->state;
+    strm->next_in = (const uint8_t *) data;
+    strm->avail_in = len;
+
+    lzma_ret rc;
+    do {
+        strm->next_out = (uint8_t *) c->out;
+        strm->avail_out = COMPRESS_BUFFER_SIZE;
+        rc = lzma_code(strm, action);
+        if (rc != LZMA_OK && rc != LZMA_STREAM_END)
+            return fail(c->failure, "xz: compression failed (%d)", (int) rc);
+        if (!write_output(c, c->out, COMPRESS_BUFFER_SIZE - strm->avail_out))
+            return false;
+    } while (strm->avail_in > 0 || strm->avail_out == 0 || (action == LZMA_FINISH && rc != LZMA_STREAM_END));
+    return true;
+}
+
+static bool xz_write(struct compressor *c, const char *data, size_t len)
+{
+    return xz_code(c, data, len, LZMA_RUN);
+}
+
+static bool xz_finish(struct compressor *c, bool flush)
+{
+    bool ok = !flush || xz_code(c, NULL, 0, LZMA_FINISH);
+    lzma_end((lzma_stream *) c->state);
+    free(c->state);
+    return ok;
+}
+
+static bool xz_open(struct compressor *c)
+{
+    lzma_stream *strm = (lzma_stream *) calloc(1, sizeof(lzma_stream));
+    lzma_stream init = LZMA_STREAM_INIT;
+    if (!strm)
+        return fail_errno(c->failure, "calloc");
+    *strm = init;
+    lzma_ret rc;
+
+#ifdef HAVE_LZMA_STREAM_ENCODER_MT
+    // Like xz -T0. The blocks can also be decompressed in parallel.
+    lzma_mt mt;
+    memset(&mt, 0, sizeof(mt));
+    mt.threads = thread_count();
+    mt.preset = LZMA_PRESET_DEFAULT;
+    mt.check = LZMA_CHECK_CRC64;
+    rc = lzma_stream_encoder_mt(strm, &mt);
+#else
+    rc = lzma_easy_encoder(strm, LZMA_PRESET_DEFAULT, LZMA_CHECK_CRC64);
+#endif
+    if (rc != LZMA_OK) {
+        lzma_end(strm);
+        free(strm);
+        return fail(c->failure, "xz: can't initialize compressor");
+    }
+
+    c->state = strm;
+    c->write = xz_write;
+    c->finish = xz_finish;
+    return true;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+struct zstd_state
+{
+    ZSTD_CCtx *cctx;
+    bool in_frame;       // Data has been given to the compressor for this frame
+    uint64_t zero_run;   // Zeros waiting to be written as an RLE frame
+};
+
+// A single segment frame's window is its whole content size, and
+// decoders refuse windows over their limit (128 MiB by default), so long
+// zero runs are split into frames of at most this size.
+#define ZSTD_MAX_ZERO_FRAME (8 * 1024 * 1024)
+
+static bool zstd_stream(struct compressor *c, const char *data, size_t len, ZSTD_EndDirective mode)
+{
+    struct zstd_state *z = (struct zstd_state *) c->state;
+    ZSTD_inBuffer in = { data, len, 0 };
+
+    size_t rc;
+    do {
+        ZSTD_outBuffer out = { c->out, COMPRESS_BUFFER_SIZE, 0 };
+        rc = ZSTD_compressStream2(z->cctx, &out, &in, mode);
+        if (ZSTD_isError(rc))
+            return fail(c->failure, "zstd: %s", ZSTD_getErrorName(rc));
+        if (!write_output(c, c->out, out.pos))
+            return false;
+    } while (in.pos < in.size || (mode == ZSTD_e_end && rc != 0));
+    return true;
+}
+
+static bool zstd_write_zero_frame(struct compressor *c, uint64_t len)
+{
+    // Write a frame that's only RLE blocks of zeros without running the
+    // compressor. The frame is a single segment with an 8 byte content
+    // size, so the window is the whole frame and blocks can be up to
+    // 128 KiB.
+    uint8_t *out = (uint8_t *) c->out;
+    size_t pos = 0;
+    int i;
+
+    out[pos++] = 0x28;
+    out[pos++] = 0xb5;
+    out[pos++] = 0x2f;
+    out[pos++] = 0xfd;
+    out[pos++] = 0xe0;  // 8 byte content size, single segment, no checksum
+    for (i = 0; i < 8; i++)
+        out[pos++] = (uint8_t) (len >> (8 * i));
+
+    while (len > 0) {
+        uint32_t block_len = len < 128 * 1024 ? (uint32_t) len : 128 * 1024;
+        len -= block_len;
+
+        // Last block flag, RLE block type (1) and the regenerated size
+        uint32_t header = (len == 0 ? 1 : 0) | (1 << 1) | (block_len << 3);
+        out[pos++] = (uint8_t) header;
+        out[pos++] = (uint8_t) (header >> 8);
+        out[pos++] = (uint8_t) (header >> 16);
+        out[pos++] = 0;  // The byte to repeat
+
+        if (pos + 4 > COMPRESS_BUFFER_SIZE) {
+            if (!write_output(c, c->out, pos))
+                return false;
+            pos = 0;
+        }
+    }
+    return write_output(c, c->out, pos);
+}
+
+static bool zstd_end_frame(struct compressor *c)
+{
+    struct zstd_state *z = (struct zstd_state *) c->state;
+    if (z->in_frame) {
+        if (!zstd_stream(c, NULL, 0, ZSTD_e_end))
+            return false;
+        z->in_frame = false;
+    }
+    while (z->zero_run) {
+        uint64_t len = z->zero_run < ZSTD_MAX_ZERO_FRAME ? z->zero_run : ZSTD_MAX_ZERO_FRAME;
+        if (!zstd_write_zero_frame(c, len))
+            return false;
+        z->zero_run -= len;
+    }
+    return true;
+}
+
+static bool zstd_write(struct compressor *c, const char *data, size_t len)
+{
+    struct zstd_state *z = (struct zstd_state *) c->state;
+    if (z->zero_run && !zstd_end_frame(c))
+        return false;
+    z->in_frame = true;
+    return zstd_stream(c, data, len, ZSTD_e_continue);
+}
+
+static bool zstd_write_zeros(struct compressor *c, size_t len)
+{
+    // Zeros don't go through the compressor. Finish the current frame and
+    // then collect them until the next data.
+    struct zstd_state *z = (struct zstd_state *) c->state;
+    if (z->in_frame && !zstd_end_frame(c))
+        return false;
+    z->zero_run += len;
+    return true;
+}
+
+static bool zstd_finish(struct compressor *c, bool flush)
+{
+    struct zstd_state *z = (struct zstd_state *) c->state;
+    bool ok = !flush || zstd_end_frame(c);
+    ZSTD_freeCCtx(z->cctx);
+    free(z);
+    return ok;
+}
+
+static bool zstd_open(struct compressor *c)
+{
+    struct zstd_state *z = (struct zstd_state *) calloc(1, sizeof(struct zstd_state));
+    if (!z)
+        return fail_errno(c->failure, "calloc");
+    z->cctx = ZSTD_createCCtx();
+    if (!z->cctx) {
+        free(z);
+        return fail(c->failure, "zstd: can't initialize compressor");
+    }
+
+    // This fails harmlessly if libzstd was built without threads
+    ZSTD_CCtx_setParameter(z->cctx, ZSTD_c_nbWorkers, thread_count());
+
+    c->state = z;
+    c->write = zstd_write;
+    c->write_zeros = zstd_write_zeros;
+    c->finish = zstd_finish;
+    return true;
+}
+#endif
+
+struct compressor *compressor_open(int fd, const char *format, struct failure *failure)
+{
+    // Returns NULL after recording an error in failure
+    bool (*open_fn)(struct compressor *) = NULL;
+    const char *name;
+    if (strcmp(format, "gzip") == 0 || strcmp(format, "gz") == 0) {
+        name = "gzip";
+#ifdef HAVE_ZLIB
+        open_fn = gzip_open;
+#endif
+    } else if (strcmp(format, "xz") == 0) {
+        name = "xz";
+#ifdef HAVE_LZMA
+        open_fn = xz_open;
+#endif
+    } else if (strcmp(format, "zstd") == 0 || strcmp(format, "zst") == 0) {
+        name = "zstd";
+#ifdef HAVE_ZSTD
+        open_fn = zstd_open;
+#endif
+    } else {
+        fail(failure, "Unknown compression format '%s'. Use gzip, xz or zstd", format);
+        return NULL;
+    }
+
+    if (!open_fn) {
+        fail(failure, "mmccopy was built without %s support", name);
+        return NULL;
+    }
+
+    struct compressor *c = (struct compressor *) calloc(1, sizeof(struct compressor));
+    if (!c) {
+        fail_errno(failure, "calloc");
+        return NULL;
+    }
+    c->name = name;
+    c->fd = fd;
+    c->failure = failure;
+    c->out = (char *) malloc(COMPRESS_BUFFER_SIZE);
+    if (!c->out) {
+        fail_errno(failure, "malloc");
+        free(c);
+        return NULL;
+    }
+
+    if (!open_fn(c)) {
+        free(c->out);
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+bool compressor_write(struct compressor *c, const char *data, size_t len)
+{
+    return c->write(c, data, len);
+}
+
+bool compressor_write_zeros(struct compressor *c, size_t len)
+{
+    if (c->write_zeros)
+        return c->write_zeros(c, len);
+
+    static const char zeros[64 * 1024];
+    while (len > 0) {
+        size_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+        if (!c->write(c, zeros, n))
+            return false;
+        len -= n;
+    }
+    return true;
+}
+
+bool compressor_finish(struct compressor *c)
+{
+    // Flush everything and free the compressor. Nothing more is written
+    // once the copy has failed since the output is useless by then.
+    bool ok = c->finish(c, !failed(c->failure));
+    free(c->out);
+    free(c);
+    return ok;
+}
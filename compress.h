@@ -0,0 +1,56 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Frank Hunleth
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "failure.h"
+
+// Streaming compression of images read from the memory card. The
+// compressed data is written to fd as it's produced.
+struct compressor
+{
+    const char *name;
+    int fd;
+    struct failure *failure;
+
+    // Compressed data waiting to be written to fd
+    char *out;
+    void *state;
+
+    // These return false after recording an error in failure
+    bool (*write)(struct compressor *c, const char *data, size_t len);
+    // Optional fast path for runs of zeros
+    bool (*write_zeros)(struct compressor *c, size_t len);
+    bool (*finish)(struct compressor *c, bool flush);
+};
+
+struct compressor *compressor_open(int fd, const char *format, struct failure *failure);
+bool compressor_write(struct compressor *c, const char *data, size_t len);
+bool compressor_write_zeros(struct compressor *c, size_t len);
+bool compressor_finish(struct compressor *c);
+
+#endif // COMPRESS_H
@@ -0,0 +1,426 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Frank Hunleth
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+#include "decompress.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define DECOMPRESS_BUFFER_SIZE (256 * 1024)
+
+static const uint8_t gzip_magic[] = {0x1f, 0x8b};
+static const uint8_t xz_magic[] = {0xfd, '7', 'z', 'X', 'Z', 0x00};
+static const uint8_t zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+static bool fill_input(struct decompressor *d)
+{
+    ssize_t amount_read;
+    do {
+        amount_read = read(d->fd, d->in, DECOMPRESS_BUFFER_SIZE);
+    } while (amount_read < 0 && errno == EINTR);
+
+    if (amount_read < 0)
+        return fail_errno(d->failure, "read");
+
+    d->in_len = amount_read;
+    d->in_eof = (amount_read == 0);
+    return true;
+}
+
+#ifdef HAVE_ZLIB
+static ssize_t gzip_read(struct decompressor *d, char *out, size_t len)
+{
+    z_stream *z = (z_stream *) d->state;
+    z->next_out = (Bytef *) out;
+    z->avail_out = len;
+
+    while (z->avail_out > 0 && !d->done) {
+        if (z->avail_in == 0 && !d->in_eof) {
+            if (!fill_input(d))
+                return -1;
+            z->next_in = (Bytef *) d->in;
+            z->avail_in = d->in_len;
+        }
+
+        uInt avail_out = z->avail_out;
+        int rc = inflate(z, Z_NO_FLUSH);
+        if (rc == Z_STREAM_END) {
+            // gzip files can have several members back to back
+            d->end_of_frame = true;
+            if (inflateReset(z) != Z_OK) {
+                fail(d->failure, "gzip: inflateReset failed");
+                return -1;
+            }
+        } else if (rc == Z_OK) {
+            d->end_of_frame = false;
+        } else if (rc == Z_BUF_ERROR && d->in_eof && z->avail_in == 0 && avail_out == z->avail_out) {
+            // Nothing left
+            if (!d->end_of_frame) {
+                fail(d->failure, "gzip: unexpected end of file");
+                return -1;
+            }
+            d->done = true;
+        } else if (rc != Z_BUF_ERROR) {
+            fail(d->failure, "gzip: %s", z->msg ? z->msg : "corrupt input");
+            return -1;
+        }
+    }
+    return len - z->avail_out;
+}
+
+static void gzip_free(struct decompressor *d)
+{
+    inflateEnd((z_stream *) d->state);
+    free(d->state);
+}
+
+static bool gzip_open(struct decompressor *d, uint64_t *uncompressed_size)
+{
+    (void) uncompressed_size;
+
+    z_stream *z = (z_stream *) calloc(1, sizeof(z_stream));
+    if (!z || inflateInit2(z, 16 + MAX_WBITS) != Z_OK) {
+        free(z);
+        return fail(d->failure, "gzip: can't initialize decompressor");
+    }
+
+    d->state = z;
+    d->read = gzip_read;
+    d->free = gzip_free;
+
+    // The gzip trailer only has the size of the last member modulo 4 GiB,
+    // so the uncompressed size isn't known ahead of time.
+    return true;
+}
+#endif
+
+#ifdef HAVE_LZMA
+static ssize_t xz_read(struct decompressor *d, char *out, size_t len)
+{
+    lzma_stream *strm = (lzma_stream *) d->state;
+    strm->next_out = (uint8_t *) out;
+    strm->avail_out = len;
+
+    while (strm->avail_out > 0 && !d->done) {
+        if (strm->avail_in == 0 && !d->in_eof) {
+            if (!fill_input(d))
+                return -1;
+            strm->next_in = (uint8_t *) d->in;
+            strm->avail_in = d->in_len;
+        }
+
+        lzma_ret rc = lzma_code(strm, d->in_eof ? LZMA_FINISH : LZMA_RUN);
+        if (rc == LZMA_STREAM_END)
+            d->done = true;
+        else if (rc == LZMA_BUF_ERROR) {
+            fail(d->failure, "xz: unexpected end of file");
+            return -1;
+        } else if (rc != LZMA_OK) {
+            fail(d->failure, "xz: decompression failed (error %d)", (int) rc);
+            return -1;
+        }
+    }
+    return len - strm->avail_out;
+}
+
+static void xz_free(struct decompressor *d)
+{
+    lzma_end((lzma_stream *) d->state);
+    free(d->state);
+}
+
+static void xz_uncompressed_size(int fd, uint64_t *uncompressed_size)
+{
+#ifdef HAVE_LZMA_FILE_INFO_DECODER
+    // The index at the end of the file has the uncompressed size. The
+    // file info decoder asks for the parts of the file that it needs.
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+        return;
+
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_index *index = NULL;
+    if (lzma_file_info_decoder(&strm, &index, UINT64_MAX, st.st_size) != LZMA_OK)
+        return;
+
+    uint8_t buffer[8192];
+    off_t pos = 0;
+    for (;;) {
+        if (strm.avail_in == 0) {
+            ssize_t amount_read = pread(fd, buffer, sizeof(buffer), pos);
+            if (amount_read <= 0)
+                break;
+            strm.next_in = buffer;
+            strm.avail_in = amount_read;
+            pos += amount_read;
+        }
+
+        lzma_ret rc = lzma_code(&strm, LZMA_RUN);
+        if (rc == LZMA_SEEK_NEEDED) {
+            pos = strm.seek_pos;
+            strm.avail_in = 0;
+        } else if (rc == LZMA_STREAM_END) {
+            *uncompressed_size = lzma_index_uncompressed_size(index);
+            lzma_index_end(index, NULL);
+            break;
+        } else if (rc != LZMA_OK)
+            break;
+    }
+    lzma_end(&strm);
+#endif
+}
+
+static bool xz_open(struct decompressor *d, uint64_t *uncompressed_size)
+{
+    lzma_stream *strm = (lzma_stream *) calloc(1, sizeof(lzma_stream));
+    lzma_stream init = LZMA_STREAM_INIT;
+    if (!strm)
+        return fail_errno(d->failure, "calloc");
+    *strm = init;
+    lzma_ret rc;
+
+#ifdef HAVE_LZMA_STREAM_DECODER_MT
+    // Files compressed with xz -T have independent blocks that can be
+    // decompressed in parallel.
+    lzma_mt mt;
+    memset(&mt, 0, sizeof(mt));
+    mt.flags = LZMA_CONCATENATED;
+    mt.threads = lzma_cputhreads();
+    if (mt.threads == 0)
+        mt.threads = 1;
+    mt.memlimit_threading = lzma_physmem() / 4;
+    mt.memlimit_stop = UINT64_MAX;
+    rc = lzma_stream_decoder_mt(strm, &mt);
+#else
+    rc = lzma_stream_decoder(strm, UINT64_MAX, LZMA_CONCATENATED);
+#endif
+    if (rc != LZMA_OK) {
+        lzma_end(strm);
+        free(strm);
+        return fail(d->failure, "xz: can't initialize decompressor");
+    }
+
+    d->state = strm;
+    d->read = xz_read;
+    d->free = xz_free;
+
+    xz_uncompressed_size(d->fd, uncompressed_size);
+    return true;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+struct zstd_state
+{
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer in;
+    bool flushing;
+};
+
+static ssize_t zstd_read(struct decompressor *d, char *out, size_t len)
+{
+    struct zstd_state *z = (struct zstd_state *) d->state;
+    ZSTD_outBuffer output = { out, len, 0 };
+
+    while (output.pos < output.size && !d->done) {
+        // When the output fills up, the decoder may still have data
+        // buffered, so call it again even without new input.
+        if (z->in.pos == z->in.size && !z->flushing) {
+            if (!d->in_eof && !fill_input(d))
+                return -1;
+            if (d->in_eof) {
+                if (!d->end_of_frame) {
+                    fail(d->failure, "zstd: unexpected end of file");
+                    return -1;
+                }
+                d->done = true;
+                break;
+            }
+            z->in.src = d->in;
+            z->in.size = d->in_len;
+            z->in.pos = 0;
+        }
+
+        size_t in_pos = z->in.pos;
+        size_t out_pos = output.pos;
+        size_t rc = ZSTD_decompressStream(z->dctx, &output, &z->in);
+        if (ZSTD_isError(rc)) {
+            fail(d->failure, "zstd: %s", ZSTD_getErrorName(rc));
+            return -1;
+        }
+
+        // 0 means that a frame was completely decoded and flushed. A call
+        // that only checked for buffered output after a frame ended
+        // returns the size of the next frame's header instead.
+        if (z->in.pos != in_pos || output.pos != out_pos)
+            d->end_of_frame = (rc == 0);
+        z->flushing = (output.pos == output.size);
+    }
+    return output.pos;
+}
+
+static void zstd_free(struct decompressor *d)
+{
+    struct zstd_state *z = (struct zstd_state *) d->state;
+    ZSTD_freeDCtx(z->dctx);
+    free(z);
+}
+
+static bool zstd_open(struct decompressor *d, uint64_t *uncompressed_size)
+{
+    // libzstd doesn't have a multithreaded decoder, but decompression
+    // runs on the reader thread, so it overlaps with the writes.
+    struct zstd_state *z = (struct zstd_state *) calloc(1, sizeof(struct zstd_state));
+    if (!z)
+        return fail_errno(d->failure, "calloc");
+    z->dctx = ZSTD_createDCtx();
+    if (!z->dctx) {
+        free(z);
+        return fail(d->failure, "zstd: can't initialize decompressor");
+    }
+
+    d->state = z;
+    d->read = zstd_read;
+    d->free = zstd_free;
+
+    // Add up the content sizes in the frame headers. Files written by
+    // pzstd or zstd --adapt have several frames.
+    struct stat st;
+    if (fstat(d->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, d->fd, 0);
+        if (map != MAP_FAILED) {
+            const char *p = (const char *) map;
+            size_t left = st.st_size;
+            uint64_t total = 0;
+            while (left > 0) {
+                unsigned long long size = ZSTD_getFrameContentSize(p, left);
+                size_t frame_len = ZSTD_findFrameCompressedSize(p, left);
+                if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR ||
+                        ZSTD_isError(frame_len))
+                    break;
+
+                total += size;
+                p += frame_len;
+                left -= frame_len;
+            }
+            if (left == 0)
+                *uncompressed_size = total;
+            munmap(map, st.st_size);
+        }
+    }
+    return true;
+}
+#endif
+
+struct decompressor *decompressor_open(int fd, uint64_t *uncompressed_size, struct failure *failure)
+{
+    // Look for a compressed image based on the magic bytes at the start
+    // of the file. Returns NULL if the file isn't compressed or on errors,
+    // which are recorded in failure. The uncompressed size is left alone
+    // in that case and set to 0 if it isn't known.
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+        return NULL;
+
+    uint8_t magic[6];
+    ssize_t len = pread(fd, magic, sizeof(magic), 0);
+    if (len < 0) {
+        fail_errno(failure, "read");
+        return NULL;
+    }
+
+    const char *name = NULL;
+    bool (*open_fn)(struct decompressor *, uint64_t *) = NULL;
+    if (len >= (ssize_t) sizeof(gzip_magic) && memcmp(magic, gzip_magic, sizeof(gzip_magic)) == 0) {
+        name = "gzip";
+#ifdef HAVE_ZLIB
+        open_fn = gzip_open;
+#endif
+    } else if (len >= (ssize_t) sizeof(xz_magic) && memcmp(magic, xz_magic, sizeof(xz_magic)) == 0) {
+        name = "xz";
+#ifdef HAVE_LZMA
+        open_fn = xz_open;
+#endif
+    } else if (len >= (ssize_t) sizeof(zstd_magic) && memcmp(magic, zstd_magic, sizeof(zstd_magic)) == 0) {
+        name = "zstd";
+#ifdef HAVE_ZSTD
+        open_fn = zstd_open;
+#endif
+    } else
+        return NULL;
+
+    if (!open_fn) {
+        fail(failure, "Image is %s compressed, but mmccopy was built without %s support.\n"
+             "Pipe it through a decompressor or rerun with --no-decompress", name, name);
+        return NULL;
+    }
+
+    struct decompressor *d = (struct decompressor *) calloc(1, sizeof(struct decompressor));
+    if (!d) {
+        fail_errno(failure, "calloc");
+        return NULL;
+    }
+    d->name = name;
+    d->fd = fd;
+    d->failure = failure;
+    d->in = (char *) malloc(DECOMPRESS_BUFFER_SIZE);
+    if (!d->in) {
+        fail_errno(failure, "malloc");
+        free(d);
+        return NULL;
+    }
+
+    *uncompressed_size = 0;
+    if (!open_fn(d, uncompressed_size)) {
+        free(d->in);
+        free(d);
+        return NULL;
+    }
+    return d;
+}
+
+ssize_t decompressor_read(struct decompressor *d, char *out, size_t len)
+{
+    return d->read(d, out, len);
+}
+
+void decompressor_free(struct decompressor *d)
+{
+    d->free(d);
+    free(d->in);
+    free(d);
+}
@@ -0,0 +1,61 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Frank Hunleth
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "failure.h"
+
+// Streaming decompression of gzip, xz and zstd images. The decompressed
+// data goes straight into the caller's buffer.
+struct decompressor
+{
+    const char *name;
+    int fd;
+    struct failure *failure;
+
+    // Compressed data read from fd
+    char *in;
+    size_t in_len;
+    bool in_eof;
+
+    bool end_of_frame;  // The last compressed frame or member was complete
+    bool done;
+    void *state;
+
+    // Fill out with up to len decompressed bytes. Returns the number of
+    // bytes, which is only less than len at the end of the stream, or -1
+    // after recording an error in failure.
+    ssize_t (*read)(struct decompressor *d, char *out, size_t len);
+    void (*free)(struct decompressor *d);
+};
+
+struct decompressor *decompressor_open(int fd, uint64_t *uncompressed_size, struct failure *failure);
+ssize_t decompressor_read(struct decompressor *d, char *out, size_t len);
+void decompressor_free(struct decompressor *d);
+
+#endif // DECOMPRESS_H
@@ -0,0 +1,287 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Frank Hunleth
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+#include "emmc.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <linux/fs.h>
+#include <linux/mmc/ioctl.h>
+
+// Only the commands that mmccopy uses. The response flags are the same as
+// the kernel's, which aren't exported to user space.
+#define MMC_SEND_STATUS 13
+#define MMC_SET_BLOCK_COUNT 23
+#define MMC_WRITE_MULTIPLE_BLOCK 25
+#define MMC_ERASE_GROUP_START 35
+#define MMC_ERASE_GROUP_END 36
+#define MMC_ERASE 38
+
+#define MMC_RSP_PRESENT (1 << 0)
+#define MMC_RSP_CRC (1 << 2)
+#define MMC_RSP_BUSY (1 << 3)
+#define MMC_RSP_OPCODE (1 << 4)
+#define MMC_CMD_AC (0 << 5)
+#define MMC_CMD_ADTC (1 << 5)
+#define MMC_RSP_R1 (MMC_RSP_PRESENT | MMC_RSP_CRC | MMC_RSP_OPCODE)
+#define MMC_RSP_R1B (MMC_RSP_R1 | MMC_RSP_BUSY)
+
+#define MMC_DISCARD_ARG 0x00000003
+#define MMC_STATUS_READY_FOR_DATA (1 << 8)
+#define MMC_STATUS_STATE(status) (((status) >> 9) & 0xf)
+#define MMC_STATE_TRAN 4
+
+// The kernel always gives eMMC devices a relative address of 1
+#define EMMC_RCA 1
+
+#define EMMC_MAX_PAIRS (MMC_IOC_MAX_CMDS / 2)
+#define EMMC_MAX_DISCARD (1024ULL * 1024 * 1024)
+#define EMMC_ERASE_TIMEOUT_MS (60 * 1000)
+#define EMMC_READY_TIMEOUT_US (10 * 1000 * 1000)
+#define EMMC_READY_POLL_US 100
+#define EMMC_BYTE_ADDRESS_LIMIT (2ULL * 1024 * 1024 * 1024)
+#define MMC_OCR_SECTOR_MODE (1U << 30)
+
+static bool is_emmc(int fd)
+{
+    // Commands can only be sent to whole devices and boot partitions,
+    // which are the ones with a device directory. Partitions don't have
+    // one.
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISBLK(st.st_mode))
+        return false;
+
+    char path[160];
+    char type[16];
+    sprintf(path, "/sys/dev/block/%u:%u/device/type", major(st.st_rdev), minor(st.st_rdev));
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return false;
+    bool ok = (fgets(type, sizeof(type), fp) != NULL);
+    fclose(fp);
+    return ok && strcmp(type, "MMC\n") == 0;
+}
+
+static bool read_attribute(const char *path, char *out, size_t len)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return false;
+    bool ok = (fgets(out, len, fp) != NULL);
+    fclose(fp);
+    return ok;
+}
+
+static int card_byte_addressing(const char *card_dir)
+{
+    // Cards up to 2 GiB are addressed in bytes and bigger ones in blocks.
+    // This is about the whole card, so boot partitions, which are only a
+    // few MiB, can't go by their own size. The biggest block device of
+    // the card is the user area, which is what the kernel decides from
+    // too. The sector mode bit of the OCR is the fallback if there's no
+    // block directory. Returns -1 if neither is there.
+    char path[PATH_MAX];
+    char value[32];
+    uint64_t biggest = 0;
+    snprintf(path, sizeof(path), "%s/block", card_dir);
+    DIR *dir = opendir(path);
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.')
+                continue;
+            snprintf(path, sizeof(path), "%s/block/%s/size", card_dir, entry->d_name);
+            if (read_attribute(path, value, sizeof(value))) {
+                uint64_t size = strtoull(value, NULL, 10) * 512;
+                if (size > biggest)
+                    biggest = size;
+            }
+        }
+        closedir(dir);
+    }
+    if (biggest)
+        return biggest <= EMMC_BYTE_ADDRESS_LIMIT;
+
+    snprintf(path, sizeof(path), "%s/ocr", card_dir);
+    if (read_attribute(path, value, sizeof(value)))
+        return (strtoul(value, NULL, 16) & MMC_OCR_SECTOR_MODE) == 0;
+    return -1;
+}
+
+struct emmc *emmc_open(int fd)
+{
+    // Returns NULL with errno set if fd isn't an eMMC device that can be
+    // written with commands.
+    int block_size;
+    struct stat st;
+    if (!is_emmc(fd) || ioctl(fd, BLKSSZGET, &block_size) || block_size != EMMC_BLOCK_SIZE ||
+            fstat(fd, &st)) {
+        errno = ENOTTY;
+        return NULL;
+    }
+
+    char card_dir[64];
+    sprintf(card_dir, "/sys/dev/block/%u:%u/device", major(st.st_rdev), minor(st.st_rdev));
+    int byte_addressing = card_byte_addressing(card_dir);
+    if (byte_addressing < 0) {
+        errno = ENOTTY;
+        return NULL;
+    }
+
+    struct emmc *e = (struct emmc *) calloc(1, sizeof(struct emmc));
+    if (!e)
+        return NULL;
+    e->fd = fd;
+    e->byte_addressing = byte_addressing;
+    return e;
+}
+
+static uint32_t emmc_address(const struct emmc *e, uint64_t offset)
+{
+    return (uint32_t) (e->byte_addressing ? offset : offset / EMMC_BLOCK_SIZE);
+}
+
+static bool emmc_wait_ready(const struct emmc *e)
+{
+    // Wait for the card to finish programming and go back to the
+    // transfer state so that the next command isn't rejected.
+    unsigned int waited;
+    for (waited = 0; waited < EMMC_READY_TIMEOUT_US; waited += EMMC_READY_POLL_US) {
+        struct mmc_ioc_cmd cmd;
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = MMC_SEND_STATUS;
+        cmd.arg = EMMC_RCA << 16;
+        cmd.flags = MMC_RSP_R1 | MMC_CMD_AC;
+        if (ioctl(e->fd, MMC_IOC_CMD, &cmd))
+            return false;
+
+        uint32_t status = cmd.response[0];
+        if ((status & MMC_STATUS_READY_FOR_DATA) && MMC_STATUS_STATE(status) == MMC_STATE_TRAN)
+            return true;
+        usleep(EMMC_READY_POLL_US);
+    }
+    errno = ETIMEDOUT;
+    return false;
+}
+
+bool emmc_write(const struct emmc *e, const char *data, size_t len, off_t offset)
+{
+    // Each CMD25 moves up to MMC_IOC_MAX_BYTES and is preceded by a CMD23
+    // with the block count, so there's no CMD12 and reliable write stays
+    // off. As many pairs as fit go in one ioctl. Returns false with errno
+    // set on failure.
+    if (len % EMMC_BLOCK_SIZE || offset % EMMC_BLOCK_SIZE) {
+        errno = EINVAL;
+        return false;
+    }
+
+    struct mmc_ioc_multi_cmd *multi = (struct mmc_ioc_multi_cmd *)
+        calloc(1, sizeof(struct mmc_ioc_multi_cmd) + 2 * EMMC_MAX_PAIRS * sizeof(struct mmc_ioc_cmd));
+    if (!multi)
+        return false;
+
+    bool ok = true;
+    while (ok && len > 0) {
+        int pairs = 0;
+        memset(multi->cmds, 0, 2 * EMMC_MAX_PAIRS * sizeof(struct mmc_ioc_cmd));
+        while (len > 0 && pairs < EMMC_MAX_PAIRS) {
+            size_t n = len < (size_t) MMC_IOC_MAX_BYTES ? len : (size_t) MMC_IOC_MAX_BYTES;
+            struct mmc_ioc_cmd *count = &multi->cmds[2 * pairs];
+            struct mmc_ioc_cmd *write = &multi->cmds[2 * pairs + 1];
+
+            count->opcode = MMC_SET_BLOCK_COUNT;
+            count->arg = n / EMMC_BLOCK_SIZE;
+            count->flags = MMC_RSP_R1 | MMC_CMD_AC;
+
+            write->write_flag = 1;
+            write->opcode = MMC_WRITE_MULTIPLE_BLOCK;
+            write->arg = emmc_address(e, offset);
+            write->flags = MMC_RSP_R1 | MMC_CMD_ADTC;
+            write->blksz = EMMC_BLOCK_SIZE;
+            write->blocks = n / EMMC_BLOCK_SIZE;
+            mmc_ioc_cmd_set_data((*write), data);
+
+            data += n;
+            offset += n;
+            len -= n;
+            pairs++;
+        }
+        multi->num_of_cmds = 2 * pairs;
+        ok = ioctl(e->fd, MMC_IOC_MULTI_CMD, multi) == 0 && emmc_wait_ready(e);
+    }
+    free(multi);
+    return ok;
+}
+
+bool emmc_discard(const struct emmc *e, uint64_t start, uint64_t len)
+{
+    // Send DISCARD with CMD35, CMD36 and CMD38 in pieces so that each one
+    // finishes within the timeout. Only whole blocks are discarded.
+    uint64_t end = (start + len) & ~(uint64_t) (EMMC_BLOCK_SIZE - 1);
+    start = (start + EMMC_BLOCK_SIZE - 1) & ~(uint64_t) (EMMC_BLOCK_SIZE - 1);
+
+    struct mmc_ioc_multi_cmd *multi = (struct mmc_ioc_multi_cmd *)
+        calloc(1, sizeof(struct mmc_ioc_multi_cmd) + 3 * sizeof(struct mmc_ioc_cmd));
+    if (!multi)
+        return false;
+
+    bool ok = true;
+    while (ok && start < end) {
+        uint64_t n = end - start < EMMC_MAX_DISCARD ? end - start : EMMC_MAX_DISCARD;
+        memset(multi->cmds, 0, 3 * sizeof(struct mmc_ioc_cmd));
+        multi->num_of_cmds = 3;
+
+        multi->cmds[0].opcode = MMC_ERASE_GROUP_START;
+        multi->cmds[0].arg = emmc_address(e, start);
+        multi->cmds[0].flags = MMC_RSP_R1 | MMC_CMD_AC;
+
+        multi->cmds[1].opcode = MMC_ERASE_GROUP_END;
+        multi->cmds[1].arg = emmc_address(e, start + n - EMMC_BLOCK_SIZE);
+        multi->cmds[1].flags = MMC_RSP_R1 | MMC_CMD_AC;
+
+        multi->cmds[2].opcode = MMC_ERASE;
+        multi->cmds[2].arg = MMC_DISCARD_ARG;
+        multi->cmds[2].flags = MMC_RSP_R1B | MMC_CMD_AC;
+        multi->cmds[2].cmd_timeout_ms = EMMC_ERASE_TIMEOUT_MS;
+
+        ok = ioctl(e->fd, MMC_IOC_MULTI_CMD, multi) == 0 && emmc_wait_ready(e);
+        start += n;
+    }
+    free(multi);
+    return ok;
+}
+
+void emmc_free(struct emmc *e)
+{
+    free(e);
+}
@@ -0,0 +1,48 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Frank Hunleth
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef EMMC_H
+#define EMMC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define EMMC_BLOCK_SIZE 512
+
+// Raw access to eMMC devices with MMC_IOC_MULTI_CMD. Writes are sent as
+// CMD23 and CMD25 pairs so that they don't go through the block layer.
+struct emmc
+{
+    int fd;
+    bool byte_addressing;   // Cards up to 2 GiB are addressed in bytes. This is
+                            // for the whole card, even on a boot partition.
+};
+
+struct emmc *emmc_open(int fd);
+bool emmc_write(const struct emmc *e, const char *data, size_t len, off_t offset);
+bool emmc_discard(const struct emmc *e, uint64_t start, uint64_t len);
+void emmc_free(struct emmc *e);
+
+#endif // EMMC_H
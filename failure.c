@@ -0,0 +1,69 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Frank Hunleth
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+#include "failure.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+static bool record(struct failure *f, int error, const char *fmt, va_list ap)
+{
+    // Claim the failure before writing the message so that two threads
+    // can't both write it.
+    if (__atomic_exchange_n(&f->set, 1, __ATOMIC_ACQ_REL))
+        return false;
+
+    vsnprintf(f->message, sizeof(f->message), fmt, ap);
+    if (error) {
+        size_t len = strlen(f->message);
+        snprintf(f->message + len, sizeof(f->message) - len, ": %s", strerror(error));
+    }
+    return false;
+}
+
+bool fail(struct failure *f, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    record(f, 0, fmt, ap);
+    va_end(ap);
+    return false;
+}
+
+bool fail_errno(struct failure *f, const char *fmt, ...)
+{
+    int error = errno;
+    va_list ap;
+    va_start(ap, fmt);
+    record(f, error, fmt, ap);
+    va_end(ap);
+    errno = error;
+    return false;
+}
+
+bool failed(const struct failure *f)
+{
+    return __atomic_load_n(&f->set, __ATOMIC_ACQUIRE) != 0;
+}
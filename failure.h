@@ -0,0 +1,49 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Frank Hunleth
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FAILURE_H
+#define FAILURE_H
+
+#include <stdbool.h>
+
+// The first error of a copy. Code that can fail records what went wrong
+// here and returns instead of exiting, so that the copy can be cleaned up
+// and the error reported by whoever started it. Errors can be recorded
+// from any thread. Only the first one is kept since the others are
+// usually caused by it.
+struct failure
+{
+    int set;
+    char message[512];
+};
+
+// Record an error like errx(3) does. Always returns false.
+bool fail(struct failure *f, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Record an error like err(3) does with errno appended. Always returns false.
+bool fail_errno(struct failure *f, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Return true if an error was recorded. The message is complete once the
+// threads that might record one have been joined.
+bool failed(const struct failure *f);
+
+#endif // FAILURE_H
@@ -0,0 +1,201 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Frank Hunleth
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+#include "http.h"
+
+#ifdef HAVE_LIBCURL
+#include <curl/curl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HTTP_RETRIES 3
+#define HTTP_RETRY_DELAY_US (500 * 1000)
+
+struct http_source
+{
+    const char *url;
+    uint64_t size;
+    struct failure *failure;
+    CURL **handles;     // One per connection
+    int connections;
+};
+
+struct http_buffer
+{
+    char *data;
+    size_t len;
+    size_t pos;
+};
+
+static size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    // Returning less than what was received aborts the transfer, so a
+    // server that sends more than the range fails instead of overflowing.
+    struct http_buffer *b = (struct http_buffer *) userdata;
+    size_t n = size * nmemb;
+    if (n > b->len - b->pos)
+        return 0;
+    memcpy(b->data + b->pos, ptr, n);
+    b->pos += n;
+    return n;
+}
+
+static int progress_callback(void *userdata, curl_off_t dltotal, curl_off_t dlnow,
+                             curl_off_t ultotal, curl_off_t ulnow)
+{
+    // Abort transfers once the copy has failed or was canceled
+    (void) dltotal;
+    (void) dlnow;
+    (void) ultotal;
+    (void) ulnow;
+    return failed(((struct http_source *) userdata)->failure);
+}
+
+static CURL *new_handle(struct http_source *h)
+{
+    CURL *curl = curl_easy_init();
+    if (!curl)
+        return NULL;
+    curl_easy_setopt(curl, CURLOPT_URL, h->url);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progress_callback);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, h);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    return curl;
+}
+
+struct http_source *http_open(const char *url, int connections, uint64_t *size, struct failure *failure)
+{
+    // Returns NULL after recording an error in failure
+    if (curl_global_init(CURL_GLOBAL_DEFAULT)) {
+        fail(failure, "Can't initialize libcurl");
+        return NULL;
+    }
+
+    struct http_source *h = (struct http_source *) calloc(1, sizeof(struct http_source));
+    if (!h) {
+        fail_errno(failure, "calloc");
+        curl_global_cleanup();
+        return NULL;
+    }
+    h->url = url;
+    h->failure = failure;
+    h->handles = (CURL **) calloc(connections, sizeof(CURL *));
+    if (!h->handles) {
+        fail_errno(failure, "calloc");
+        http_close(h);
+        return NULL;
+    }
+    for (; h->connections < connections; h->connections++) {
+        h->handles[h->connections] = new_handle(h);
+        if (!h->handles[h->connections]) {
+            fail(failure, "Can't initialize libcurl");
+            http_close(h);
+            return NULL;
+        }
+    }
+
+    // Ask for the size with a HEAD request
+    CURL *curl = h->handles[0];
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    CURLcode rc = curl_easy_perform(curl);
+    curl_off_t length = -1;
+    if (rc == CURLE_OK)
+        curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+    if (rc != CURLE_OK || length < 0) {
+        if (rc != CURLE_OK)
+            fail(failure, "%s: %s", url, curl_easy_strerror(rc));
+        else
+            fail(failure, "%s: The server didn't report the size of the image", url);
+        http_close(h);
+        return NULL;
+    }
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 0L);
+    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+
+    h->size = length;
+    *size = h->size;
+    return h;
+}
+
+ssize_t http_fill(void *ctx, int worker, char *buffer, size_t len, uint64_t offset)
+{
+    struct http_source *h = (struct http_source *) ctx;
+    if (offset >= h->size)
+        return 0;
+    if (len > h->size - offset)
+        len = h->size - offset;
+
+    char range[48];
+    snprintf(range, sizeof(range), "%llu-%llu", (unsigned long long) offset,
+             (unsigned long long) (offset + len - 1));
+
+    // Retry a few times since a dropped connection is common on long
+    // downloads and only costs this range.
+    CURL *curl = h->handles[worker];
+    int attempt;
+    for (attempt = 0; ; attempt++) {
+        struct http_buffer b = {buffer, len, 0};
+        curl_easy_setopt(curl, CURLOPT_RANGE, range);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &b);
+        CURLcode rc = curl_easy_perform(curl);
+
+        long status = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        if (status == 200 && !(offset == 0 && len == h->size)) {
+            fail(h->failure, "%s: The server doesn't support range requests", h->url);
+            return -1;
+        }
+        if (rc == CURLE_OK && b.pos == len)
+            return len;
+        if (rc == CURLE_ABORTED_BY_CALLBACK)
+            return -1;
+
+        if (attempt == HTTP_RETRIES) {
+            if (rc == CURLE_OK)
+                fail(h->failure, "%s: Short read at offset %llu", h->url, (unsigned long long) offset);
+            else
+                fail(h->failure, "%s: %s", h->url, curl_easy_strerror(rc));
+            return -1;
+        }
+        usleep(HTTP_RETRY_DELAY_US);
+    }
+}
+
+void http_close(struct http_source *h)
+{
+    int i;
+    for (i = 0; i < h->connections; i++)
+        curl_easy_cleanup(h->handles[i]);
+    free(h->handles);
+    free(h);
+    curl_global_cleanup();
+}
+
+#endif // HAVE_LIBCURL
@@ -0,0 +1,335 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Frank Hunleth
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+#include "libmmccopy.h"
+#include "mmccopy.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_JOB_ARGS 64
+
+struct mmccopy_job
+{
+    struct copy_context *copy;
+    char *argv[MAX_JOB_ARGS];   // Copies of the options passed to mmccopy_start
+    int argc;
+
+    mmccopy_progress_fn progress_fn;
+    mmccopy_done_fn done_fn;
+    void *ctx;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct mmccopy_progress progress;
+    enum mmccopy_state state;
+    bool canceled;
+    bool finished;          // The done callback has returned
+    char error[sizeof(((struct failure *) 0)->message)];
+
+    struct mmccopy_job *next;   // Next job waiting for a thread
+};
+
+// Jobs run on a pool of threads that's shared by the whole process. A
+// thread is started when a job is queued and none are idle, and it waits
+// for the next job when its copy is done.
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct mmccopy_job *head;   // Jobs waiting for a thread
+    struct mmccopy_job *tail;
+    int idle;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0 };
+
+static void job_progress(const struct mmccopy_progress *progress, void *arg)
+{
+    struct mmccopy_job *job = (struct mmccopy_job *) arg;
+    pthread_mutex_lock(&job->lock);
+    job->progress = *progress;
+    pthread_mutex_unlock(&job->lock);
+
+    if (job->progress_fn)
+        job->progress_fn(job, progress, job->ctx);
+}
+
+static void run_job(struct mmccopy_job *job)
+{
+    // Errors are returned by the engine, so a job that fails only ends
+    // itself.
+    bool ok = false;
+    copy_set_progress_callback(job->copy, job_progress, job);
+    enum copy_parse_result parsed = copy_parse_options(job->copy, job->argc, job->argv);
+    if (parsed == COPY_PARSE_RUN)
+        ok = copy_run(job->copy);
+
+    pthread_mutex_lock(&job->lock);
+    if (ok)
+        job->state = MMCCOPY_SUCCEEDED;
+    else if (job->canceled)
+        job->state = MMCCOPY_CANCELED;
+    else {
+        job->state = MMCCOPY_FAILED;
+        snprintf(job->error, sizeof(job->error), "%s", copy_error(job->copy));
+    }
+    enum mmccopy_state state = job->state;
+    pthread_mutex_unlock(&job->lock);
+
+    if (job->done_fn)
+        job->done_fn(job, state, job->ctx);
+
+    pthread_mutex_lock(&job->lock);
+    job->finished = true;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void *job_thread(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (!pool.head) {
+            pool.idle++;
+            pthread_cond_wait(&pool.cond, &pool.lock);
+            pool.idle--;
+        }
+        struct mmccopy_job *job = pool.head;
+        pool.head = job->next;
+        if (!pool.head)
+            pool.tail = NULL;
+        pthread_mutex_unlock(&pool.lock);
+
+        run_job(job);
+
+        pthread_mutex_lock(&pool.lock);
+    }
+    return NULL;
+}
+
+static bool queue_job(struct mmccopy_job *job)
+{
+    // Returns false with errno set if there's no thread to run the job
+    pthread_mutex_lock(&pool.lock);
+    if (pool.idle == 0) {
+        // The job threads block every signal so that the caller's signals
+        // go to its own threads.
+        pthread_t thread;
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        int rc = pthread_create(&thread, NULL, job_thread, NULL);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (rc != 0) {
+            pthread_mutex_unlock(&pool.lock);
+            errno = rc;
+            return false;
+        }
+        pthread_detach(thread);
+    }
+
+    job->next = NULL;
+    if (pool.tail)
+        pool.tail->next = job;
+    else
+        pool.head = job;
+    pool.tail = job;
+    pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+    return true;
+}
+
+static void free_job_args(struct mmccopy_job *job)
+{
+    int i;
+    for (i = 0; i < job->argc; i++)
+        free(job->argv[i]);
+}
+
+static bool add_arg(struct mmccopy_job *job, const char *arg)
+{
+    // Leave room for the NULL at the end
+    if (job->argc == MAX_JOB_ARGS - 1) {
+        errno = E2BIG;
+        return false;
+    }
+    job->argv[job->argc] = strdup(arg);
+    if (!job->argv[job->argc])
+        return false;
+    job->argc++;
+    return true;
+}
+
+struct mmccopy_job *mmccopy_start(const struct mmccopy_job_options *options)
+{
+    if (!options->image || !options->device) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct mmccopy_job *job = (struct mmccopy_job *) calloc(1, sizeof(struct mmccopy_job));
+    if (!job)
+        return NULL;
+    job->progress_fn = options->progress;
+    job->done_fn = options->done;
+    job->ctx = options->ctx;
+    job->state = MMCCOPY_RUNNING;
+
+    // The job is the command line tool run on a copy of the options, so
+    // the caller's strings don't need to stay around.
+    bool ok = add_arg(job, "mmccopy") && add_arg(job, "-q") && add_arg(job, "-y") &&
+              add_arg(job, "-d") && add_arg(job, options->device);
+    const char *const *arg;
+    for (arg = options->args; ok && arg && *arg; arg++)
+        ok = add_arg(job, *arg);
+    ok = ok && add_arg(job, options->image);
+
+    if (ok) {
+        job->copy = copy_context_new(true);
+        ok = job->copy != NULL;
+    }
+    if (ok) {
+        pthread_mutex_init(&job->lock, NULL);
+        pthread_cond_init(&job->cond, NULL);
+        ok = queue_job(job);
+        if (!ok) {
+            pthread_cond_destroy(&job->cond);
+            pthread_mutex_destroy(&job->lock);
+        }
+    }
+    if (!ok) {
+        int saved_errno = errno;
+        if (job->copy)
+            copy_context_free(job->copy);
+        free_job_args(job);
+        free(job);
+        errno = saved_errno;
+        return NULL;
+    }
+    return job;
+}
+
+enum mmccopy_state mmccopy_poll(struct mmccopy_job *job, struct mmccopy_progress *progress)
+{
+    pthread_mutex_lock(&job->lock);
+    if (progress)
+        *progress = job->progress;
+    enum mmccopy_state state = job->state;
+    pthread_mutex_unlock(&job->lock);
+    return state;
+}
+
+void mmccopy_cancel(struct mmccopy_job *job)
+{
+    // The copy notices at its next read or write, or while it's waiting
+    // for a memory card
+    pthread_mutex_lock(&job->lock);
+    if (job->state == MMCCOPY_RUNNING && !job->canceled) {
+        job->canceled = true;
+        copy_cancel(job->copy);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+enum mmccopy_state mmccopy_wait(struct mmccopy_job *job)
+{
+    pthread_mutex_lock(&job->lock);
+    while (!job->finished)
+        pthread_cond_wait(&job->cond, &job->lock);
+    enum mmccopy_state state = job->state;
+    pthread_mutex_unlock(&job->lock);
+    return state;
+}
+
+const char *mmccopy_error(struct mmccopy_job *job)
+{
+    // The message is set before the job's state changes and doesn't
+    // change after that
+    return job->error;
+}
+
+void mmccopy_free(struct mmccopy_job *job)
+{
+    mmccopy_cancel(job);
+    mmccopy_wait(job);
+    copy_context_free(job->copy);
+    free_job_args(job);
+    pthread_cond_destroy(&job->cond);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+}
+
+int mmccopy_find_device(char *path, size_t len)
+{
+    struct failure failure;
+    memset(&failure, 0, sizeof(failure));
+    char *found = find_mmc_device(&failure);
+    if (!found)
+        return -1;
+
+    int rc = 0;
+    if (strlen(found) < len)
+        strcpy(path, found);
+    else {
+        errno = ENAMETOOLONG;
+        rc = -1;
+    }
+    free(found);
+    return rc;
+}
+
+int mmccopy_unmount(const char *device)
+{
+    struct failure failure;
+    memset(&failure, 0, sizeof(failure));
+    if (!umount_all_on_dev(device, &failure)) {
+        errno = EBUSY;
+        return -1;
+    }
+    return 0;
+}
+
+int mmccopy_trim(const char *device)
+{
+    // Opening the memory card unmounts it if something has it mounted
+    struct failure failure;
+    memset(&failure, 0, sizeof(failure));
+    int fd = open_mmc(device, O_WRONLY, &failure);
+    if (fd < 0) {
+        if (failed(&failure))
+            errno = EBUSY;
+        return -1;
+    }
+    bool ok = trim_mmc(fd, false);
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return ok ? 0 : -1;
+}
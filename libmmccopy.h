@@ -0,0 +1,114 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Frank Hunleth
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef LIBMMCCOPY_H
+#define LIBMMCCOPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Write images to memory cards from another program without running
+// mmccopy for each one. Each job runs the copy engine in the caller's
+// process on a pool of threads that all jobs share. Jobs have their own
+// options and state, and an error only ends its own job.
+
+struct mmccopy_job;
+
+enum mmccopy_state
+{
+    MMCCOPY_RUNNING,
+    MMCCOPY_SUCCEEDED,
+    MMCCOPY_FAILED,
+    MMCCOPY_CANCELED
+};
+
+// The latest telemetry line of a job. See --telemetry-fd.
+struct mmccopy_progress
+{
+    uint64_t bytes;
+    uint64_t total;     // 0 if unknown
+    double mbps;        // Since the last update
+    double avg_mbps;
+    double p50_ms;      // Write latencies
+    double p99_ms;
+    double eta_s;
+};
+
+// Callbacks are called on the job's thread, so slow callbacks slow down
+// the copy. They may call mmccopy_poll, mmccopy_cancel, mmccopy_error and
+// mmccopy_start, but not mmccopy_wait or mmccopy_free for the job that
+// they're called for.
+typedef void (*mmccopy_progress_fn)(struct mmccopy_job *job, const struct mmccopy_progress *progress,
+                                    void *ctx);
+typedef void (*mmccopy_done_fn)(struct mmccopy_job *job, enum mmccopy_state state, void *ctx);
+
+struct mmccopy_job_options
+{
+    const char *image;          // Image path or URL
+    const char *device;         // Memory card to write
+    const char *const *args;    // More mmccopy options like "--sparse" or NULL. NULL terminated.
+
+    mmccopy_progress_fn progress;  // Optional
+    mmccopy_done_fn done;          // Optional
+    void *ctx;
+};
+
+// Start copying. Returns NULL with errno set if the job couldn't be started.
+struct mmccopy_job *mmccopy_start(const struct mmccopy_job_options *options);
+
+// Return the job's state and fill out progress if it isn't NULL
+enum mmccopy_state mmccopy_poll(struct mmccopy_job *job, struct mmccopy_progress *progress);
+
+// Stop a running job. The done callback still gets called.
+void mmccopy_cancel(struct mmccopy_job *job);
+
+// Wait for the job to finish and return how it ended
+enum mmccopy_state mmccopy_wait(struct mmccopy_job *job);
+
+// Why a failed job failed or "" if it hasn't failed
+const char *mmccopy_error(struct mmccopy_job *job);
+
+// Cancel the job if it's still running, wait for it and free it
+void mmccopy_free(struct mmccopy_job *job);
+
+// Find the memory card like -f does. Returns 0 on success or -1 if there
+// isn't exactly one.
+int mmccopy_find_device(char *path, size_t len);
+
+// Unmount everything on a memory card like a copy does before writing.
+// Returns 0 on success or -1 with errno set.
+int mmccopy_unmount(const char *device);
+
+// TRIM a whole memory card like -t does. Returns 0 on success or -1 with
+// errno set.
+int mmccopy_trim(const char *device);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBMMCCOPY_H
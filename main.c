@@ -0,0 +1,56 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Frank Hunleth
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+#include "mmccopy.h"
+
+#include <err.h>
+#include <stdlib.h>
+
+// The command line tool runs one copy of the library's engine
+int main(int argc, char *argv[])
+{
+    struct copy_context *ctx = copy_context_new(false);
+    if (!ctx)
+        err(EXIT_FAILURE, "calloc");
+
+    bool ok = false;
+    switch (copy_parse_options(ctx, argc, argv)) {
+    case COPY_PARSE_RUN:
+        ok = copy_run(ctx);
+        break;
+    case COPY_PARSE_DONE:
+        ok = true;
+        break;
+    case COPY_PARSE_USAGE:
+        print_usage(argv[0]);
+        break;
+    case COPY_PARSE_ERROR:
+        break;
+    }
+
+    if (!ok && copy_error(ctx)[0])
+        warnx("%s", copy_error(ctx));
+    copy_context_free(ctx);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
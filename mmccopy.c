@@ -21,21 +21,58 @@
  */
 
 #include "config.h"
+#include "compress.h"
+#include "decompress.h"
+#include "emmc.h"
+#include "failure.h"
+#include "http.h"
+#include "libmmccopy.h"
+#include "mmccopy.h"
+#include "partition.h"
+#include "prefetch.h"
+#include "sha256.h"
 
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include <linux/fs.h>
+#include <linux/netlink.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+#define USE_IO_URING 1
+#endif
+
+// Netlink multicast groups for device events
+#define UEVENT_GROUP_KERNEL 1
+#define UEVENT_GROUP_UDEV 2
 
 #ifndef BLKDISCARD
 #define BLKDISCARD _IO(0x12,119)
@@ -43,11 +80,71 @@
 
 #define NUM_ELEMENTS(X) (sizeof(X) / sizeof(X[0]))
 
+#define OFF_MAX ((off_t) INT64_MAX)
+
 #define ONE_KiB  (1024ULL)
 #define ONE_MiB  (1024 * ONE_KiB)
 #define ONE_GiB  (1024 * ONE_MiB)
 
-#define COPY_BUFFER_SIZE ONE_MiB
+#define DEFAULT_CHUNK_SIZE ONE_MiB
+#define MIN_CHUNK_SIZE (4 * ONE_KiB)
+#define MAX_CHUNK_SIZE (64 * ONE_MiB)
+#define TUNE_MIN_CHUNK_SIZE (128 * ONE_KiB)
+#define TUNE_MAX_CHUNK_SIZE (8 * ONE_MiB)
+#define TUNE_SAMPLE_SIZE (32 * ONE_MiB)
+#define MMAP_WINDOW_SIZE (32 * ONE_MiB)
+#define SPARSE_BLOCK_SIZE (4 * ONE_KiB)
+#define VERIFY_BLOCK_SIZE (256 * ONE_KiB)
+#define DELTA_BLOCK_SIZE (64 * ONE_KiB)
+#define DEFAULT_PIPELINE_DEPTH 2
+#define MAX_DEVICES 32
+#define MAX_PIPELINE_DEPTH 256
+#define DEFAULT_QUEUE_DEPTH 4
+#define MAX_QUEUE_DEPTH 64
+#define MAX_READERS 16
+#define RESUME_INTERVAL (64 * ONE_MiB)
+#define RESUME_SAMPLE_SIZE ONE_MiB
+#define BENCH_DEFAULT_SIZE (64 * ONE_MiB)
+#define BENCH_RANDOM_BLOCK_SIZE (4 * ONE_KiB)
+#define BENCH_RANDOM_SECONDS 5
+#define MAX_PREFETCH_SIZE ONE_GiB
+#define DEFAULT_HTTP_PREFETCH_SIZE (64 * ONE_MiB)
+#define HTTP_CONNECTIONS 4
+
+// A range of the image that holds data. Everything else can be skipped.
+struct data_range
+{
+    off_t offset;
+    size_t len;
+    bool has_checksum;
+    uint8_t sha256[SHA256_DIGEST_LENGTH];
+};
+
+struct range_map
+{
+    struct data_range *ranges;
+    size_t count;
+    size_t image_size;
+};
+
+// One piece of a --job file. The segments are copied in order of their
+// offsets as if they were one image.
+struct job_segment
+{
+    const char *path;
+    int fd;
+    struct decompressor *decoder;
+    off_t offset;       // Where it goes on the memory card
+    size_t size;
+    bool trim;          // TRIM the segment's region before writing it
+};
+
+struct copy_job
+{
+    struct job_segment *segments;
+    int count;
+    size_t total;
+};
 
 struct suffix_multiplier
 {
@@ -68,9 +165,223 @@ struct suffix_multiplier suffix_multipliers[] = {
     {"GiB", ONE_GiB}
 };
 
-// Global options
-static bool numeric_progress = false;
-static bool quiet = false;
+struct resume_journal;
+struct image_cache;
+
+// Telemetry is written as JSON lines to --telemetry-fd. The copy loops only
+// update counters. A line is written when enough time has passed since
+// the last one so that slow consumers don't slow down the copy.
+#define TELEMETRY_INTERVAL 0.5
+#define LATENCY_BUCKETS 128
+
+struct telemetry
+{
+    int fd;
+    double start_time;
+
+    // Library jobs get each line as a struct instead
+    void (*callback)(const struct mmccopy_progress *progress, void *arg);
+    void *callback_arg;
+
+    // Updated by the copy loops
+    size_t done;
+    size_t total;
+    uint64_t latency_counts[LATENCY_BUCKETS];  // Write latencies in microseconds
+    uint64_t latency_max;
+    uint64_t input_wait_us;   // Time spent waiting for data to write
+    uint64_t output_wait_us;  // Time spent waiting for writes to finish
+
+    pthread_mutex_t lock;     // Held while writing a line
+    double next_time;
+    double last_time;
+    size_t last_done;
+};
+
+// Progress is printed by its own thread at a fixed rate so that a slow
+// terminal or serial console doesn't hold up the copy. The copy loops
+// only update the counters.
+#define PROGRESS_INTERVAL 0.25
+#define PROGRESS_NICE 10
+
+struct copy_dest;
+
+struct progress
+{
+    // Updated by the copy loops
+    size_t done;
+    size_t total;
+    bool reported;              // Something has been reported in this phase
+
+    const char *label;          // Printed before the percentage if set
+    struct copy_dest *dests;    // One line per memory card if set
+    int dest_count;
+    bool drawn;                 // The per-card lines have been printed
+    char last[32];              // Last text printed on the progress line
+
+    size_t copied;              // Bytes copied and how long it took for
+    double copy_seconds;        // the summary
+    bool summarize;
+
+    bool running;
+    bool stop;
+    pthread_t thread;
+    pthread_mutex_t lock;       // Held while printing
+    pthread_cond_t cond;
+};
+
+// Everything about one copy. The command line tool makes one for its run
+// and each library job gets its own, so copies in the same process don't
+// share options or state.
+struct copy_context
+{
+    bool library;               // A library job rather than the command line tool
+
+    // Options
+    const char *mmc_devices[MAX_DEVICES];
+    int mmc_device_count;
+    const char *data_pathname;
+    size_t total_to_copy;
+    off_t seek_offset;
+    bool size_given;
+    bool accept_found_device;
+    bool read_from_mmc;
+    bool trim_mmc_device;
+    bool trim_unused;
+    bool numeric_progress;
+    bool quiet;
+    int pipeline_depth;
+    int queue_depth;
+    bool direct_io;
+    bool sparse_write;
+    const char *bmap_path;
+    bool auto_decompress;
+    bool verify_writes;
+    bool delta_write;
+    size_t chunk_size;
+    size_t copy_buffer_size;
+    bool fixed_chunk_size;
+    bool adaptive_chunks;
+    bool zero_copy;
+    bool mmap_input;
+    int reader_count;
+    const char *output_compression;
+    bool json_progress;
+    bool bench;
+    bool bench_json;
+    const char *resume_path;
+    bool wait_for_card;
+    const char *partition_list;
+    const char *job_path;
+    bool coalesce_writes;
+    size_t prefetch_size;
+    bool raw_mmc;
+    const char *cache_dir;
+
+    // State of the copy
+    struct failure failure;     // The first error. Canceling records one too.
+    FILE *progress_out;
+    struct telemetry telemetry;
+    struct progress progress;
+    char *found_device;         // Memory card found when there's no -d
+    int data_fd;
+    struct range_map *data_map;
+    struct decompressor *image_decompressor;
+    struct prefetch *image_prefetch;
+    struct http_source *http;
+    struct compressor *compressor;
+    struct copy_job *copy_job;
+    struct image_cache *image_cache;
+    struct resume_journal *resume_journal;
+    struct partition_table selected_partitions;
+    struct copy_dest *dests;
+    int dest_count;             // Destinations that have been opened
+
+    // eMMC boot partitions are read-only until force_ro is cleared. It's
+    // set again when the copy ends.
+    char force_ro_paths[MAX_DEVICES][96];
+    int force_ro_count;
+};
+
+// Long options that don't have a short equivalent
+enum {
+    OPT_BUFFERS = 256,
+    OPT_QUEUE_DEPTH,
+    OPT_DIRECT,
+    OPT_SPARSE,
+    OPT_BMAP,
+    OPT_TRIM_UNUSED,
+    OPT_NO_DECOMPRESS,
+    OPT_VERIFY,
+    OPT_DELTA,
+    OPT_ZERO_COPY,
+    OPT_MMAP,
+    OPT_READERS,
+    OPT_COMPRESS,
+    OPT_TELEMETRY_FD,
+    OPT_BENCH,
+    OPT_RESUME,
+    OPT_WAIT,
+    OPT_PARTITION,
+    OPT_JOB,
+    OPT_COALESCE,
+    OPT_PREFETCH,
+    OPT_PROGRESS_JSON,
+    OPT_RAW_MMC,
+    OPT_CACHE
+};
+
+static struct option long_options[] = {
+    {"buffers", required_argument, 0, OPT_BUFFERS},
+    {"queue-depth", required_argument, 0, OPT_QUEUE_DEPTH},
+    {"direct", no_argument, 0, OPT_DIRECT},
+    {"sparse", no_argument, 0, OPT_SPARSE},
+    {"bmap", required_argument, 0, OPT_BMAP},
+    {"trim-unused", no_argument, 0, OPT_TRIM_UNUSED},
+    {"no-decompress", no_argument, 0, OPT_NO_DECOMPRESS},
+    {"verify", no_argument, 0, OPT_VERIFY},
+    {"delta", no_argument, 0, OPT_DELTA},
+    {"zero-copy", no_argument, 0, OPT_ZERO_COPY},
+    {"mmap", no_argument, 0, OPT_MMAP},
+    {"readers", required_argument, 0, OPT_READERS},
+    {"compress", required_argument, 0, OPT_COMPRESS},
+    {"telemetry-fd", required_argument, 0, OPT_TELEMETRY_FD},
+    {"bench", optional_argument, 0, OPT_BENCH},
+    {"resume", required_argument, 0, OPT_RESUME},
+    {"wait", no_argument, 0, OPT_WAIT},
+    {"partition", required_argument, 0, OPT_PARTITION},
+    {"job", required_argument, 0, OPT_JOB},
+    {"coalesce", no_argument, 0, OPT_COALESCE},
+    {"prefetch", required_argument, 0, OPT_PREFETCH},
+    {"progress-json", no_argument, 0, OPT_PROGRESS_JSON},
+    {"raw-mmc", no_argument, 0, OPT_RAW_MMC},
+    {"cache", required_argument, 0, OPT_CACHE},
+    {0, 0, 0, 0}
+};
+
+// Warnings go to stderr like warn(3) and warnx(3) do for the command line
+// tool. Library jobs don't own stderr, so theirs are dropped.
+void warning(const struct copy_context *ctx, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void warning_errno(const struct copy_context *ctx, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+void warning(const struct copy_context *ctx, const char *fmt, ...)
+{
+    if (ctx->library)
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    vwarnx(fmt, ap);
+    va_end(ap);
+}
+
+void warning_errno(const struct copy_context *ctx, const char *fmt, ...)
+{
+    if (ctx->library)
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    vwarn(fmt, ap);
+    va_end(ap);
+}
 
 void print_version()
 {
@@ -80,7 +391,8 @@ void print_version()
 void print_usage(const char *argv0)
 {
     fprintf(stderr, "Usage: %s [options] [path]\n", argv0);
-    fprintf(stderr, "  -d <Device file for the memory card>\n");
+    fprintf(stderr, "  -b <Size of each read and write or 'auto' to tune it to the memory card> (default 1 MiB)\n");
+    fprintf(stderr, "  -d <Device file for the memory card> (repeat to write several cards at once)\n");
     fprintf(stderr, "  -f   Run SDCard auto-detection and print the device path\n");
     fprintf(stderr, "  -n   Report numeric progress\n");
     fprintf(stderr, "  -o <Offset from the beginning of the memory card>\n");
@@ -92,10 +404,44 @@ void print_usage(const char *argv0)
     fprintf(stderr, "  -v   Print out the version and exit\n");
     fprintf(stderr, "  -w   Write to the memory card (default)\n");
     fprintf(stderr, "  -y   Accept automatically found memory card\n");
+    fprintf(stderr, "  --buffers <n> Number of -b sized buffers in the read/write pipeline (default %d)\n",
+            DEFAULT_PIPELINE_DEPTH);
+    fprintf(stderr, "  --queue-depth <n> Number of writes to keep in flight using io_uring (default %d, 0 to disable)\n",
+            DEFAULT_QUEUE_DEPTH);
+    fprintf(stderr, "  --direct   Write to the memory card with O_DIRECT instead of O_SYNC\n");
+    fprintf(stderr, "  --sparse   Skip holes and blocks of zeros in the image (use with -t to clear them)\n");
+    fprintf(stderr, "  --bmap <path> Only write the ranges listed in this block map file\n");
+    fprintf(stderr, "  --trim-unused Instead of -t, only TRIM the skipped parts of the image and\n");
+    fprintf(stderr, "                everything after it\n");
+    fprintf(stderr, "  --no-decompress Don't decompress gzip, xz or zstd images automatically\n");
+    fprintf(stderr, "  --verify   Read back what was written and check it against the image\n");
+    fprintf(stderr, "  --delta    Only write the blocks that are different on the memory card\n");
+    fprintf(stderr, "  --zero-copy Have the kernel copy the image without going through user space\n");
+    fprintf(stderr, "  --mmap     Memory map image files and keep them from filling the page cache\n");
+    fprintf(stderr, "  --readers <n> Number of threads reading from the memory card with -r (default 1)\n");
+    fprintf(stderr, "  --compress <gzip|xz|zstd> Compress what's read with -r\n");
+    fprintf(stderr, "  --telemetry-fd <fd> Write throughput and latency as JSON lines to this file descriptor\n");
+    fprintf(stderr, "  --bench[=json] Benchmark the memory card on the -s bytes at -o (default 64 MiB at 0)\n");
+    fprintf(stderr, "                 This overwrites that region and TRIMs the whole card\n");
+    fprintf(stderr, "  --resume <path> Keep a journal at this path to continue an interrupted write\n");
+    fprintf(stderr, "  --wait     Wait for a memory card to be inserted instead of using one that's there\n");
+    fprintf(stderr, "  --partition <list> Only write these partitions of the image (numbers or GPT names,\n");
+    fprintf(stderr, "                separated by commas)\n");
+    fprintf(stderr, "  --job <path> Write the images listed in this file in one run. Each line is\n");
+    fprintf(stderr, "               \"<image> <offset> [size] [trim]\"\n");
+    fprintf(stderr, "  --coalesce Widen small and unaligned writes to whole erase blocks\n");
+    fprintf(stderr, "  --prefetch <size> Read up to this much of a piped or HTTP image ahead of the\n");
+    fprintf(stderr, "                memory card (default 64 MiB for HTTP, max 1 GiB)\n");
+    fprintf(stderr, "  --progress-json Report progress as JSON lines like --telemetry-fd does\n");
+    fprintf(stderr, "  --raw-mmc  Write eMMC devices with MMC commands instead of through the block layer\n");
+    fprintf(stderr, "  --cache <dir> Keep decompressed images and where their data is in this directory\n");
+    fprintf(stderr, "                so that writing them again is faster\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "The [path] specifies the location of the image to copy to or from\n");
     fprintf(stderr, "the memory card. If it is unspecified or '-', the image will either\n");
-    fprintf(stderr, "be read from stdin (-w) or written to stdout (-r).\n");
+    fprintf(stderr, "be read from stdin (-w) or written to stdout (-r). Images compressed with\n");
+    fprintf(stderr, "gzip, xz or zstd are decompressed automatically.\n");
+    fprintf(stderr, "Images can also be written from http:// and https:// URLs.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "The -d argument does not need to be a device file. It can also be a regular file.\n");
     fprintf(stderr, "\n");
@@ -107,36 +453,43 @@ void print_usage(const char *argv0)
     fprintf(stderr, "Read the master boot record (512 bytes @ offset 0) from /dev/sdc:\n");
     fprintf(stderr, "  %s -r -s 512 -o 0 -d /dev/sdc mbr.img\n", argv0);
     fprintf(stderr, "\n");
+    fprintf(stderr, "Write sdcard.img to the SD Cards at /dev/sdc and /dev/sdd at the same time:\n");
+    fprintf(stderr, "  %s -d /dev/sdc -d /dev/sdd sdcard.img\n", argv0);
+    fprintf(stderr, "\n");
     fprintf(stderr, "Offset and size may be specified with the following suffixes:\n");
     size_t i;
     for (i = 0; i < NUM_ELEMENTS(suffix_multipliers); i++)
         fprintf(stderr, "  %3s  %d\n", suffix_multipliers[i].suffix, (int) suffix_multipliers[i].multiple);
 }
 
-size_t parse_size(const char *str)
+bool parse_size(struct copy_context *ctx, const char *str, size_t *value)
 {
     char *suffix;
-    size_t value = strtoul(str, &suffix, 10);
     size_t i;
 
+    *value = strtoul(str, &suffix, 10);
     if (suffix == str)
-        errx(EXIT_FAILURE, "Expecting number but got '%s'", str);
+        return fail(&ctx->failure, "Expecting number but got '%s'", str);
 
     if (*suffix == '\0')
-        return value;
+        return true;
 
     for (i = 0; i < NUM_ELEMENTS(suffix_multipliers); i++) {
-        if (strcmp(suffix_multipliers[i].suffix, suffix) == 0)
-            return value * suffix_multipliers[i].multiple;
+        if (strcmp(suffix_multipliers[i].suffix, suffix) == 0) {
+            *value *= suffix_multipliers[i].multiple;
+            return true;
+        }
     }
 
-    errx(EXIT_FAILURE, "Unknown size multiplier '%s'", suffix);
-    return 0;
+    return fail(&ctx->failure, "Unknown size multiplier '%s'", suffix);
 }
 
 char *unescape_string(const char *input)
 {
+    // Returns NULL with errno set if out of memory
     char *result = (char *) malloc(strlen(input) + 1);
+    if (!result)
+        return NULL;
     char *p = result;
     while (*input) {
         if (*input != '\\') {
@@ -197,152 +550,269 @@ char *unescape_string(const char *input)
     return result;
 }
 
-void umount_all_on_dev(const char *mmc_device)
+char *read_file(struct copy_context *ctx, const char *path, size_t *len)
 {
-    FILE *fp = fopen("/proc/mounts", "r");
-    if (!fp)
-        err(EXIT_FAILURE, "/proc/mounts");
-
-    char *todo[64] = {0};
-    int todo_ix = 0;
-    int i;
-
-    char line[512] = {0};
-    while (!feof(fp) &&
-            fgets(line, sizeof(line), fp)) {
-        char devname[64];
-        char mountpoint[256];
-        if (sscanf(line, "%63s %255s", devname, mountpoint) != 2)
-            continue;
-
-        if (strstr(devname, mmc_device) == devname) {
-            // mmc_device is a prefix of this device, i.e. mmc_device is /dev/sdc
-            // and /dev/sdc1 is mounted.
-
-            if (todo_ix == NUM_ELEMENTS(todo))
-                errx(EXIT_FAILURE, "Device mounted too many times");
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fail_errno(&ctx->failure, "%s", path);
+        return NULL;
+    }
 
-            // strings from /proc/mounts are escaped, so unescape them
-            todo[todo_ix++] = unescape_string(mountpoint);
+    size_t size = 0;
+    size_t capacity = 64 * ONE_KiB;
+    char *contents = (char *) malloc(capacity + 1);
+    size_t amount;
+    while (contents && (amount = fread(contents + size, 1, capacity - size, fp)) > 0) {
+        size += amount;
+        if (size == capacity) {
+            capacity *= 2;
+            char *bigger = (char *) realloc(contents, capacity + 1);
+            if (!bigger)
+                free(contents);
+            contents = bigger;
         }
     }
+    if (!contents || ferror(fp)) {
+        if (!contents)
+            fail_errno(&ctx->failure, "malloc");
+        else
+            fail_errno(&ctx->failure, "%s", path);
+        free(contents);
+        fclose(fp);
+        return NULL;
+    }
     fclose(fp);
 
-    int mtab_exists = (access("/etc/mtab", F_OK) != -1);
-    for (i = 0; i < todo_ix; i++) {
-        if (mtab_exists) {
-            // If /etc/mtab, then call umount(8) so that
-            // gets updated correctly.
-            char cmdline[384];
-            sprintf(cmdline, "/bin/umount %s", todo[i]);
-            int rc = system(cmdline);
-            if (rc != 0)
-                err(EXIT_FAILURE, "%s", cmdline);
-        } else {
-            // No /etc/mtab, so call the kernel directly.
-            if (umount(todo[i]) < 0)
-                err(EXIT_FAILURE, "umount %s", todo[i]);
+    contents[size] = '\0';
+    *len = size;
+    return contents;
+}
+
+const char *xml_element_text(const char *xml, const char *name)
+{
+    // Return the text after <name> or <name attributes...>
+    size_t name_len = strlen(name);
+    const char *p = xml;
+    while ((p = strchr(p, '<')) != NULL) {
+        p++;
+        if (strncmp(p, name, name_len) == 0 &&
+                (p[name_len] == '>' || p[name_len] == ' ')) {
+            p = strchr(p, '>');
+            return p ? p + 1 : NULL;
         }
     }
-
-    for (i = 0; i < todo_ix; i++)
-        free(todo[i]);
+    return NULL;
 }
 
-size_t device_size(const char *devpath)
+bool add_data_range(struct range_map *map, size_t *capacity, off_t offset, size_t len)
 {
-    int fd = open(devpath, O_RDONLY);
-    if (fd < 0)
-        return 0;
-
-    off_t len = lseek(fd, 0, SEEK_END);
-    close(fd);
+    // Returns false with errno set if out of memory
+    if (map->count == *capacity) {
+        size_t bigger = *capacity ? *capacity * 2 : 64;
+        struct data_range *ranges = (struct data_range *) realloc(map->ranges, bigger * sizeof(struct data_range));
+        if (!ranges)
+            return false;
+        map->ranges = ranges;
+        *capacity = bigger;
+    }
 
-    return len < 0 ? 0 : len;
+    struct data_range *r = &map->ranges[map->count++];
+    memset(r, 0, sizeof(*r));
+    r->offset = offset;
+    r->len = len;
+    return true;
 }
 
-bool is_mmc_device(const char *devpath)
+bool parse_bmap_xml(struct copy_context *ctx, const char *path, const char *xml, struct range_map *map)
 {
-    // Check 1: Path exists and can read length
-    size_t len = device_size(devpath);
-    if (len == 0)
-        return false;
+    // Parse the subset of the bmaptool format that's needed to know which
+    // blocks to copy. For example:
+    //
+    //   <bmap version="2.0">
+    //     <ImageSize> 8388608 </ImageSize>
+    //     <BlockSize> 4096 </BlockSize>
+    //     <ChecksumType> sha256 </ChecksumType>
+    //     <BlockMap>
+    //       <Range chksum="...."> 0-3 </Range>
+    //       <Range chksum="...."> 129 </Range>
+    //     </BlockMap>
+    //   </bmap>
+    const char *image_size = xml_element_text(xml, "ImageSize");
+    const char *block_size = xml_element_text(xml, "BlockSize");
+    if (!image_size || !block_size || !strstr(xml, "<bmap"))
+        return fail(&ctx->failure, "%s: not a bmap file", path);
 
-    // Check 2: Capacity larger than 32 GiB -> false
-    if (len > (32 * ONE_GiB))
-        return false;
+    map->image_size = strtoull(image_size, NULL, 10);
+    size_t bs = strtoull(block_size, NULL, 10);
+    if (bs == 0)
+        return fail(&ctx->failure, "%s: invalid BlockSize", path);
+
+    // Only SHA-256 checksums (bmap version 2.0) are checked. Version 1.3
+    // uses SHA-1.
+    bool sha256 = false;
+    const char *checksum_type = xml_element_text(xml, "ChecksumType");
+    if (checksum_type) {
+        while (*checksum_type == ' ')
+            checksum_type++;
+        sha256 = (strncmp(checksum_type, "sha256", 6) == 0);
+        if (!sha256)
+            warning(ctx, "%s: not checking %.*s checksums", path,
+                    (int) strcspn(checksum_type, " <"), checksum_type);
+    }
+
+    const char *p = xml_element_text(xml, "BlockMap");
+    if (!p)
+        return fail(&ctx->failure, "%s: missing BlockMap", path);
+
+    size_t capacity = 0;
+    while ((p = strstr(p, "<Range")) != NULL) {
+        const char *end_tag = strchr(p, '>');
+        if (!end_tag)
+            break;
+
+        char *endp;
+        size_t first = strtoull(end_tag + 1, &endp, 10);
+        size_t last = first;
+        while (*endp == ' ')
+            endp++;
+        if (*endp == '-')
+            last = strtoull(endp + 1, &endp, 10);
+        if (last < first)
+            return fail(&ctx->failure, "%s: invalid range %zu-%zu", path, first, last);
 
-    // Certainly there are more checks that we can do
-    // to avoid false memory card detects...
+        off_t offset = first * bs;
+        size_t len = (last - first + 1) * bs;
+        if (offset >= (off_t) map->image_size)
+            return fail(&ctx->failure, "%s: range %zu-%zu is past the end of the image", path, first, last);
+        if (offset + len > map->image_size)
+            len = map->image_size - offset;
+        if (!add_data_range(map, &capacity, offset, len))
+            return fail_errno(&ctx->failure, "realloc");
 
+        const char *chksum = strstr(p, "chksum=\"");
+        if (sha256 && chksum && chksum < end_tag) {
+            struct data_range *r = &map->ranges[map->count - 1];
+            if (sha256_from_hex(chksum + 8, r->sha256) < 0)
+                return fail(&ctx->failure, "%s: invalid checksum for range %zu-%zu", path, first, last);
+            r->has_checksum = true;
+        }
+        p = endp;
+    }
     return true;
 }
 
-char *find_mmc_device()
+uint64_t get_le64(const char *p)
 {
-    char *possible[64] = {0};
-    size_t possible_ix = 0;
-    char c;
-    size_t i;
+    const uint8_t *b = (const uint8_t *) p;
+    uint64_t v = 0;
+    int i;
+    for (i = 7; i >= 0; i--)
+        v = (v << 8) | b[i];
+    return v;
+}
 
-    // Scan memory cards connected via USB. These are /dev/sd_ devices.
-    // NOTE: Don't scan /dev/sda, since I don't think this is ever right
-    // for any use case.
-    for (c = 'b'; c != 'z'; c++) {
-        char devpath[64];
-        sprintf(devpath, "/dev/sd%c", c);
+void put_le64(char *p, uint64_t v)
+{
+    int i;
+    for (i = 0; i < 8; i++)
+        p[i] = (char) (v >> (i * 8));
+}
 
-        if (is_mmc_device(devpath) && possible_ix < NUM_ELEMENTS(possible))
-            possible[possible_ix++] = strdup(devpath);
-    }
+bool parse_bmap_binary(struct copy_context *ctx, const char *path, const char *data, size_t len,
+                       struct range_map *map)
+{
+    // Binary range list:
+    //   "MMCBMAP1"
+    //   64-bit image size
+    //   64-bit flags (bit 0 set if every range has a SHA-256)
+    //   64-bit offset and 64-bit length for each range (+ SHA-256)
+    //
+    // All integers are little endian and the offsets are in bytes.
+    if (len < 24)
+        return fail(&ctx->failure, "%s: truncated block map", path);
 
-    // Scan the mmcblk devices
-    for (i = 0; i < 16; i++) {
-        char devpath[64];
-        sprintf(devpath, "/dev/mmcblk%d", (int) i);
+    map->image_size = get_le64(data + 8);
+    uint64_t flags = get_le64(data + 16);
+    size_t entry_len = (flags & 1) ? 16 + SHA256_DIGEST_LENGTH : 16;
+    if ((len - 24) % entry_len)
+        return fail(&ctx->failure, "%s: truncated block map", path);
 
-        if (is_mmc_device(devpath) && possible_ix < NUM_ELEMENTS(possible))
-            possible[possible_ix++] = strdup(devpath);
+    size_t capacity = 0;
+    const char *p;
+    for (p = data + 24; p < data + len; p += entry_len) {
+        off_t offset = get_le64(p);
+        size_t range_len = get_le64(p + 8);
+        if (offset + range_len > map->image_size)
+            return fail(&ctx->failure, "%s: range at %lld is past the end of the image", path, (long long) offset);
+        if (!add_data_range(map, &capacity, offset, range_len))
+            return fail_errno(&ctx->failure, "realloc");
+        if (flags & 1) {
+            struct data_range *r = &map->ranges[map->count - 1];
+            memcpy(r->sha256, p + 16, SHA256_DIGEST_LENGTH);
+            r->has_checksum = true;
+        }
     }
+    return true;
+}
 
-    if (possible_ix == 1) {
-	// Success.
-	return possible[0];
-    } else if (possible_ix == 0) {
-	if (getuid() != 0)
-	    errx(EXIT_FAILURE, "Memory card couldn't be found automatically.\nTry running as root or specify -? for help");
-	else
-	    errx(EXIT_FAILURE, "No memory cards found.");
-    } else {
-        fprintf(stderr, "Too many possible memory cards found: \n");
-        for (i = 0; i < possible_ix; i++)
-            fprintf(stderr, "  %s\n", possible[i]);
-        fprintf(stderr, "Pick one and specify it explicitly on the commandline.\n");
-        exit(EXIT_FAILURE);
-    }
+int compare_data_ranges(const void *a, const void *b)
+{
+    off_t x = ((const struct data_range *) a)->offset;
+    off_t y = ((const struct data_range *) b)->offset;
+    return x < y ? -1 : (x > y ? 1 : 0);
 }
 
-void trim_mmc(int fd)
+void free_range_map(struct range_map *map)
 {
-    // Run the TRIM command on the MMC file handle to free all currently
-    // allocated blocks back to the MMC firmware.
-    uint64_t range[2];
+    if (map) {
+        free(map->ranges);
+        free(map);
+    }
+}
 
-    range[0] = 0;
-    if (ioctl(fd, BLKGETSIZE64, &range[1]))
-        err(EXIT_FAILURE, "Can't get size of device. Check that device is block device");
+struct range_map *load_range_map(struct copy_context *ctx, const char *path)
+{
+    size_t len;
+    char *contents = read_file(ctx, path, &len);
+    if (!contents)
+        return NULL;
+    struct range_map *map = (struct range_map *) calloc(1, sizeof(struct range_map));
+    if (!map) {
+        fail_errno(&ctx->failure, "calloc");
+        free(contents);
+        return NULL;
+    }
 
-    if (ioctl(fd, BLKDISCARD, &range))
-        err(EXIT_FAILURE, "BLKDISCARD (TRIM command) failed");
+    bool ok;
+    if (len >= 8 && memcmp(contents, "MMCBMAP1", 8) == 0)
+        ok = parse_bmap_binary(ctx, path, contents, len, map);
+    else
+        ok = parse_bmap_xml(ctx, path, contents, map);
+    free(contents);
 
+    qsort(map->ranges, map->count, sizeof(struct data_range), compare_data_ranges);
+    size_t i;
+    for (i = 1; ok && i < map->count; i++) {
+        if (map->ranges[i - 1].offset + (off_t) map->ranges[i - 1].len > map->ranges[i].offset)
+            ok = fail(&ctx->failure, "%s: overlapping ranges", path);
+    }
+    if (!ok) {
+        free_range_map(map);
+        return NULL;
+    }
+    return map;
 }
 
-double calculate_progress(size_t written, size_t total)
+size_t device_size(const char *devpath)
 {
-    if (total > 0)
-        return 100.0 * written / total;
-    else
+    int fd = open(devpath, O_RDONLY);
+    if (fd < 0)
         return 0;
+
+    off_t len = lseek(fd, 0, SEEK_END);
+    close(fd);
+
+    return len < 0 ? 0 : len;
 }
 
 void pretty_size(size_t amount, char *out)
@@ -357,226 +827,5539 @@ void pretty_size(size_t amount, char *out)
         sprintf(out, "%d bytes", (int) amount);
 }
 
-void report_progress(size_t written, size_t total)
+bool read_sysfs_u64(const char *path, uint64_t *value)
 {
-    if (quiet)
-	return;
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return false;
 
-    if (numeric_progress) {
-        // If numeric, write the percentage if we can figure it out.
-        printf("%.0f\n", calculate_progress(written, total));
-    } else {
-        // If this is for a human, then print the percent complete
-        // if we can calculate it or the bytes written.
-        if (total > 0)
-            printf("\r%.0f%%", calculate_progress(written, total));
-        else {
-            char sizestr[32];
-            pretty_size(written, sizestr);
-            printf("\r%s     ", sizestr);
-        }
-        fflush(stdout);
+    unsigned long long v;
+    bool ok = (fscanf(fp, "%llu", &v) == 1);
+    fclose(fp);
+    if (ok)
+        *value = v;
+    return ok;
+}
+
+// Memory card detection only looks at sysfs. Opening device nodes can
+// block for seconds on readers that are powered down or have no card.
+struct mmc_info
+{
+    char name[32];
+    uint64_t size;
+    char description[96];
+};
+
+bool read_sysfs_string(const char *path, char *value, size_t len)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return false;
+
+    bool ok = (fgets(value, len, fp) != NULL);
+    fclose(fp);
+    if (ok) {
+        // Trim the newline and the padding that SCSI strings have
+        size_t n = strlen(value);
+        while (n > 0 && (value[n - 1] == '\n' || value[n - 1] == ' '))
+            value[--n] = '\0';
     }
+    return ok;
 }
 
-void copy(int from_fd, int to_fd, size_t total_to_copy)
+bool read_mmc_info(const char *name, struct mmc_info *info)
 {
-    char *buffer = malloc(COPY_BUFFER_SIZE);
-    off_t total_written = 0;
-    while (total_to_copy == 0 || total_written < total_to_copy) {
-        size_t amount_to_read = COPY_BUFFER_SIZE;
-        if (total_to_copy != 0 && total_to_copy < amount_to_read)
-            amount_to_read = total_to_copy;
+    // Returns true if the block device with this name looks like a memory
+    // card.
+    memset(info, 0, sizeof(*info));
+    if (strlen(name) >= sizeof(info->name) || strchr(name, '/'))
+        return false;
+    strcpy(info->name, name);
 
-        ssize_t amount_read = read(from_fd, buffer, amount_to_read);
-        if (amount_read < 0)
-            err(EXIT_FAILURE, "read");
+    // MMC devices also have boot and RPMB partitions that aren't useful
+    bool mmc = (strncmp(name, "mmcblk", 6) == 0);
+    if (mmc && (strstr(name, "boot") || strstr(name, "rpmb")))
+        return false;
+    if (!mmc && strncmp(name, "sd", 2) != 0)
+        return false;
 
-        if (amount_read == 0)
-            break;
+    // SCSI disks need to be removable or on USB. This leaves out internal
+    // drives.
+    char path[160];
+    char link[PATH_MAX];
+    uint64_t value;
+    if (!mmc) {
+        sprintf(path, "/sys/block/%s", name);
+        ssize_t len = readlink(path, link, sizeof(link) - 1);
+        link[len < 0 ? 0 : len] = '\0';
 
-        char *ptr = buffer;
-        do {
-            ssize_t amount_written = write(to_fd, ptr, amount_read);
-            if (amount_written < 0) {
-                if (errno == EINTR)
-                    continue;
-                else
-                    err(EXIT_FAILURE, "write");
-            }
+        sprintf(path, "/sys/block/%s/removable", name);
+        bool removable = read_sysfs_u64(path, &value) && value == 1;
+        if (!removable && !strstr(link, "/usb"))
+            return false;
+    }
 
-            amount_read -= amount_written;
-            ptr += amount_written;
-            total_written += amount_written;
-        } while (amount_read > 0);
+    // Readers with no card report a size of 0. Anything over 32 GiB is
+    // probably a hard drive.
+    sprintf(path, "/sys/block/%s/size", name);
+    if (!read_sysfs_u64(path, &value))
+        return false;
+    info->size = value * 512;
+    if (info->size == 0 || info->size > 32 * ONE_GiB)
+        return false;
 
-	report_progress(total_written, total_to_copy);
+    char vendor[48] = "";
+    char model[48] = "";
+    sprintf(path, "/sys/block/%s/device/%s", name, mmc ? "name" : "vendor");
+    read_sysfs_string(path, vendor, sizeof(vendor));
+    if (!mmc) {
+        sprintf(path, "/sys/block/%s/device/model", name);
+        read_sysfs_string(path, model, sizeof(model));
     }
-    free(buffer);
+    snprintf(info->description, sizeof(info->description), "%s%s%s",
+             vendor, vendor[0] && model[0] ? " " : "", model);
+    return true;
+}
 
-    // Print a linefeed at the end so that the final progress report has
-    // a new line after it. Numeric progress already prints linefeeds, so
-    // don't add another on those.
-    if (!quiet && !numeric_progress)
-	printf("\n");
+int compare_mmc_info(const void *a, const void *b)
+{
+    return strcmp(((const struct mmc_info *) a)->name, ((const struct mmc_info *) b)->name);
 }
 
-int main(int argc, char *argv[])
+char *mmc_info_path(const struct mmc_info *info)
 {
-    const char *mmc_device = 0;
-    const char *data_pathname = "-";
-    size_t total_to_copy = 0;
-    off_t seek_offset = 0;
-    bool accept_found_device = false;
-    bool read_from_mmc = false;
-    bool trim_mmc_device = false;
+    char devpath[64];
+    sprintf(devpath, "/dev/%s", info->name);
+    return strdup(devpath);
+}
 
-    // Memory cards are too big to bother with systems
-    // that don't support large file sizes any more.
-    if (sizeof(off_t) != 8)
-        errx(EXIT_FAILURE, "recompile with largefile support");
+char *find_mmc_device(struct failure *failure)
+{
+    // Returns NULL after recording an error in failure if there isn't
+    // exactly one memory card.
+    struct mmc_info possible[64];
+    size_t possible_ix = 0;
+    size_t i;
 
-    int opt;
-    while ((opt = getopt(argc, argv, "d:fno:pqrs:tvwy")) != -1) {
-        switch (opt) {
-        case 'd':
-            mmc_device = optarg;
-            break;
-	case 'f':
-	    mmc_device = find_mmc_device();
-	    printf("%s", mmc_device);
-	    exit(EXIT_SUCCESS);
-	    break;
-        case 's':
-            total_to_copy = parse_size(optarg);
-            break;
-        case 'o':
-            seek_offset = parse_size(optarg);
-            break;
-        case 'n':
-            numeric_progress = true;
-            break;
-        case 'p':
-            // This is now the default. Keep parameter around since I wrote
-            // some docs that include it.
-            break;
-        case 'q':
-            quiet = true;
-            break;
-        case 'r':
-            read_from_mmc = true;
-            break;
-        case 't':
-            trim_mmc_device = true;
-            break;
-        case 'w':
-	    read_from_mmc = false;
-	    break;
-        case 'y':
-            accept_found_device = true;
-            break;
-        case 'v':
-            print_version();
-            exit(EXIT_SUCCESS);
-            break;
-        default: /* '?' */
-            print_usage(argv[0]);
-            exit(EXIT_FAILURE);
+    DIR *dir = opendir("/sys/block");
+    if (!dir) {
+        fail_errno(failure, "/sys/block");
+        return NULL;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && possible_ix < NUM_ELEMENTS(possible)) {
+        if (read_mmc_info(entry->d_name, &possible[possible_ix]))
+            possible_ix++;
+    }
+    closedir(dir);
+    qsort(possible, possible_ix, sizeof(possible[0]), compare_mmc_info);
+
+    if (possible_ix == 1) {
+	// Success.
+	return mmc_info_path(&possible[0]);
+    } else if (possible_ix == 0) {
+	fail(failure, "No memory cards found.");
+    } else {
+        char list[sizeof(failure->message)];
+        size_t len = 0;
+        for (i = 0; i < possible_ix && len < sizeof(list); i++) {
+            char sizestr[32];
+            pretty_size(possible[i].size, sizestr);
+            len += snprintf(list + len, sizeof(list) - len, "\n  /dev/%-10s %10s  %s",
+                            possible[i].name, sizestr, possible[i].description);
         }
+        fail(failure, "Too many possible memory cards found:%s\n"
+             "Pick one and specify it explicitly on the commandline.", list);
+    }
+    return NULL;
+}
+
+char *wait_for_mmc_device(struct copy_context *ctx)
+{
+    // Wait for a memory card to be inserted. Cards that are already there
+    // are ignored so that a line station can run this in a loop. Events
+    // come from udev once it has created the device node, or straight
+    // from the kernel on systems without udev. The wait ends early if the
+    // copy is canceled.
+    bool udev = (access("/run/udev/control", F_OK) == 0);
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+        fail_errno(&ctx->failure, "socket");
+        return NULL;
     }
 
-    if (quiet && numeric_progress)
-        errx(EXIT_FAILURE, "pick either -n or -q, but not both.");
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = udev ? UEVENT_GROUP_UDEV : UEVENT_GROUP_KERNEL;
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fail_errno(&ctx->failure, "Can't listen for device events");
+        close(fd);
+        return NULL;
+    }
+
+    if (!ctx->quiet)
+        fprintf(stderr, "Waiting for a memory card...\n");
 
-    if (optind < argc)
-        data_pathname = argv[optind];
+    while (!failed(&ctx->failure)) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 250) <= 0)
+            continue;
 
-    if (read_from_mmc && total_to_copy == 0)
-	errx(EXIT_FAILURE, "Specify the amount to copy (-s) when reading from memory card.");
+        char buffer[8192];
+        ssize_t len = recv(fd, buffer, sizeof(buffer) - 1, 0);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            fail_errno(&ctx->failure, "recv");
+            break;
+        }
+        buffer[len] = '\0';
 
-    if (read_from_mmc && trim_mmc_device)
-        errx(EXIT_FAILURE, "You probably don't want to TRIM the device if you're going to read from it.");
+        // Kernel events are "action@devpath" followed by KEY=value strings.
+        // udev events have a header that says where its strings start.
+        size_t pos = 0;
+        if (len >= 24 && memcmp(buffer, "libudev", 8) == 0) {
+            uint32_t properties_offset;
+            memcpy(&properties_offset, buffer + 16, sizeof(properties_offset));
+            pos = properties_offset;
+        }
 
-    if (!mmc_device) {
-        mmc_device = find_mmc_device();
+        const char *action = "";
+        const char *subsystem = "";
+        const char *devtype = "";
+        const char *devname = "";
+        while (pos < (size_t) len) {
+            const char *property = buffer + pos;
+            if (strncmp(property, "ACTION=", 7) == 0)
+                action = property + 7;
+            else if (strncmp(property, "SUBSYSTEM=", 10) == 0)
+                subsystem = property + 10;
+            else if (strncmp(property, "DEVTYPE=", 8) == 0)
+                devtype = property + 8;
+            else if (strncmp(property, "DEVNAME=", 8) == 0)
+                devname = property + 8;
+            pos += strlen(property) + 1;
+        }
 
-        if (!accept_found_device) {
-            if (strcmp(data_pathname, "-") == 0)
-                errx(EXIT_FAILURE, "Cannot confirm use of %s when using stdin/stdout.\nRerun with -y if location is correct.", mmc_device);
+        // Inserting a card into a USB reader changes a disk that's already
+        // there, so look at both.
+        if ((strcmp(action, "add") != 0 && strcmp(action, "change") != 0) ||
+                strcmp(subsystem, "block") != 0 || strcmp(devtype, "disk") != 0)
+            continue;
+        if (strncmp(devname, "/dev/", 5) == 0)
+            devname += 5;
 
-            char sizestr[16];
-            pretty_size(device_size(mmc_device), sizestr);
-            fprintf(stderr, "Use %s memory card found at %s? [y/N] ", sizestr, mmc_device);
-            int response = fgetc(stdin);
-            if (response != 'y' && response != 'Y')
-                errx(EXIT_FAILURE, "aborted");
+        struct mmc_info info;
+        if (read_mmc_info(devname, &info)) {
+            close(fd);
+            return mmc_info_path(&info);
         }
     }
+    close(fd);
+    return NULL;
+}
 
-    int data_fd;
-    if (strcmp(data_pathname, "-") != 0) {
-	if (read_from_mmc)
-	    data_fd = open(data_pathname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-	else
-	    data_fd = open(data_pathname, O_RDONLY);
-        if (data_fd < 0)
-            err(EXIT_FAILURE, "%s", data_pathname);
+// Mounted file systems are found by device number so that /dev/sdb
+// doesn't match /dev/sdb10. The partitions and anything stacked on top of
+// them, like dm-crypt, come from sysfs.
+#define MAX_MOUNTED_DEVICES 256
 
-	// If writing to the MMC, cap the number of bytes to write to the file size.
-	if (!read_from_mmc) {
-	    struct stat st;
-	    if (fstat(data_fd, &st))
-		err(EXIT_FAILURE, "fstat");
+struct device_set
+{
+    dev_t devs[MAX_MOUNTED_DEVICES];
+    int count;
+};
 
-	    if (total_to_copy == 0 ||
-                st.st_size < total_to_copy)
-		total_to_copy = st.st_size;
-	}
-    } else {
-	// Reading from stdin or stdout.
-	if (read_from_mmc) {
-	    data_fd = STDOUT_FILENO;
+bool add_block_devices(struct device_set *set, const char *sysdir, struct failure *failure)
+{
+    // Add the device for this sysfs directory, its partitions and
+    // holders.
+    char path[PATH_MAX];
+    char value[32];
+    unsigned int maj, min;
+    snprintf(path, sizeof(path), "%s/dev", sysdir);
+    if (!read_sysfs_string(path, value, sizeof(value)) || sscanf(value, "%u:%u", &maj, &min) != 2)
+        return true;
 
-	    // Force quiet to true so that progress reports don't stomp on
-	    // the data.
-	    quiet = true;
-	} else
-	    data_fd = STDIN_FILENO;
+    int i;
+    for (i = 0; i < set->count; i++) {
+        if (set->devs[i] == makedev(maj, min))
+            return true;
     }
+    if (set->count == MAX_MOUNTED_DEVICES)
+        return fail(failure, "Too many partitions");
+    set->devs[set->count++] = makedev(maj, min);
 
-    if (numeric_progress &&
-            total_to_copy == 0)
-        errx(EXIT_FAILURE, "Specify input size to report numeric progress");
+    bool ok = true;
+    DIR *dir = opendir(sysdir);
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/%s/partition", sysdir, entry->d_name);
+            if (ok && entry->d_name[0] != '.' && stat(path, &st) == 0) {
+                snprintf(path, sizeof(path), "%s/%s", sysdir, entry->d_name);
+                ok = add_block_devices(set, path, failure);
+            }
+        }
+        closedir(dir);
+    }
 
-    // Unmount everything so that our read and writes to the device are
-    // unaffected by file system caches or other concurrent activity.
-    umount_all_on_dev(mmc_device);
+    snprintf(path, sizeof(path), "%s/holders", sysdir);
+    dir = opendir(path);
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (ok && entry->d_name[0] != '.') {
+                snprintf(path, sizeof(path), "/sys/class/block/%s", entry->d_name);
+                ok = add_block_devices(set, path, failure);
+            }
+        }
+        closedir(dir);
+    }
+    return ok;
+}
 
-    int mmc_fd = open(mmc_device, read_from_mmc ? O_RDONLY : (O_WRONLY | O_SYNC));
-    if (mmc_fd < 0) {
-        if (errno == EROFS)
-            errx(EXIT_FAILURE, "%s isn't writable. Check permissions or write-protect switch", mmc_device);
-        else
-            err(EXIT_FAILURE, "%s", mmc_device);
+struct umount_job
+{
+    const char *mountpoint;
+    int error;
+    pthread_t thread;
+};
+
+void *umount_thread(void *arg)
+{
+    struct umount_job *job = (struct umount_job *) arg;
+    job->error = umount2(job->mountpoint, 0) < 0 ? errno : 0;
+    return NULL;
+}
+
+bool run_umount(const char *mountpoint, struct failure *failure)
+{
+    // umount(8) keeps /etc/mtab up to date on systems where it's still a
+    // file. Run it directly rather than through a shell.
+    pid_t pid = fork();
+    if (pid < 0)
+        return fail_errno(failure, "fork");
+    if (pid == 0) {
+        execl("/bin/umount", "umount", mountpoint, (char *) NULL);
+        _exit(127);
     }
 
-    // Update the progress to 0% to give the user quick feedback
-    report_progress(0, total_to_copy);
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return fail_errno(failure, "waitpid");
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return fail(failure, "/bin/umount %s failed", mountpoint);
+    return true;
+}
 
-    if (trim_mmc_device)
-        trim_mmc(mmc_fd);
+bool umount_all_on_dev(const char *mmc_device, struct failure *failure)
+{
+    // Returns false after recording an error in failure if something on
+    // the device couldn't be unmounted.
+    struct stat st;
+    if (stat(mmc_device, &st) < 0 || !S_ISBLK(st.st_mode))
+        return true;
 
-    if (lseek(mmc_fd, seek_offset, SEEK_SET) == (off_t) -1)
-        err(EXIT_FAILURE, "lseek");
+    struct device_set set;
+    char sysdir[64];
+    set.count = 0;
+    sprintf(sysdir, "/sys/dev/block/%u:%u", major(st.st_rdev), minor(st.st_rdev));
+    if (!add_block_devices(&set, sysdir, failure))
+        return false;
 
-    if (read_from_mmc)
-	copy(mmc_fd, data_fd, total_to_copy);
-    else
-	copy(data_fd, mmc_fd, total_to_copy);
+    FILE *fp = fopen("/proc/self/mountinfo", "r");
+    if (!fp)
+        return fail_errno(failure, "/proc/self/mountinfo");
 
-    close(mmc_fd);
-    if (data_fd != STDOUT_FILENO && data_fd != STDIN_FILENO)
-        close(data_fd);
+    char **todo = NULL;
+    int todo_ix = 0;
+    int i;
+    bool ok = true;
+
+    char *line = NULL;
+    size_t line_size = 0;
+    while (ok && getline(&line, &line_size, fp) >= 0) {
+        unsigned int maj, min;
+        char *mountpoint = (char *) malloc(strlen(line) + 1);
+        if (!mountpoint) {
+            ok = fail_errno(failure, "malloc");
+            break;
+        }
+        if (sscanf(line, "%*d %*d %u:%u %*s %s", &maj, &min, mountpoint) == 3) {
+            for (i = 0; i < set.count; i++) {
+                if (set.devs[i] == makedev(maj, min))
+                    break;
+            }
+            if (i < set.count) {
+                // strings from mountinfo are escaped, so unescape them
+                char **bigger = (char **) realloc(todo, (todo_ix + 1) * sizeof(char *));
+                char *unescaped = bigger ? unescape_string(mountpoint) : NULL;
+                if (bigger)
+                    todo = bigger;
+                if (unescaped)
+                    todo[todo_ix++] = unescaped;
+                else
+                    ok = fail_errno(failure, "malloc");
+            }
+        }
+        free(mountpoint);
+    }
+    free(line);
+    fclose(fp);
 
-    exit(EXIT_SUCCESS);
+    bool legacy_mtab = (lstat("/etc/mtab", &st) == 0 && S_ISREG(st.st_mode));
+    if (!ok || todo_ix == 0) {
+        // Nothing to unmount
+    } else if (legacy_mtab) {
+        for (i = todo_ix - 1; ok && i >= 0; i--)
+            ok = run_umount(todo[i], failure);
+    } else {
+        // Each unmount flushes its file system, so do them all at once.
+        // Mounts inside other mounts make the outer ones busy, so retry
+        // those afterwards, innermost first.
+        struct umount_job *jobs = (struct umount_job *) calloc(todo_ix, sizeof(struct umount_job));
+        if (!jobs)
+            ok = fail_errno(failure, "calloc");
+        int started = 0;
+        for (; ok && started < todo_ix; started++) {
+            jobs[started].mountpoint = todo[started];
+            if (pthread_create(&jobs[started].thread, NULL, umount_thread, &jobs[started]))
+                ok = fail(failure, "Can't start umount thread");
+        }
+        if (!ok && started > 0)
+            started--;
+        for (i = 0; i < started; i++)
+            pthread_join(jobs[i].thread, NULL);
+        for (i = todo_ix - 1; ok && i >= 0; i--) {
+            if (jobs[i].error == EBUSY)
+                umount_thread(&jobs[i]);
+            if (jobs[i].error) {
+                errno = jobs[i].error;
+                ok = fail_errno(failure, "umount %s", todo[i]);
+            }
+        }
+        free(jobs);
+    }
+
+    for (i = 0; i < todo_ix; i++)
+        free(todo[i]);
+    free(todo);
+    return ok;
+}
+
+int open_mmc(const char *mmc_device, int flags, struct failure *failure)
+{
+    // Block devices are opened exclusively so that nothing can mount them
+    // while they're being copied. If an automounter got in after
+    // umount_all_on_dev, unmount once more. Returns -1 with errno set if
+    // the device can't be opened, or after recording an error in failure
+    // if it's still in use.
+    struct stat st;
+    if (stat(mmc_device, &st) == 0 && S_ISBLK(st.st_mode))
+        flags |= O_EXCL;
+
+    int fd = open(mmc_device, flags);
+    if (fd < 0 && errno == EBUSY) {
+        if (!umount_all_on_dev(mmc_device, failure))
+            return -1;
+        fd = open(mmc_device, flags);
+        if (fd < 0 && errno == EBUSY)
+            fail(failure, "%s is in use. Is another program using it or mounting it?", mmc_device);
+    }
+    return fd;
+}
+
+// eMMC boot partitions are read-only until force_ro is cleared. It's set
+// again when the copy finishes.
+void restore_force_ro(struct copy_context *ctx)
+{
+    int i;
+    for (i = 0; i < ctx->force_ro_count; i++) {
+        FILE *fp = fopen(ctx->force_ro_paths[i], "w");
+        if (!fp || fputs("1", fp) == EOF)
+            warning_errno(ctx, "Can't make %s read-only again", ctx->force_ro_paths[i]);
+        if (fp)
+            fclose(fp);
+    }
+    ctx->force_ro_count = 0;
+}
+
+bool unlock_boot_partition(struct copy_context *ctx, const char *mmc_device)
+{
+    char resolved[PATH_MAX];
+    if (!realpath(mmc_device, resolved))
+        return true;
+    const char *name = strrchr(resolved, '/') + 1;
+    if (strncmp(name, "mmcblk", 6) != 0 || !strstr(name, "boot") || strlen(name) > 32)
+        return true;
+
+    char path[96];
+    uint64_t value;
+    sprintf(path, "/sys/block/%s/force_ro", name);
+    if (!read_sysfs_u64(path, &value) || value == 0)
+        return true;
+
+    FILE *fp = fopen(path, "w");
+    bool ok = fp && fputs("0", fp) != EOF;
+    if (fp && fclose(fp) == EOF)
+        ok = false;
+    if (!ok)
+        return fail_errno(&ctx->failure, "Can't make %s writable", mmc_device);
+    strcpy(ctx->force_ro_paths[ctx->force_ro_count++], path);
+    return true;
+}
+
+bool trim_range(int fd, uint64_t start, uint64_t len, bool raw_mmc)
+{
+    // TRIM part of the memory card. Regular files get a hole punched
+    // instead. Returns false with errno set on failure.
+    struct stat st;
+    if (fstat(fd, &st))
+        return false;
+    if (S_ISREG(st.st_mode))
+        return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, len) == 0;
+
+    // With --raw-mmc, eMMC devices get the DISCARD command directly
+    struct emmc *e = raw_mmc ? emmc_open(fd) : NULL;
+    if (e) {
+        bool ok = emmc_discard(e, start, len);
+        emmc_free(e);
+        return ok;
+    }
+
+    // BLKDISCARD needs whole sectors, so only discard those
+    uint64_t end = (start + len) & ~511ULL;
+    start = (start + 511) & ~511ULL;
+    if (end <= start)
+        return true;
+
+    uint64_t range[2] = { start, end - start };
+    return ioctl(fd, BLKDISCARD, &range) == 0;
+}
+
+bool trim_mmc(int fd, bool raw_mmc)
+{
+    // Run the TRIM command on the MMC file handle to free all currently
+    // allocated blocks back to the MMC firmware. Returns false with errno
+    // set on failure.
+    uint64_t size;
+    if (ioctl(fd, BLKGETSIZE64, &size))
+        return false;
+
+    return trim_range(fd, 0, size, raw_mmc);
+}
+
+// Range TRIM support. Rather than discarding the whole device up front,
+// the regions that the copy skips and the area after the image are sent to
+// a thread that discards them while the writes continue.
+#define DISCARD_QUEUE_LEN 64
+
+struct discard_range
+{
+    uint64_t start;
+    uint64_t end;
+};
+
+struct discard_queue
+{
+    int fd;
+    int error;              // errno of the first failed discard. Held with lock.
+    bool is_file;           // Punch holes in regular files instead of BLKDISCARD
+    uint64_t granularity;
+    uint64_t max_bytes;
+
+    // Adjacent skipped regions are merged here before being queued
+    uint64_t pending_start;
+    uint64_t pending_end;
+
+    struct discard_range queue[DISCARD_QUEUE_LEN];
+    int head;
+    int count;
+    bool done;
+    bool canceled;          // Drop what's left without discarding it
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+};
+
+bool read_block_attribute(int fd, const char *name, uint64_t *value)
+{
+    // Partitions don't have queue or device directories, so look at the
+    // parent device if needed.
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISBLK(st.st_mode))
+        return false;
+
+    char path[160];
+    sprintf(path, "/sys/dev/block/%u:%u/%s", major(st.st_rdev), minor(st.st_rdev), name);
+    if (read_sysfs_u64(path, value))
+        return true;
+
+    sprintf(path, "/sys/dev/block/%u:%u/../%s", major(st.st_rdev), minor(st.st_rdev), name);
+    return read_sysfs_u64(path, value);
+}
+
+bool issue_discard(struct discard_queue *dq, uint64_t start, uint64_t end)
+{
+    // Only discard whole granules. Anything partial is left alone.
+    if (start % dq->granularity)
+        start += dq->granularity - (start % dq->granularity);
+    end -= end % dq->granularity;
+
+    while (start < end) {
+        uint64_t range[2];
+        range[0] = start;
+        range[1] = end - start;
+        if (range[1] > dq->max_bytes)
+            range[1] = dq->max_bytes;
+
+        if (dq->is_file) {
+            if (fallocate(dq->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, range[0], range[1]))
+                return false;
+        } else if (ioctl(dq->fd, BLKDISCARD, &range))
+            return false;
+
+        start += range[1];
+    }
+    return true;
+}
+
+void discard_error(struct discard_queue *dq, int error)
+{
+    // Keep the first error. Call with the lock held.
+    if (!dq->error)
+        dq->error = error;
+}
+
+void *discard_thread(void *arg)
+{
+    struct discard_queue *dq = (struct discard_queue *) arg;
+
+    pthread_mutex_lock(&dq->lock);
+    for (;;) {
+        while (dq->count == 0 && !dq->done)
+            pthread_cond_wait(&dq->cond, &dq->lock);
+        if (dq->count == 0)
+            break;
+
+        struct discard_range r = dq->queue[dq->head];
+        bool skip = dq->canceled || dq->error != 0;
+        pthread_mutex_unlock(&dq->lock);
+
+        // After a failure or a canceled queue, keep draining it so that
+        // the writer doesn't block, but don't send any more discards.
+        bool ok = skip || issue_discard(dq, r.start, r.end);
+        int error = errno;
+
+        pthread_mutex_lock(&dq->lock);
+        if (!ok)
+            discard_error(dq, error);
+        dq->head = (dq->head + 1) % DISCARD_QUEUE_LEN;
+        dq->count--;
+        pthread_cond_signal(&dq->cond);
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return NULL;
+}
+
+struct discard_queue *discard_init(int fd, struct failure *failure)
+{
+    // Returns NULL after recording an error in failure
+    struct stat st;
+    if (fstat(fd, &st)) {
+        fail_errno(failure, "fstat");
+        return NULL;
+    }
+
+    struct discard_queue *dq = (struct discard_queue *) calloc(1, sizeof(struct discard_queue));
+    if (!dq) {
+        fail_errno(failure, "calloc");
+        return NULL;
+    }
+    dq->fd = fd;
+
+    if (S_ISREG(st.st_mode)) {
+        dq->is_file = true;
+        dq->granularity = st.st_blksize;
+        dq->max_bytes = ONE_GiB;
+    } else {
+        // Size each discard based on what the device reports. A maximum
+        // of 0 means that discard isn't supported at all.
+        if (!read_block_attribute(fd, "queue/discard_max_bytes", &dq->max_bytes))
+            dq->max_bytes = ONE_GiB;
+        if (dq->max_bytes == 0) {
+            fail(failure, "Memory card doesn't support the TRIM command");
+            free(dq);
+            return NULL;
+        }
+        if (!read_block_attribute(fd, "queue/discard_granularity", &dq->granularity))
+            dq->granularity = 0;
+    }
+    if (dq->granularity < 512)
+        dq->granularity = 512;
+
+    // Keep each discard a whole number of granules
+    dq->max_bytes -= dq->max_bytes % dq->granularity;
+    if (dq->max_bytes == 0)
+        dq->max_bytes = dq->granularity;
+
+    pthread_mutex_init(&dq->lock, NULL);
+    pthread_cond_init(&dq->cond, NULL);
+    if (pthread_create(&dq->thread, NULL, discard_thread, dq)) {
+        fail(failure, "Can't start discard thread");
+        pthread_cond_destroy(&dq->cond);
+        pthread_mutex_destroy(&dq->lock);
+        free(dq);
+        return NULL;
+    }
+    return dq;
+}
+
+void discard_queue_range(struct discard_queue *dq, uint64_t start, uint64_t end)
+{
+    pthread_mutex_lock(&dq->lock);
+    while (dq->count == DISCARD_QUEUE_LEN)
+        pthread_cond_wait(&dq->cond, &dq->lock);
+    struct discard_range *r = &dq->queue[(dq->head + dq->count) % DISCARD_QUEUE_LEN];
+    r->start = start;
+    r->end = end;
+    dq->count++;
+    pthread_cond_signal(&dq->cond);
+    pthread_mutex_unlock(&dq->lock);
+}
+
+void discard_skipped(struct discard_queue *dq, off_t offset, size_t len)
+{
+    // Called from the writer for every region that the copy skips.
+    // Adjacent regions are merged so that the discards are large.
+    if (!dq || len == 0)
+        return;
+
+    if (dq->pending_end == (uint64_t) offset && dq->pending_end != dq->pending_start) {
+        dq->pending_end += len;
+    } else {
+        if (dq->pending_end != dq->pending_start)
+            discard_queue_range(dq, dq->pending_start, dq->pending_end);
+        dq->pending_start = offset;
+        dq->pending_end = offset + len;
+    }
+
+    if (dq->pending_end - dq->pending_start >= dq->max_bytes) {
+        discard_queue_range(dq, dq->pending_start, dq->pending_end);
+        dq->pending_start = dq->pending_end;
+    }
+}
+
+bool discard_finish(struct discard_queue *dq, off_t image_end)
+{
+    // Discard everything after the image and wait for all of the
+    // discards to complete. Returns false with errno set if any failed.
+    uint64_t device_end = 0;
+    int size_error = 0;
+    if (dq->is_file) {
+        struct stat st;
+        if (fstat(dq->fd, &st) == 0)
+            device_end = st.st_size;
+        else
+            size_error = errno;
+    } else if (ioctl(dq->fd, BLKGETSIZE64, &device_end))
+        size_error = errno;
+
+    if (device_end > (uint64_t) image_end)
+        discard_skipped(dq, image_end, device_end - image_end);
+    if (dq->pending_end != dq->pending_start)
+        discard_queue_range(dq, dq->pending_start, dq->pending_end);
+
+    pthread_mutex_lock(&dq->lock);
+    if (size_error)
+        discard_error(dq, size_error);
+    dq->done = true;
+    pthread_cond_signal(&dq->cond);
+    pthread_mutex_unlock(&dq->lock);
+
+    pthread_join(dq->thread, NULL);
+    pthread_mutex_lock(&dq->lock);
+    int error = dq->error;
+    pthread_mutex_unlock(&dq->lock);
+    pthread_cond_destroy(&dq->cond);
+    pthread_mutex_destroy(&dq->lock);
+    free(dq);
+    errno = error;
+    return error == 0;
+}
+
+void discard_cancel(struct discard_queue *dq)
+{
+    // Stop the thread after a failed copy. The rest of the memory card
+    // isn't discarded since the image didn't make it there.
+    pthread_mutex_lock(&dq->lock);
+    dq->canceled = true;
+    dq->done = true;
+    pthread_cond_signal(&dq->cond);
+    pthread_mutex_unlock(&dq->lock);
+
+    pthread_join(dq->thread, NULL);
+    pthread_cond_destroy(&dq->cond);
+    pthread_mutex_destroy(&dq->lock);
+    free(dq);
+}
+
+double calculate_progress(size_t written, size_t total)
+{
+    if (total > 0)
+        return 100.0 * written / total;
+    else
+        return 0;
+}
+
+double monotonic_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int latency_bucket(uint64_t us)
+{
+    // Buckets are powers of two split into four, so percentiles are
+    // within 25%.
+    if (us < 4)
+        return (int) us;
+    int msb = 63 - __builtin_clzll(us);
+    int bucket = (msb - 1) * 4 + ((us >> (msb - 2)) & 3);
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+uint64_t latency_bucket_value(int bucket)
+{
+    if (bucket < 4)
+        return bucket;
+    return (uint64_t) (4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+bool telemetry_active(const struct telemetry *telemetry)
+{
+    return telemetry->fd >= 0 || telemetry->callback;
+}
+
+void telemetry_write_latency(struct telemetry *telemetry, double seconds)
+{
+    if (!telemetry_active(telemetry))
+        return;
+
+    uint64_t us = (uint64_t) (seconds * 1e6);
+    __atomic_fetch_add(&telemetry->latency_counts[latency_bucket(us)], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&telemetry->latency_max, __ATOMIC_RELAXED);
+    while (us > max && !__atomic_compare_exchange_n(&telemetry->latency_max, &max, us, true,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void telemetry_wait(struct telemetry *telemetry, bool input, double seconds)
+{
+    if (telemetry_active(telemetry))
+        __atomic_fetch_add(input ? &telemetry->input_wait_us : &telemetry->output_wait_us,
+                           (uint64_t) (seconds * 1e6), __ATOMIC_RELAXED);
+}
+
+uint64_t latency_percentile(const uint64_t *counts, uint64_t count, double fraction)
+{
+    uint64_t target = (uint64_t) (count * fraction);
+    uint64_t seen = 0;
+    int i;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen > target)
+            return latency_bucket_value(i);
+    }
+    return 0;
+}
+
+void telemetry_emit(struct telemetry *telemetry, bool final)
+{
+    double now = monotonic_seconds();
+    size_t done = __atomic_load_n(&telemetry->done, __ATOMIC_RELAXED);
+    size_t total = __atomic_load_n(&telemetry->total, __ATOMIC_RELAXED);
+
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t count = 0;
+    int i;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        counts[i] = __atomic_load_n(&telemetry->latency_counts[i], __ATOMIC_RELAXED);
+        count += counts[i];
+    }
+
+    double elapsed = now - telemetry->start_time;
+    double interval = now - telemetry->last_time;
+    double average = elapsed > 0 ? done / elapsed / 1e6 : 0;
+    double current = interval > 0 ? (done - telemetry->last_done) / interval / 1e6 : 0;
+    double eta = (total > done && average > 0) ? (total - done) / (average * 1e6) : 0;
+
+    if (telemetry->callback) {
+        struct mmccopy_progress p;
+        p.bytes = done;
+        p.total = total;
+        p.mbps = current;
+        p.avg_mbps = average;
+        p.p50_ms = latency_percentile(counts, count, 0.5) / 1e3;
+        p.p99_ms = latency_percentile(counts, count, 0.99) / 1e3;
+        p.eta_s = eta;
+        telemetry->callback(&p, telemetry->callback_arg);
+    }
+
+    char line[512];
+    int len = snprintf(line, sizeof(line),
+                       "{\"time\":%.3f,\"bytes\":%llu,\"total\":%llu,\"mbps\":%.2f,\"avg_mbps\":%.2f,"
+                       "\"writes\":%llu,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f,"
+                       "\"input_wait_s\":%.3f,\"output_wait_s\":%.3f,\"eta_s\":%.1f,\"done\":%s}\n",
+                       elapsed, (unsigned long long) done, (unsigned long long) total, current, average,
+                       (unsigned long long) count,
+                       latency_percentile(counts, count, 0.5) / 1e3,
+                       latency_percentile(counts, count, 0.99) / 1e3,
+                       __atomic_load_n(&telemetry->latency_max, __ATOMIC_RELAXED) / 1e3,
+                       __atomic_load_n(&telemetry->input_wait_us, __ATOMIC_RELAXED) / 1e6,
+                       __atomic_load_n(&telemetry->output_wait_us, __ATOMIC_RELAXED) / 1e6,
+                       eta, final ? "true" : "false");
+
+    // Lines are shorter than PIPE_BUF so they're written in one go. A
+    // consumer that goes away shouldn't stop the copy.
+    if (telemetry->fd >= 0 && len > 0 && write(telemetry->fd, line, len) != len)
+        telemetry->fd = -1;
+
+    telemetry->last_time = now;
+    telemetry->last_done = done;
+    telemetry->next_time = now + TELEMETRY_INTERVAL;
+}
+
+void telemetry_progress(struct telemetry *telemetry, size_t done, size_t total)
+{
+    if (!telemetry_active(telemetry))
+        return;
+
+    __atomic_store_n(&telemetry->done, done, __ATOMIC_RELAXED);
+    __atomic_store_n(&telemetry->total, total, __ATOMIC_RELAXED);
+}
+
+void telemetry_tick(struct telemetry *telemetry)
+{
+    // Called by the progress thread
+    if (!telemetry_active(telemetry))
+        return;
+
+    pthread_mutex_lock(&telemetry->lock);
+    if (monotonic_seconds() >= telemetry->next_time)
+        telemetry_emit(telemetry, false);
+    pthread_mutex_unlock(&telemetry->lock);
+}
+
+void telemetry_end(struct telemetry *telemetry)
+{
+    if (!telemetry_active(telemetry))
+        return;
+
+    pthread_mutex_lock(&telemetry->lock);
+    telemetry_emit(telemetry, true);
+    pthread_mutex_unlock(&telemetry->lock);
+}
+
+void set_progress(struct progress *progress, size_t done, size_t total)
+{
+    __atomic_store_n(&progress->total, total, __ATOMIC_RELAXED);
+    __atomic_store_n(&progress->done, done, __ATOMIC_RELAXED);
+    __atomic_store_n(&progress->reported, true, __ATOMIC_RELEASE);
+}
+
+void report_progress(struct copy_context *ctx, size_t written, size_t total)
+{
+    telemetry_progress(&ctx->telemetry, written, total);
+    set_progress(&ctx->progress, written, total);
+}
+
+void print_progress(struct copy_context *ctx)
+{
+    // Called with progress.lock held. Only print when the text changes.
+    struct progress *progress = &ctx->progress;
+    if (ctx->quiet || ctx->json_progress || !__atomic_load_n(&progress->reported, __ATOMIC_ACQUIRE))
+        return;
+
+    size_t done = __atomic_load_n(&progress->done, __ATOMIC_RELAXED);
+    size_t total = __atomic_load_n(&progress->total, __ATOMIC_RELAXED);
+    char text[32];
+    if (total > 0 || ctx->numeric_progress)
+        sprintf(text, "%.0f", calculate_progress(done, total));
+    else
+        pretty_size(done, text);
+    if (strcmp(text, progress->last) == 0)
+        return;
+    strcpy(progress->last, text);
+
+    if (ctx->numeric_progress) {
+        // If numeric, write the percentage if we can figure it out.
+        fprintf(ctx->progress_out, "%s\n", text);
+    } else {
+        // If this is for a human, then print the percent complete
+        // if we can calculate it or the bytes written.
+        const char *label = progress->label ? progress->label : "";
+        if (total > 0)
+            fprintf(ctx->progress_out, "\r%s%s%%", label, text);
+        else
+            fprintf(ctx->progress_out, "\r%s%s     ", label, text);
+    }
+    fflush(ctx->progress_out);
+}
+
+// A chunk of the image on its way from the source to the destination.
+struct copy_buffer
+{
+    char *storage;  // Memory allocated for the buffer
+    char *data;     // Either storage or a view of a memory mapped image
+    size_t len;
+    off_t offset;  // Destination offset of the data or -1 if writing sequentially
+    bool hole;     // The source has a hole here, so there's no data
+};
+
+// Reads the source into buffers. This is shared by the pipeline and the
+// io_uring backends.
+struct copy_source
+{
+    struct copy_context *ctx;
+    int fd;
+    size_t total_to_copy;  // 0 if unknown
+    size_t total_read;
+    off_t to_offset;       // Destination offset of the first byte or -1. With
+                           // a job, this is adjusted for each segment.
+    size_t alignment;      // O_DIRECT alignment or 0 for normal writes
+    size_t erase_size;     // Keep chunks within erase blocks of this size if set
+
+    // Regular files are read with pread so that the parts without data
+    // can be skipped without reading them.
+    bool seekable;
+    off_t from_offset;     // Offset in the source of the next byte
+    off_t from_size;
+
+    struct decompressor *decoder;  // Decompress the source if set
+    struct prefetch *prefetch;     // Read the source through this if set
+
+    bool seek_holes;       // Skip holes in the source using SEEK_DATA/SEEK_HOLE
+    const struct range_map *map;  // Only copy these ranges if set
+    size_t range_ix;
+    struct sha256_ctx range_hash;
+
+    struct verify_log *verify;  // Record what's written for --verify
+    struct image_cache *cache;  // Store what's read with --cache if set
+    bool keep_cached;           // Leave the image in the page cache for other copies
+
+    const char *mapped;         // Memory mapped image with --mmap
+    off_t advised_end;          // End of the read ahead window
+    off_t released;             // Everything before this has been dropped
+    size_t lag;                 // How far behind the writers can be
+    size_t chunk_size;          // Size of each read. Adaptive sizing changes this.
+
+    const struct copy_job *job; // Copy these segments instead of fd if set
+    off_t job_base;             // Offset that the segment offsets are relative to
+    int segment_ix;
+    size_t segment_end;         // total_read at the end of the current segment
+};
+
+// Where the copy goes. Writing to several memory cards at once has one of
+// these for each card.
+struct copy_dest
+{
+    struct copy_context *ctx;
+    const char *path;
+    int fd;
+    off_t offset;          // Starting offset or -1 if writing sequentially
+    size_t alignment;      // O_DIRECT alignment or 0 for normal writes
+    size_t erase_size;     // Erase block size of the memory card or 0
+    struct emmc *emmc;     // Write with MMC commands if set
+    struct discard_queue *discards;  // Discard skipped regions if set
+    struct compressor *compressor;   // Compress everything written if set
+    char *compare;         // Buffer for what's on the card with --delta
+    size_t unchanged;      // Bytes that --delta didn't need to write
+
+    // With --coalesce, writes that don't cover a whole block are merged
+    // into the pending block and written once it's complete.
+    size_t coalesce;       // Block size or 0 if not coalescing
+    char *pending;
+    char *scratch;         // What's on the card around the pending data
+    off_t pending_start;   // Offset of the pending block or -1 if none
+    size_t pending_lo;     // New data in the pending block
+    size_t pending_hi;
+    bool pending_loaded;   // The rest of the block was read from the card
+
+    size_t written;
+    uint64_t drain_seq;    // Sequence number of the next buffer to write
+    int error;             // errno if the copy to this destination failed
+    bool verify_failed;    // The readback didn't match the image
+    off_t bad_offset;      // Start of the first block that didn't match
+    bool done;
+    size_t progress;       // Bytes to show in the progress
+    double reported;       // Last progress shown for this destination
+
+    struct copy_ring *ring;
+    pthread_t thread;
+};
+
+// With -b auto, the chunk size is tuned during the first part of the copy.
+// It starts at the size that sysfs suggests for the memory card and then
+// doubles while throughput improves. If the first step up doesn't help,
+// it halves instead. Once neither helps, the best size is used for the
+// rest of the copy.
+struct chunk_tuner
+{
+    size_t start_size;
+    size_t size;          // Size being measured
+    int direction;        // 1 when trying bigger sizes, -1 for smaller
+    bool locked;
+
+    size_t best_size;
+    double best_rate;
+
+    size_t sample_bytes;  // Bytes written at this size and how long it took
+    double sample_seconds;
+};
+
+// The copy runs as a pipeline. A reader thread fills a ring of buffers
+// from the source while writer threads drain them to each destination.
+// This keeps both the source and the memory cards busy at the same time.
+// A buffer is refilled only after every destination has written it, so a
+// slow memory card can fall at most a ring's worth behind before it holds
+// up the others.
+struct copy_ring
+{
+    struct copy_buffer *buffers;
+    int depth;
+
+    uint64_t fill_seq;  // Number of buffers filled so far
+    bool eof;           // The reader won't fill any more buffers
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    struct copy_source source;
+    struct copy_dest *dests;
+    int dest_count;
+
+    struct chunk_tuner *tuner;  // Set when the chunk size is adaptive
+};
+
+size_t sd_au_size(int fd)
+{
+    // The allocation unit size of SD cards is in bits 431:428 of the SD
+    // Status register, which sysfs prints as 16 32-bit words.
+    static const size_t large_au_sizes[] = {
+        12 * ONE_MiB, 16 * ONE_MiB, 24 * ONE_MiB, 32 * ONE_MiB, 64 * ONE_MiB
+    };
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISBLK(st.st_mode))
+        return 0;
+
+    char path[160];
+    char ssr[160];
+    sprintf(path, "/sys/dev/block/%u:%u/device/ssr", major(st.st_rdev), minor(st.st_rdev));
+    if (!read_sysfs_string(path, ssr, sizeof(ssr))) {
+        sprintf(path, "/sys/dev/block/%u:%u/../device/ssr", major(st.st_rdev), minor(st.st_rdev));
+        if (!read_sysfs_string(path, ssr, sizeof(ssr)))
+            return 0;
+    }
+    if (strlen(ssr) < 128)
+        return 0;
+
+    char word[9];
+    memcpy(word, ssr + 16, 8);
+    word[8] = '\0';
+    unsigned int au = (strtoul(word, NULL, 16) >> 12) & 0xf;
+    if (au == 0)
+        return 0;
+    else if (au <= 0xa)
+        return (16 * ONE_KiB) << (au - 1);
+    else
+        return large_au_sizes[au - 0xb];
+}
+
+size_t erase_block_size(int fd)
+{
+    // Returns the erase block or SD allocation unit size of the memory
+    // card or 0 if it isn't known. The kernel reports the allocation unit
+    // as the preferred erase size for SD cards when it can read it.
+    uint64_t value;
+    if (read_block_attribute(fd, "device/preferred_erase_size", &value) && value > 0 && value % 512 == 0)
+        return value;
+    return sd_au_size(fd);
+}
+
+size_t suggested_chunk_size(int fd)
+{
+    // Prefer the erase block size of MMC and SD cards, then what the
+    // block layer says is optimal and finally the largest request that it
+    // sends without splitting.
+    uint64_t value;
+    size_t size = erase_block_size(fd);
+    if (size == 0 && read_block_attribute(fd, "queue/optimal_io_size", &value) && value > 0)
+        size = value;
+    else if (size == 0 && read_block_attribute(fd, "queue/max_sectors_kb", &value) && value > 0)
+        size = value * ONE_KiB;
+
+    if (size < TUNE_MIN_CHUNK_SIZE || size > TUNE_MAX_CHUNK_SIZE || size % MIN_CHUNK_SIZE)
+        size = DEFAULT_CHUNK_SIZE;
+    return size;
+}
+
+void tuner_init(struct chunk_tuner *tuner, int fd)
+{
+    memset(tuner, 0, sizeof(*tuner));
+    tuner->start_size = suggested_chunk_size(fd);
+    tuner->size = tuner->start_size;
+    tuner->best_size = tuner->start_size;
+    tuner->direction = 1;
+}
+
+void tuner_record(struct chunk_tuner *tuner, size_t *chunk_size, size_t len, double seconds)
+{
+    // Only count full sized chunks. The reader may still be handing out
+    // chunks of the previous size for a little while after a change.
+    if (tuner->locked || len != tuner->size)
+        return;
+
+    tuner->sample_bytes += len;
+    tuner->sample_seconds += seconds;
+    if (tuner->sample_bytes < TUNE_SAMPLE_SIZE)
+        return;
+
+    // Require a 5% improvement so that noise doesn't pick a size
+    double rate = tuner->sample_bytes / tuner->sample_seconds;
+    bool better = (tuner->best_rate == 0 || rate > tuner->best_rate * 1.05);
+    if (better) {
+        tuner->best_size = tuner->size;
+        tuner->best_rate = rate;
+    }
+
+    size_t next = 0;
+    if (better || tuner->direction > 0) {
+        if (!better && tuner->size == tuner->start_size * 2)
+            tuner->direction = -1;
+        else if (!better)
+            tuner->direction = 0;
+
+        if (tuner->direction > 0)
+            next = tuner->best_size * 2;
+        else if (tuner->direction < 0)
+            next = tuner->best_size / 2;
+    }
+
+    if (next < TUNE_MIN_CHUNK_SIZE || next > TUNE_MAX_CHUNK_SIZE) {
+        tuner->locked = true;
+        next = tuner->best_size;
+    }
+    tuner->size = next;
+    tuner->sample_bytes = 0;
+    tuner->sample_seconds = 0;
+    __atomic_store_n(chunk_size, next, __ATOMIC_RELAXED);
+}
+
+void report_chunk_size(struct copy_context *ctx, const struct chunk_tuner *tuner)
+{
+    char sizestr[32];
+    pretty_size(tuner->best_size, sizestr);
+    fflush(ctx->progress_out);
+    if (tuner->best_size % ONE_MiB == 0)
+        fprintf(stderr, "Adaptive chunk size settled on %s (pin it with -b %dM)\n",
+                sizestr, (int) (tuner->best_size / ONE_MiB));
+    else
+        fprintf(stderr, "Adaptive chunk size settled on %s (pin it with -b %dK)\n",
+                sizestr, (int) (tuner->best_size / ONE_KiB));
+}
+
+
+ssize_t read_fully_at(int fd, char *buffer, size_t len, off_t offset)
+{
+    // Keep reading until the buffer is full or the end of the input
+    // so that writes to the memory card are as large as possible. If
+    // offset is negative, read from the current position. Returns -1 with
+    // errno set on failure.
+    size_t total_read = 0;
+    while (total_read < len) {
+        ssize_t amount_read;
+        if (offset < 0)
+            amount_read = read(fd, buffer + total_read, len - total_read);
+        else
+            amount_read = pread(fd, buffer + total_read, len - total_read, offset + total_read);
+        if (amount_read < 0) {
+            if (errno == EINTR)
+                continue;
+            else
+                return -1;
+        }
+
+        if (amount_read == 0)
+            break;
+
+        total_read += amount_read;
+    }
+    return total_read;
+}
+
+ssize_t read_fully(int fd, char *buffer, size_t len)
+{
+    return read_fully_at(fd, buffer, len, -1);
+}
+
+// Like read_fully_at, but also reports how much was read when it fails
+bool pread_fully(int fd, char *buffer, size_t len, off_t offset, size_t *amount_read)
+{
+    *amount_read = 0;
+    while (*amount_read < len) {
+        ssize_t amount = pread(fd, buffer + *amount_read, len - *amount_read, offset + *amount_read);
+        if (amount < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (amount == 0)
+            break;
+        *amount_read += amount;
+    }
+    return true;
+}
+
+// The write helpers return false with errno set on failure so that a
+// failing memory card doesn't stop writes to the others.
+bool write_fully(int fd, const char *buffer, size_t len)
+{
+    while (len > 0) {
+        ssize_t amount_written = write(fd, buffer, len);
+        if (amount_written < 0) {
+            if (errno == EINTR)
+                continue;
+            else
+                return false;
+        }
+
+        len -= amount_written;
+        buffer += amount_written;
+    }
+    return true;
+}
+
+void *alloc_buffer(size_t size)
+{
+    // Buffers are page aligned so that they can be used with O_DIRECT.
+    // Returns NULL with errno set if out of memory.
+    void *buffer;
+    int rc = posix_memalign(&buffer, sysconf(_SC_PAGESIZE), size);
+    if (rc != 0) {
+        errno = rc;
+        return NULL;
+    }
+    return buffer;
+}
+
+size_t direct_io_alignment(int fd)
+{
+    // O_DIRECT requires that offsets and lengths be multiples of the
+    // logical block size. Filesystems don't report this, so use 4 KiB for
+    // regular files since that works everywhere that we care about.
+    // Returns 0 with errno set on failure.
+    struct stat st;
+    if (fstat(fd, &st))
+        return 0;
+
+    int block_size = 4096;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKSSZGET, &block_size))
+        return 0;
+
+    return block_size < 512 ? 512 : block_size;
+}
+
+size_t next_chunk_size(off_t offset, size_t remaining, size_t alignment, size_t chunk_size,
+                       size_t erase_size)
+{
+    size_t amount = chunk_size;
+
+    // When using O_DIRECT, make the unaligned head its own chunk so that
+    // the remaining chunks are aligned both in memory and on the device.
+    if (alignment && (offset % alignment) != 0)
+        amount = alignment - (offset % alignment);
+
+    // Don't let writes straddle erase blocks. Cheap memory cards are much
+    // slower when a write programs parts of two of them. After a short
+    // head, chunks start on erase block boundaries.
+    if (erase_size && offset >= 0) {
+        off_t end = offset + (off_t) amount;
+        off_t boundary = end - (end % erase_size);
+        if (boundary > offset)
+            amount = boundary - offset;
+    }
+
+    return remaining < amount ? remaining : amount;
+}
+
+bool pwrite_fully(int fd, const char *buffer, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t amount_written = pwrite(fd, buffer, len, offset);
+        if (amount_written < 0) {
+            if (errno == EINTR)
+                continue;
+            else
+                return false;
+        }
+        if (amount_written == 0) {
+            // No progress writing to the memory card
+            errno = EIO;
+            return false;
+        }
+
+        len -= amount_written;
+        buffer += amount_written;
+        offset += amount_written;
+    }
+    return true;
+}
+
+bool write_unaligned(int fd, const char *data, size_t len, off_t offset, size_t alignment)
+{
+    // Read-modify-write the blocks that contain the data so that bytes
+    // around it aren't changed.
+    off_t start = offset - (offset % alignment);
+    off_t end = offset + len;
+    if (end % alignment)
+        end += alignment - (end % alignment);
+
+    size_t cover = end - start;
+    char *block = (char *) alloc_buffer(cover);
+    if (!block)
+        return false;
+    struct stat st;
+    ssize_t amount_read = pread(fd, block, cover, start);
+    if (amount_read < 0 || fstat(fd, &st)) {
+        free(block);
+        return false;
+    }
+    memset(block + amount_read, 0, cover - amount_read);
+    memcpy(block + (offset - start), data, len);
+
+    bool ok = pwrite_fully(fd, block, cover, start);
+    free(block);
+
+    // Don't let the padding grow a regular file past the end of the data.
+    if (ok && S_ISREG(st.st_mode) && st.st_size < end) {
+        off_t new_size = st.st_size > offset + (off_t) len ? st.st_size : offset + (off_t) len;
+        ok = (ftruncate(fd, new_size) == 0);
+    }
+    return ok;
+}
+
+bool write_chunk(int fd, const char *data, size_t len, off_t offset, size_t alignment)
+{
+    if (alignment == 0) {
+        if (offset < 0)
+            return write_fully(fd, data, len);
+        else
+            return pwrite_fully(fd, data, len, offset);
+    }
+
+    // O_DIRECT writes. The reader's chunking guarantees that only the
+    // first and the last chunk can be unaligned.
+    size_t aligned_len = len - (len % alignment);
+    if (offset % alignment || aligned_len == 0)
+        return write_unaligned(fd, data, len, offset, alignment);
+
+    if (!pwrite_fully(fd, data, aligned_len, offset))
+        return false;
+    if (aligned_len < len)
+        return write_unaligned(fd, data + aligned_len, len - aligned_len, offset + aligned_len, alignment);
+    return true;
+}
+
+size_t coalesce_block_size(int fd, size_t alignment)
+{
+    // Use the erase block size of MMC and SD cards so that the card
+    // doesn't have to read-modify-write internally. Otherwise use the
+    // logical block size or what the filesystem prefers. Returns 0 with
+    // errno set on failure.
+    struct stat st;
+    if (fstat(fd, &st))
+        return 0;
+
+    size_t size = st.st_blksize;
+    if (S_ISBLK(st.st_mode)) {
+        int block_size = 512;
+        if (ioctl(fd, BLKSSZGET, &block_size))
+            return 0;
+        size = block_size;
+        size_t erase_size = erase_block_size(fd);
+        if (erase_size > size && erase_size <= TUNE_MAX_CHUNK_SIZE && erase_size % size == 0)
+            size = erase_size;
+    }
+
+    if (size < 512)
+        size = 512;
+    if (alignment && size % alignment)
+        size += alignment - (size % alignment);
+    return size;
+}
+
+bool coalesce_init(struct copy_dest *dest)
+{
+    // Returns false with errno set on failure
+    dest->pending_start = -1;
+    dest->coalesce = coalesce_block_size(dest->fd, dest->alignment);
+    if (dest->coalesce == 0)
+        return false;
+    dest->pending = (char *) alloc_buffer(dest->coalesce);
+    dest->scratch = (char *) alloc_buffer(dest->coalesce);
+    return dest->pending && dest->scratch;
+}
+
+bool coalesce_fill(struct copy_dest *dest)
+{
+    // Read the block once and keep the new data that's already in it
+    size_t amount_read;
+    if (!pread_fully(dest->fd, dest->scratch, dest->coalesce, dest->pending_start, &amount_read))
+        return false;
+    memset(dest->scratch + amount_read, 0, dest->coalesce - amount_read);
+    memcpy(dest->pending, dest->scratch, dest->pending_lo);
+    memcpy(dest->pending + dest->pending_hi, dest->scratch + dest->pending_hi,
+           dest->coalesce - dest->pending_hi);
+    dest->pending_loaded = true;
+    return true;
+}
+
+bool coalesce_flush(struct copy_dest *dest)
+{
+    // Returns false with errno set on failure. The block stays pending so
+    // that a later flush reports the error again.
+    if (dest->pending_start < 0)
+        return true;
+
+    bool whole = dest->pending_lo == 0 && dest->pending_hi == dest->coalesce;
+    struct stat st;
+    if ((!whole && !dest->pending_loaded && !coalesce_fill(dest)) || fstat(dest->fd, &st))
+        return false;
+    if (!pwrite_fully(dest->fd, dest->pending, dest->coalesce, dest->pending_start))
+        return false;
+
+    // Don't let the rest of the block grow a regular file past the data
+    off_t end = dest->pending_start + (off_t) dest->coalesce;
+    if (S_ISREG(st.st_mode) && st.st_size < end) {
+        off_t data_end = dest->pending_start + (off_t) dest->pending_hi;
+        if (ftruncate(dest->fd, st.st_size > data_end ? st.st_size : data_end))
+            return false;
+    }
+    dest->pending_start = -1;
+    return true;
+}
+
+bool coalesce_write(struct copy_dest *dest, const char *data, size_t len, off_t offset)
+{
+    // Whole blocks are written directly. Pieces of blocks are merged into
+    // the pending block, which is only read from the card if the pieces
+    // don't end up covering it.
+    size_t block = dest->coalesce;
+    while (len > 0) {
+        off_t start = offset - (offset % block);
+        size_t pos = offset - start;
+        size_t n = block - pos < len ? block - pos : len;
+
+        if (pos == 0 && n == block && start != dest->pending_start) {
+            size_t whole = len - (len % block);
+            if (dest->pending_start >= start && dest->pending_start < offset + (off_t) whole)
+                dest->pending_start = -1;
+            if (!pwrite_fully(dest->fd, data, whole, offset))
+                return false;
+            data += whole;
+            offset += whole;
+            len -= whole;
+            continue;
+        }
+
+        if (start != dest->pending_start) {
+            if (!coalesce_flush(dest))
+                return false;
+            dest->pending_start = start;
+            dest->pending_lo = pos;
+            dest->pending_hi = pos;
+            dest->pending_loaded = false;
+        }
+        if (!dest->pending_loaded && (pos > dest->pending_hi || pos + n < dest->pending_lo) &&
+                !coalesce_fill(dest))
+            return false;
+
+        memcpy(dest->pending + pos, data, n);
+        if (pos < dest->pending_lo)
+            dest->pending_lo = pos;
+        if (pos + n > dest->pending_hi)
+            dest->pending_hi = pos + n;
+
+        data += n;
+        offset += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool emmc_write_chunk(struct copy_dest *dest, const char *data, size_t len, off_t offset)
+{
+    // Commands only move whole blocks. The chunking leaves partial blocks
+    // at the start and end at most, and those go through the block layer.
+    // The device is opened with O_DIRECT so that both see the same data.
+    size_t alignment = dest->alignment;
+    size_t aligned_len = len - (len % alignment);
+    if (offset % alignment || aligned_len == 0)
+        return write_unaligned(dest->fd, data, len, offset, alignment);
+
+    if (!emmc_write(dest->emmc, data, aligned_len, offset))
+        return false;
+    if (aligned_len < len)
+        return write_unaligned(dest->fd, data + aligned_len, len - aligned_len, offset + aligned_len, alignment);
+    return true;
+}
+
+bool dest_write(struct copy_dest *dest, const char *data, size_t len, off_t offset)
+{
+    if (dest->coalesce)
+        return coalesce_write(dest, data, len, offset);
+    else if (dest->emmc)
+        return emmc_write_chunk(dest, data, len, offset);
+    else
+        return write_chunk(dest->fd, data, len, offset, dest->alignment);
+}
+
+bool is_zero(const char *data, size_t len)
+{
+    // Check 64 bytes at a time with independent words so that the compiler
+    // can vectorize the loop. Blocks start on 8-byte boundaries since the
+    // buffers are page aligned.
+    const uint64_t *p = (const uint64_t *) data;
+    while (len >= 64) {
+        if ((p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7]) != 0)
+            return false;
+        p += 8;
+        len -= 64;
+    }
+
+    const char *c = (const char *) p;
+    while (len--) {
+        if (*c++)
+            return false;
+    }
+    return true;
+}
+
+size_t next_data_run(const char *data, size_t len, size_t *pos)
+{
+    // Skip blocks of zeros starting at *pos and then return the length
+    // of the run of non-zero blocks that follows.
+    size_t start = *pos;
+    while (start < len) {
+        size_t n = len - start < SPARSE_BLOCK_SIZE ? len - start : SPARSE_BLOCK_SIZE;
+        if (!is_zero(data + start, n))
+            break;
+        start += n;
+    }
+
+    size_t end = start;
+    while (end < len) {
+        size_t n = len - end < SPARSE_BLOCK_SIZE ? len - end : SPARSE_BLOCK_SIZE;
+        if (is_zero(data + end, n))
+            break;
+        end += n;
+    }
+
+    *pos = start;
+    return end - start;
+}
+
+bool write_changed(struct copy_dest *dest, const char *data, size_t len, off_t offset)
+{
+    // Read what's on the memory card and only write the blocks that are
+    // different. Reads are much faster than writes and don't wear out the
+    // flash. Unaligned O_DIRECT pieces can't be read directly, so they're
+    // always written.
+    if (dest->alignment && (offset % dest->alignment || len % dest->alignment))
+        return dest_write(dest, data, len, offset);
+
+    // Start the kernel reading the next chunk while this one is compared
+    // and written.
+    if (!dest->alignment)
+        posix_fadvise(dest->fd, offset + len, len, POSIX_FADV_WILLNEED);
+
+    size_t amount_read;
+    if (!pread_fully(dest->fd, dest->compare, len, offset, &amount_read))
+        return false;
+
+    size_t pos = 0;
+    while (pos < len) {
+        size_t start = pos;
+        while (start < len) {
+            size_t n = len - start < DELTA_BLOCK_SIZE ? len - start : DELTA_BLOCK_SIZE;
+            if (start + n > amount_read || memcmp(data + start, dest->compare + start, n) != 0)
+                break;
+            start += n;
+        }
+        dest->unchanged += start - pos;
+
+        size_t end = start;
+        while (end < len) {
+            size_t n = len - end < DELTA_BLOCK_SIZE ? len - end : DELTA_BLOCK_SIZE;
+            if (end + n <= amount_read && memcmp(data + end, dest->compare + end, n) == 0)
+                break;
+            end += n;
+        }
+
+        if (end > start && !dest_write(dest, data + start, end - start, offset + start))
+            return false;
+        pos = end;
+    }
+    return true;
+}
+
+bool write_run(struct copy_dest *dest, const char *data, size_t len, off_t offset)
+{
+    if (dest->compare)
+        return write_changed(dest, data, len, offset);
+    else
+        return dest_write(dest, data, len, offset);
+}
+
+bool write_buffer(struct copy_dest *dest, const struct copy_buffer *buffer)
+{
+    if (dest->compressor) {
+        // Blocks of zeros are common on memory cards and are much cheaper
+        // to compress separately. Errors are recorded by the compressor.
+        if (is_zero(buffer->data, buffer->len))
+            return compressor_write_zeros(dest->compressor, buffer->len);
+        else
+            return compressor_write(dest->compressor, buffer->data, buffer->len);
+    }
+
+    if (buffer->hole) {
+        discard_skipped(dest->discards, buffer->offset, buffer->len);
+        return true;
+    }
+
+    if (!dest->ctx->sparse_write)
+        return write_run(dest, buffer->data, buffer->len, buffer->offset);
+
+    size_t pos = 0;
+    for (;;) {
+        size_t start = pos;
+        size_t run = next_data_run(buffer->data, buffer->len, &pos);
+        discard_skipped(dest->discards, buffer->offset + start, pos - start);
+        if (run == 0)
+            break;
+
+        if (!write_run(dest, buffer->data + pos, run, buffer->offset + pos))
+            return false;
+        pos += run;
+    }
+    return true;
+}
+
+// What was written, so that it can be read back and checked. The image is
+// hashed in blocks as it's copied so that a mismatch found on readback can
+// be narrowed down to a block.
+struct verify_log
+{
+    struct range_map written;
+    size_t capacity;
+    struct sha256_ctx hash;  // Hash of the last block until it's complete
+};
+
+void verify_end_block(struct verify_log *log)
+{
+    if (log->written.count == 0)
+        return;
+
+    struct data_range *r = &log->written.ranges[log->written.count - 1];
+    if (!r->has_checksum) {
+        sha256_final(&log->hash, r->sha256);
+        r->has_checksum = true;
+    }
+}
+
+bool verify_record(struct verify_log *log, off_t offset, const char *data, size_t len)
+{
+    // Returns false with errno set if out of memory
+    while (len > 0) {
+        struct data_range *r = NULL;
+        if (log->written.count > 0) {
+            r = &log->written.ranges[log->written.count - 1];
+            if (r->has_checksum || r->offset + (off_t) r->len != offset)
+                r = NULL;
+        }
+        if (!r) {
+            verify_end_block(log);
+            if (!add_data_range(&log->written, &log->capacity, offset, 0))
+                return false;
+            r = &log->written.ranges[log->written.count - 1];
+            sha256_init(&log->hash);
+        }
+
+        size_t n = VERIFY_BLOCK_SIZE - r->len;
+        if (n > len)
+            n = len;
+        sha256_update(&log->hash, data, n);
+        r->len += n;
+        if (r->len == VERIFY_BLOCK_SIZE)
+            verify_end_block(log);
+
+        offset += n;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool verify_buffer(struct verify_log *log, const struct copy_buffer *buffer, bool sparse)
+{
+    // Record the same parts of the buffer that write_buffer writes.
+    // Returns false with errno set if out of memory.
+    if (buffer->hole)
+        return true;
+
+    if (!sparse)
+        return verify_record(log, buffer->offset, buffer->data, buffer->len);
+
+    size_t pos = 0;
+    size_t run;
+    while ((run = next_data_run(buffer->data, buffer->len, &pos)) != 0) {
+        if (!verify_record(log, buffer->offset + pos, buffer->data + pos, run))
+            return false;
+        pos += run;
+    }
+    return true;
+}
+
+void verify_free(struct verify_log *log)
+{
+    verify_end_block(log);
+    free(log->written.ranges);
+    free(log);
+}
+
+// --cache keeps the decompressed image and where its data is so that
+// writing the same image again skips decompressing and looking for zeros.
+// Entries are named by the SHA-256 of the image file:
+//
+//   <hash>.img   The decompressed image with holes where it's zero. Only
+//                compressed images have one since the original is as good.
+//   <hash>.bmap  The ranges with data in the MMCBMAP1 format
+//
+// Copies that read the same entry at the same time share it through the
+// page cache.
+struct image_cache
+{
+    struct copy_context *ctx;
+    const char *dir;
+    char id[SHA256_DIGEST_LENGTH * 2 + 1];
+    bool hit;              // The image came from the cache
+    struct range_map *map; // Its data ranges on a hit
+
+    // Set while storing the image on a miss
+    bool storing;
+    bool compressed;       // Store the decompressed image too
+    int fd;
+    char tmp_path[PATH_MAX];
+    struct range_map ranges;
+    size_t capacity;
+    bool failed;           // Stop storing after an error
+};
+
+bool cache_path(const struct image_cache *cache, const char *suffix, char *out)
+{
+    if (snprintf(out, PATH_MAX, "%s/%s%s", cache->dir, cache->id, suffix) >= PATH_MAX)
+        return fail(&cache->ctx->failure, "%s: path too long", cache->dir);
+    return true;
+}
+
+bool cache_image_id(struct copy_context *ctx, const char *dir, int fd, char *out)
+{
+    // Hashing the whole image takes a while, so remember the hash for
+    // files that haven't changed since.
+    struct stat st;
+    if (fstat(fd, &st))
+        return fail_errno(&ctx->failure, "fstat");
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%llu-%llu.id", dir,
+             (unsigned long long) st.st_dev, (unsigned long long) st.st_ino);
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        unsigned long long size, seconds, nanoseconds;
+        bool ok = (fscanf(fp, "%llu %llu %llu %64s", &size, &seconds, &nanoseconds, out) == 4 &&
+                   size == (unsigned long long) st.st_size &&
+                   seconds == (unsigned long long) st.st_mtim.tv_sec &&
+                   nanoseconds == (unsigned long long) st.st_mtim.tv_nsec &&
+                   strlen(out) == SHA256_DIGEST_LENGTH * 2);
+        fclose(fp);
+        if (ok)
+            return true;
+    }
+
+    struct sha256_ctx hash;
+    sha256_init(&hash);
+    char *buffer = (char *) alloc_buffer(ONE_MiB);
+    if (!buffer)
+        return fail_errno(&ctx->failure, "posix_memalign");
+    off_t offset = 0;
+    size_t amount;
+    do {
+        if (failed(&ctx->failure) || !pread_fully(fd, buffer, ONE_MiB, offset, &amount)) {
+            if (!failed(&ctx->failure))
+                fail_errno(&ctx->failure, "read");
+            free(buffer);
+            return false;
+        }
+        sha256_update(&hash, buffer, amount);
+        offset += amount;
+    } while (amount == ONE_MiB);
+    free(buffer);
+
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    sha256_final(&hash, digest);
+    sha256_to_hex(digest, out);
+
+    // Not being able to remember the hash only makes the next run slower
+    fp = fopen(path, "w");
+    if (fp) {
+        fprintf(fp, "%llu %llu %llu %s\n", (unsigned long long) st.st_size,
+                (unsigned long long) st.st_mtim.tv_sec, (unsigned long long) st.st_mtim.tv_nsec, out);
+        fclose(fp);
+    }
+    return true;
+}
+
+bool cache_open(struct copy_context *ctx, const char *dir, int *fd, bool compressed)
+{
+    // Look the image up in the cache. On a hit, *fd is switched to the
+    // decompressed image if there is one and true is returned. Errors are
+    // recorded in the context's failure.
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        return fail_errno(&ctx->failure, "%s", dir);
+
+    struct image_cache *cache = (struct image_cache *) calloc(1, sizeof(struct image_cache));
+    if (!cache)
+        return fail_errno(&ctx->failure, "calloc");
+    cache->ctx = ctx;
+    cache->dir = dir;
+    cache->fd = -1;
+    cache->compressed = compressed;
+    ctx->image_cache = cache;
+    if (!cache_image_id(ctx, dir, *fd, cache->id))
+        return false;
+
+    char path[PATH_MAX];
+    if (!cache_path(cache, ".bmap", path) || access(path, R_OK) < 0)
+        return false;
+
+    int image_fd = -1;
+    if (compressed) {
+        char image_path[PATH_MAX];
+        if (!cache_path(cache, ".img", image_path))
+            return false;
+        image_fd = open(image_path, O_RDONLY);
+        if (image_fd < 0)
+            return false;
+    }
+
+    cache->map = load_range_map(ctx, path);
+    if (!cache->map) {
+        if (image_fd >= 0)
+            close(image_fd);
+        return false;
+    }
+    cache->hit = true;
+    if (image_fd >= 0) {
+        close(*fd);
+        *fd = image_fd;
+    }
+    return true;
+}
+
+void cache_start(struct image_cache *cache)
+{
+    // Store the image as it's copied. It's only added to the cache if the
+    // copy finishes.
+    if (cache->compressed) {
+        snprintf(cache->tmp_path, sizeof(cache->tmp_path), "%s/.%s.XXXXXX", cache->dir, cache->id);
+        cache->fd = mkstemp(cache->tmp_path);
+        if (cache->fd < 0) {
+            warning_errno(cache->ctx, "%s", cache->dir);
+            cache->tmp_path[0] = '\0';
+            return;
+        }
+
+        // Other users' copies can share the image too
+        fchmod(cache->fd, 0644);
+    }
+    cache->storing = true;
+}
+
+void cache_store(struct image_cache *cache, off_t offset, const char *data, size_t len, bool hole)
+{
+    // Record the non-zero blocks of what was read at offset in the image.
+    // Holes only make the image longer.
+    struct range_map *map = &cache->ranges;
+    if (cache->failed)
+        return;
+
+    size_t pos = 0;
+    size_t run;
+    while (!hole && (run = next_data_run(data, len, &pos)) != 0) {
+        off_t start = offset + (off_t) pos;
+        if (cache->fd >= 0 && !pwrite_fully(cache->fd, data + pos, run, start)) {
+            warning_errno(cache->ctx, "%s", cache->tmp_path);
+            cache->failed = true;
+            return;
+        }
+
+        struct data_range *last = map->count ? &map->ranges[map->count - 1] : NULL;
+        if (last && last->offset + (off_t) last->len == start) {
+            last->len += run;
+        } else if (!add_data_range(map, &cache->capacity, start, run)) {
+            warning_errno(cache->ctx, "realloc");
+            cache->failed = true;
+            return;
+        }
+        pos += run;
+    }
+
+    if ((uint64_t) offset + len > map->image_size)
+        map->image_size = offset + len;
+}
+
+bool cache_write_map(const struct range_map *map, const char *path)
+{
+    // Returns false with errno set on failure.
+    char header[24];
+    memcpy(header, "MMCBMAP1", 8);
+    put_le64(header + 8, map->image_size);
+    put_le64(header + 16, 0);
+
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        return false;
+    bool ok = fwrite(header, sizeof(header), 1, fp) == 1;
+    size_t i;
+    for (i = 0; ok && i < map->count; i++) {
+        char entry[16];
+        put_le64(entry, map->ranges[i].offset);
+        put_le64(entry + 8, map->ranges[i].len);
+        ok = fwrite(entry, sizeof(entry), 1, fp) == 1;
+    }
+    ok = (fflush(fp) == 0 && ok && fdatasync(fileno(fp)) == 0);
+    if (fclose(fp) != 0)
+        ok = false;
+    return ok;
+}
+
+void cache_finish(struct image_cache *cache)
+{
+    // Move the stored image and its ranges into place. The block map goes
+    // last since it's what makes the entry valid. A cache that can't be
+    // updated doesn't fail the copy.
+    if (!cache->storing || cache->failed)
+        return;
+
+    // The paths were checked when the cache was opened
+    char path[PATH_MAX];
+    if (cache->fd >= 0) {
+        cache_path(cache, ".img", path);
+        if (ftruncate(cache->fd, cache->ranges.image_size) < 0 || fdatasync(cache->fd) < 0 ||
+                rename(cache->tmp_path, path) < 0) {
+            warning_errno(cache->ctx, "%s", path);
+            return;
+        }
+        cache->tmp_path[0] = '\0';
+    }
+
+    char tmp_path[PATH_MAX];
+    cache_path(cache, ".bmap", path);
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int) sizeof(tmp_path)) {
+        warning(cache->ctx, "%s: path too long", cache->dir);
+        return;
+    }
+    if (!cache_write_map(&cache->ranges, tmp_path) || rename(tmp_path, path) < 0) {
+        warning_errno(cache->ctx, "%s", path);
+        unlink(tmp_path);
+    }
+}
+
+void cache_free(struct image_cache *cache)
+{
+    // An image that wasn't moved into place is left over from a copy that
+    // didn't finish
+    if (cache->fd >= 0)
+        close(cache->fd);
+    if (cache->tmp_path[0])
+        unlink(cache->tmp_path);
+    free_range_map(cache->map);
+    free(cache->ranges.ranges);
+    free(cache);
+}
+
+bool dest_init(struct copy_context *ctx, struct copy_dest *dest, const char *path, int fd)
+{
+    memset(dest, 0, sizeof(*dest));
+    dest->ctx = ctx;
+    dest->path = path;
+    dest->fd = fd;
+
+    // Write at explicit offsets when the destination can seek so that
+    // sparse regions can be skipped.
+    dest->offset = lseek(fd, 0, SEEK_CUR);
+    if (dest->offset < 0) {
+        if (errno != ESPIPE)
+            return fail_errno(&ctx->failure, "lseek");
+        if (ctx->sparse_write || ctx->data_map)
+            return fail(&ctx->failure, "Skipping parts of the image requires a seekable destination");
+        if (ctx->verify_writes || ctx->delta_write)
+            return fail(&ctx->failure, "--verify and --delta require a seekable destination");
+    }
+
+    if (fcntl(fd, F_GETFL) & O_DIRECT) {
+        dest->alignment = direct_io_alignment(fd);
+        if (dest->alignment == 0)
+            return fail_errno(&ctx->failure, "Can't get logical block size of %s", path);
+    }
+    dest->erase_size = erase_block_size(fd);
+    return true;
+}
+
+void source_next_segment(struct copy_source *src)
+{
+    // Switch to the next job segment. The destination offset is adjusted
+    // so that to_offset + total_read is where the segment goes.
+    const struct job_segment *segment = &src->job->segments[++src->segment_ix];
+    src->to_offset = src->job_base + segment->offset - (off_t) src->total_read;
+    src->segment_end = src->total_read + segment->size;
+
+    src->fd = segment->fd;
+    src->decoder = segment->decoder;
+    src->seekable = false;
+    src->from_offset = 0;
+
+    struct stat st;
+    if (!src->decoder && fstat(src->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        src->seekable = true;
+        src->from_size = st.st_size;
+    }
+    src->seek_holes = src->ctx->sparse_write && src->seekable;
+}
+
+bool source_init(struct copy_context *ctx, struct copy_source *src, int from_fd,
+                 const struct copy_dest *dests, int dest_count, size_t total_to_copy)
+{
+    memset(src, 0, sizeof(*src));
+    src->ctx = ctx;
+    src->fd = from_fd;
+    src->total_to_copy = total_to_copy;
+    src->chunk_size = ctx->chunk_size;
+
+    // All destinations start at the same offset. Chunk for the biggest
+    // O_DIRECT alignment and let the others read-modify-write if needed.
+    src->to_offset = dests[0].offset;
+    int i;
+    for (i = 0; i < dest_count; i++) {
+        if (dests[i].alignment > src->alignment)
+            src->alignment = dests[i].alignment;
+        if (dests[i].erase_size > src->erase_size)
+            src->erase_size = dests[i].erase_size;
+    }
+
+    src->decoder = ctx->image_decompressor;
+    src->prefetch = ctx->image_prefetch;
+
+    struct stat st;
+    if (!src->decoder && fstat(from_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        src->seekable = true;
+        src->from_offset = lseek(from_fd, 0, SEEK_CUR);
+        src->from_size = st.st_size;
+    }
+
+    src->map = ctx->data_map;
+    src->seek_holes = ctx->sparse_write && src->seekable && !src->map;
+    if (ctx->image_cache) {
+        src->cache = ctx->image_cache->storing ? ctx->image_cache : NULL;
+        src->keep_cached = ctx->image_cache->hit;
+    }
+
+    if (ctx->copy_job) {
+        src->job = ctx->copy_job;
+        src->job_base = src->to_offset;
+        src->segment_ix = -1;
+        source_next_segment(src);
+    }
+
+    if (ctx->verify_writes) {
+        src->verify = (struct verify_log *) calloc(1, sizeof(struct verify_log));
+        if (!src->verify)
+            return fail_errno(&ctx->failure, "calloc");
+    }
+    return true;
+}
+
+off_t source_next_data(struct copy_source *src, off_t *data_end)
+{
+    // Return the offset of the next data in the source at or after the
+    // current position and where that data ends. OFF_MAX means that
+    // there's no more data and -1 that the source failed.
+    off_t pos = src->from_offset;
+    *data_end = OFF_MAX;
+
+    if (src->map) {
+        while (src->range_ix < src->map->count &&
+               src->map->ranges[src->range_ix].offset + (off_t) src->map->ranges[src->range_ix].len <= pos)
+            src->range_ix++;
+        if (src->range_ix == src->map->count)
+            return OFF_MAX;
+
+        const struct data_range *r = &src->map->ranges[src->range_ix];
+        *data_end = r->offset + r->len;
+        return r->offset > pos ? r->offset : pos;
+    }
+
+    if (src->seek_holes) {
+        off_t data = lseek(src->fd, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno != ENXIO) {
+                fail_errno(&src->ctx->failure, "lseek");
+                return -1;
+            }
+
+            // The rest of the file is a hole
+            return OFF_MAX;
+        }
+
+        *data_end = lseek(src->fd, data, SEEK_HOLE);
+        if (*data_end < 0) {
+            fail_errno(&src->ctx->failure, "lseek");
+            return -1;
+        }
+        return data;
+    }
+
+    return pos;
+}
+
+ssize_t source_read(struct copy_source *src, char *buffer, size_t len)
+{
+    // Returns -1 after recording an error in the context's failure
+    if (src->decoder)
+        return decompressor_read(src->decoder, buffer, len);
+    else if (src->prefetch)
+        return prefetch_read(src->prefetch, buffer, len);
+
+    ssize_t amount = read_fully_at(src->fd, buffer, len, src->seekable ? src->from_offset : -1);
+    if (amount < 0)
+        fail_errno(&src->ctx->failure, "read");
+    return amount;
+}
+
+bool source_check_range(struct copy_source *src, const char *data, size_t len)
+{
+    const struct data_range *r = &src->map->ranges[src->range_ix];
+    if (!r->has_checksum)
+        return true;
+
+    off_t start = src->from_offset - len;
+    if (start == r->offset)
+        sha256_init(&src->range_hash);
+    sha256_update(&src->range_hash, data, len);
+
+    if (src->from_offset == r->offset + (off_t) r->len) {
+        uint8_t digest[SHA256_DIGEST_LENGTH];
+        sha256_final(&src->range_hash, digest);
+        if (memcmp(digest, r->sha256, SHA256_DIGEST_LENGTH) != 0)
+            return fail(&src->ctx->failure,
+                        "Checksum mismatch in block map range at offset %lld. Image is corrupt.",
+                        (long long) r->offset);
+    }
+    return true;
+}
+
+void source_map(struct copy_source *src, int depth)
+{
+    // Memory map image files so that the data can be written straight
+    // from the page cache.
+    if (!src->seekable || src->from_size == 0)
+        return;
+
+    void *mapped = mmap(NULL, src->from_size, PROT_READ, MAP_SHARED, src->fd, 0);
+    if (mapped == MAP_FAILED)
+        return;
+    madvise(mapped, src->from_size, MADV_SEQUENTIAL);
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    src->mapped = (const char *) mapped;
+    src->released = src->from_offset - (src->from_offset % page_size);
+    src->advised_end = src->from_offset;
+    src->lag = (depth + 1) * src->ctx->copy_buffer_size;
+}
+
+void source_advise(struct copy_source *src, size_t len)
+{
+    // Keep a window ahead of the reader in the page cache and drop what
+    // the writers are done with so that big images don't push everything
+    // else out of the cache.
+    off_t window = MMAP_WINDOW_SIZE;
+    off_t end = src->from_offset + window;
+    if (end > src->from_size)
+        end = src->from_size;
+    if (src->from_offset + (off_t) len + window / 2 > src->advised_end && end > src->advised_end) {
+        long page_size = sysconf(_SC_PAGESIZE);
+        off_t start = src->advised_end - (src->advised_end % page_size);
+        madvise((void *) (src->mapped + start), end - start, MADV_WILLNEED);
+        posix_fadvise(src->fd, start, end - start, POSIX_FADV_WILLNEED);
+        src->advised_end = end;
+    }
+
+    off_t done = src->from_offset - (off_t) src->lag;
+    if (!src->keep_cached && done - src->released >= window) {
+        long page_size = sysconf(_SC_PAGESIZE);
+        done -= done % page_size;
+        madvise((void *) (src->mapped + src->released), done - src->released, MADV_DONTNEED);
+        posix_fadvise(src->fd, src->released, done - src->released, POSIX_FADV_DONTNEED);
+        src->released = done;
+    }
+}
+
+void source_unmap(struct copy_source *src)
+{
+    if (!src->mapped)
+        return;
+
+    // Drop the rest of the image from the page cache unless it came from
+    // --cache
+    munmap((void *) src->mapped, src->from_size);
+    if (!src->keep_cached)
+        posix_fadvise(src->fd, src->released, 0, POSIX_FADV_DONTNEED);
+    src->mapped = NULL;
+}
+
+bool source_fill(struct copy_source *src, struct copy_buffer *buffer)
+{
+    // Fill the buffer with the next chunk of the source. Returns false
+    // when there's nothing more to read or after recording an error in
+    // the context's failure.
+    struct copy_context *ctx = src->ctx;
+    if (src->job && src->total_read == src->segment_end && src->segment_ix + 1 < src->job->count)
+        source_next_segment(src);
+    bool last_segment = !src->job || src->segment_ix + 1 == src->job->count;
+
+    size_t remaining = src->total_to_copy ? src->total_to_copy - src->total_read : SIZE_MAX;
+    if (src->seekable && (uint64_t) (src->from_size - src->from_offset) < remaining)
+        remaining = src->from_size - src->from_offset;
+    if (src->job && src->segment_end - src->total_read < remaining)
+        remaining = src->segment_end - src->total_read;
+
+    off_t to_offset = src->to_offset < 0 ? -1 : src->to_offset + (off_t) src->total_read;
+    size_t chunk_size = __atomic_load_n(&src->chunk_size, __ATOMIC_RELAXED);
+    size_t amount_to_read = next_chunk_size(to_offset, remaining, src->alignment, chunk_size,
+                                            src->erase_size);
+
+    buffer->data = buffer->storage;
+    buffer->offset = to_offset;
+    buffer->hole = false;
+    buffer->len = 0;
+    if (remaining == 0)
+        return false;
+
+    off_t data_end;
+    off_t data = source_next_data(src, &data_end);
+    if (data < 0)
+        return false;
+    if (data > src->from_offset) {
+        size_t skip = remaining;
+        if ((uint64_t) (data - src->from_offset) < skip)
+            skip = data - src->from_offset;
+
+        // Skipped regions don't need buffer space when the source can
+        // seek, so skip them all at once. Otherwise they have to be read.
+        buffer->hole = true;
+        if (src->seekable)
+            buffer->len = skip;
+        else {
+            if (skip > ctx->copy_buffer_size)
+                skip = ctx->copy_buffer_size;
+            ssize_t amount = source_read(src, buffer->data, skip);
+            if (amount < 0)
+                return false;
+            buffer->len = amount;
+        }
+        src->from_offset += buffer->len;
+        src->total_read += buffer->len;
+        if (src->cache)
+            cache_store(src->cache, src->from_offset - buffer->len, NULL, buffer->len, true);
+        return buffer->len == skip && (buffer->len != remaining || !last_segment);
+    }
+
+    if ((uint64_t) (data_end - src->from_offset) < amount_to_read)
+        amount_to_read = data_end - src->from_offset;
+
+    if (src->mapped) {
+        source_advise(src, amount_to_read);
+
+        // Use the mapping directly unless O_DIRECT needs the data to be
+        // aligned in memory.
+        const char *data = src->mapped + src->from_offset;
+        buffer->len = amount_to_read;
+        if (src->alignment && (src->from_offset % src->alignment) != 0)
+            memcpy(buffer->storage, data, amount_to_read);
+        else
+            buffer->data = (char *) data;
+    } else {
+        ssize_t amount = source_read(src, buffer->data, amount_to_read);
+        if (amount < 0)
+            return false;
+        buffer->len = amount;
+    }
+    if (src->job && buffer->len != amount_to_read)
+        return fail(&ctx->failure, "%s is shorter than expected", src->job->segments[src->segment_ix].path);
+    src->total_read += buffer->len;
+    src->from_offset += buffer->len;
+    if (src->map && !source_check_range(src, buffer->data, buffer->len))
+        return false;
+    if (src->cache)
+        cache_store(src->cache, src->from_offset - buffer->len, buffer->data, buffer->len, false);
+    if (src->verify && !verify_buffer(src->verify, buffer, ctx->sparse_write))
+        return fail_errno(&ctx->failure, "realloc");
+
+    return buffer->len == amount_to_read && (buffer->len != remaining || !last_segment);
+}
+
+bool finish_copy(struct copy_dest *dest, const struct copy_source *src)
+{
+    // Returns false with errno set on failure.
+    if (dest->compressor) {
+        bool ok = compressor_finish(dest->compressor);
+        dest->compressor = NULL;
+        return ok;
+    }
+
+    off_t end = src->to_offset + src->total_read;
+    if (dest->discards) {
+        bool ok = discard_finish(dest->discards, end);
+        dest->discards = NULL;
+        if (!ok)
+            return false;
+    }
+
+    // O_DIRECT bypasses the page cache, but the memory card may still have
+    // data in its write cache. Flush once at the end. --coalesce doesn't
+    // use O_SYNC, so it needs this too.
+    if (!coalesce_flush(dest))
+        return false;
+    if ((dest->alignment || dest->coalesce) && fdatasync(dest->fd) < 0)
+        return false;
+
+    // MMC commands skip the page cache, so drop anything stale in it
+    if (dest->emmc && ioctl(dest->fd, BLKFLSBUF, 0) < 0)
+        return false;
+
+    // Skipping zeros or what's not in the block map at the end of the
+    // image won't extend a regular file, so do that here.
+    struct stat st;
+    if ((dest->ctx->sparse_write || src->map) && fstat(dest->fd, &st) == 0 && S_ISREG(st.st_mode) &&
+            st.st_size < end) {
+        if (ftruncate(dest->fd, end))
+            return false;
+    }
+    return true;
+}
+
+void report_dest_progress(struct copy_ring *ring, struct copy_dest *dest, bool final)
+{
+    size_t total = ring->source.total_to_copy;
+
+    // With O_DIRECT, 100% waits until after the final flush.
+    if (!final && (dest->alignment || dest->coalesce) && dest->written == total)
+        return;
+
+    if (ring->dest_count == 1) {
+        report_progress(dest->ctx, dest->written, total);
+        return;
+    }
+
+    // Telemetry follows the first memory card
+    if (dest == ring->dests)
+        telemetry_progress(&dest->ctx->telemetry, dest->written, total);
+    __atomic_store_n(&dest->progress, dest->written, __ATOMIC_RELAXED);
+}
+
+void print_dest_progress(struct copy_context *ctx)
+{
+    // Several memory cards get one progress line each. Called with
+    // progress.lock held. Numeric progress is only printed when a
+    // percentage changes.
+    struct progress *progress = &ctx->progress;
+    FILE *out = ctx->progress_out;
+    if (ctx->quiet || ctx->json_progress)
+        return;
+
+    size_t total = __atomic_load_n(&progress->total, __ATOMIC_RELAXED);
+    bool changed = false;
+    int i;
+    for (i = 0; i < progress->dest_count; i++) {
+        struct copy_dest *d = &progress->dests[i];
+        size_t written = __atomic_load_n(&d->progress, __ATOMIC_RELAXED);
+        double percent = (double) (int) calculate_progress(written, total);
+        double value = __atomic_load_n(&d->error, __ATOMIC_RELAXED) ? -1 : total > 0 ? percent : written;
+        if (value == d->reported)
+            continue;
+        d->reported = value;
+        changed = true;
+        if (ctx->numeric_progress && value >= 0)
+            fprintf(out, "%s %.0f\n", d->path, percent);
+    }
+    if (!changed || ctx->numeric_progress) {
+        fflush(out);
+        return;
+    }
+
+    // Redraw all of the lines. The cursor sits below the last one.
+    if (progress->drawn)
+        fprintf(out, "\033[%dA", progress->dest_count);
+    progress->drawn = true;
+
+    for (i = 0; i < progress->dest_count; i++) {
+        struct copy_dest *d = &progress->dests[i];
+        if (d->reported < 0)
+            fprintf(out, "\r%s: failed\033[K\n", d->path);
+        else if (total > 0)
+            fprintf(out, "\r%s: %.0f%%\033[K\n", d->path, d->reported);
+        else {
+            char sizestr[32];
+            pretty_size(d->reported, sizestr);
+            fprintf(out, "\r%s: %s\033[K\n", d->path, sizestr);
+        }
+    }
+    fflush(out);
+}
+
+void *progress_thread(void *arg)
+{
+    // Printing is the least important thing going on, so it shouldn't
+    // take the CPU from the copy.
+    struct copy_context *ctx = (struct copy_context *) arg;
+    struct progress *progress = &ctx->progress;
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), PROGRESS_NICE);
+
+    pthread_mutex_lock(&progress->lock);
+    while (!progress->stop) {
+        if (progress->dests)
+            print_dest_progress(ctx);
+        else
+            print_progress(ctx);
+        telemetry_tick(&ctx->telemetry);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long) (PROGRESS_INTERVAL * 1e9);
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&progress->cond, &progress->lock, &deadline);
+    }
+    pthread_mutex_unlock(&progress->lock);
+    return NULL;
+}
+
+bool start_progress(struct copy_context *ctx)
+{
+    if ((ctx->quiet || ctx->json_progress) && !telemetry_active(&ctx->telemetry))
+        return true;
+    if (pthread_create(&ctx->progress.thread, NULL, progress_thread, ctx))
+        return fail(&ctx->failure, "Can't start progress thread");
+    ctx->progress.running = true;
+    return true;
+}
+
+void watch_dest_progress(struct copy_context *ctx, struct copy_dest *dests, int count, size_t total)
+{
+    struct progress *progress = &ctx->progress;
+    pthread_mutex_lock(&progress->lock);
+    progress->dests = dests;
+    progress->dest_count = count;
+    __atomic_store_n(&progress->total, total, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&progress->lock);
+}
+
+void start_progress_phase(struct copy_context *ctx, const char *label, size_t total)
+{
+    // Show progress for something other than the copy, like verifying
+    struct progress *progress = &ctx->progress;
+    pthread_mutex_lock(&progress->lock);
+    progress->label = label;
+    progress->last[0] = '\0';
+    set_progress(progress, 0, total);
+    pthread_mutex_unlock(&progress->lock);
+}
+
+void end_progress(struct copy_context *ctx)
+{
+    // Print the final progress of the phase rather than waiting for the
+    // progress thread. A linefeed goes after it so that the next output
+    // starts on a new line. Numeric progress and the per-card lines
+    // already end with linefeeds, so don't add another on those.
+    struct progress *progress = &ctx->progress;
+    pthread_mutex_lock(&progress->lock);
+    size_t done = __atomic_load_n(&progress->done, __ATOMIC_RELAXED);
+    if (progress->dests) {
+        print_dest_progress(ctx);
+        int i;
+        for (i = 0; i < progress->dest_count; i++) {
+            if (progress->dests[i].progress > done)
+                done = progress->dests[i].progress;
+        }
+        progress->dests = NULL;
+    } else {
+        print_progress(ctx);
+        if (!ctx->quiet && !ctx->numeric_progress && !ctx->json_progress && progress->reported) {
+            fprintf(ctx->progress_out, "\n");
+            fflush(ctx->progress_out);
+        }
+    }
+
+    // The summary is for the copy and not for checking it afterwards
+    if (!progress->label && !progress->summarize) {
+        progress->copied = done;
+        progress->copy_seconds = monotonic_seconds() - ctx->telemetry.start_time;
+        progress->summarize = true;
+    }
+    progress->label = NULL;
+    progress->last[0] = '\0';
+    __atomic_store_n(&progress->reported, false, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&progress->lock);
+}
+
+void finish_progress(struct copy_context *ctx)
+{
+    // Stop the progress thread and print how fast the copy went
+    struct progress *progress = &ctx->progress;
+    if (progress->running) {
+        pthread_mutex_lock(&progress->lock);
+        progress->stop = true;
+        pthread_cond_signal(&progress->cond);
+        pthread_mutex_unlock(&progress->lock);
+        pthread_join(progress->thread, NULL);
+        progress->running = false;
+    }
+
+    if (ctx->quiet || ctx->numeric_progress || ctx->json_progress || !progress->summarize ||
+            progress->copy_seconds <= 0 || failed(&ctx->failure))
+        return;
+    char sizestr[32];
+    pretty_size(progress->copied, sizestr);
+    fprintf(ctx->progress_out, "Copied %s in %.1f s (%.1f MB/s)\n", sizestr, progress->copy_seconds,
+            progress->copied / progress->copy_seconds / 1e6);
+    fflush(ctx->progress_out);
+}
+
+// Reading back runs on several threads. Each one reads a buffer's worth of
+// blocks with O_DIRECT so that the data comes from the memory card and not
+// the page cache, and then hashes the blocks while the others are reading.
+struct verify_job
+{
+    struct copy_context *ctx;
+    int fd;
+    size_t alignment;
+    const struct range_map *written;
+
+    pthread_mutex_t lock;
+    size_t next_ix;      // Next block to check
+    size_t bad_ix;       // First block that didn't match or written->count
+    int error;           // errno if a read failed
+    size_t verified;     // Bytes checked so far for progress
+    size_t total;
+    bool show_progress;
+};
+
+struct verify_worker
+{
+    struct verify_job *job;
+    char *buffer;
+    pthread_t thread;
+};
+
+void *verify_thread(void *arg)
+{
+    struct verify_worker *worker = (struct verify_worker *) arg;
+    struct verify_job *job = worker->job;
+    const struct data_range *ranges = job->written->ranges;
+    size_t alignment = job->alignment ? job->alignment : 1;
+
+    for (;;) {
+        // Claim as many consecutive blocks as fit in the buffer
+        pthread_mutex_lock(&job->lock);
+        size_t first = job->next_ix;
+        size_t last = first;
+        off_t start = 0;
+        off_t end = 0;
+        if (first < job->bad_ix && !job->error && !failed(&job->ctx->failure)) {
+            start = ranges[first].offset - (ranges[first].offset % alignment);
+            while (last < job->bad_ix) {
+                off_t range_end = ranges[last].offset + ranges[last].len;
+                if (range_end % alignment)
+                    range_end += alignment - (range_end % alignment);
+                if (last > first && range_end - start > (off_t) job->ctx->copy_buffer_size)
+                    break;
+                end = range_end;
+                last++;
+            }
+        }
+        job->next_ix = last;
+        pthread_mutex_unlock(&job->lock);
+        if (first == last)
+            break;
+
+        size_t amount_read;
+        int error = 0;
+        if (!pread_fully(job->fd, worker->buffer, end - start, start, &amount_read))
+            error = errno;
+
+        size_t i;
+        size_t bad_ix = job->written->count;
+        size_t verified = 0;
+        for (i = first; i < last && !error; i++) {
+            const struct data_range *r = &ranges[i];
+            size_t pos = r->offset - start;
+            uint8_t digest[SHA256_DIGEST_LENGTH];
+            if (pos + r->len <= amount_read) {
+                struct sha256_ctx hash;
+                sha256_init(&hash);
+                sha256_update(&hash, worker->buffer + pos, r->len);
+                sha256_final(&hash, digest);
+            }
+            if (pos + r->len > amount_read || memcmp(digest, r->sha256, SHA256_DIGEST_LENGTH) != 0) {
+                bad_ix = i;
+                break;
+            }
+            verified += r->len;
+        }
+
+        pthread_mutex_lock(&job->lock);
+        if (error && !job->error)
+            job->error = error;
+        if (bad_ix < job->bad_ix)
+            job->bad_ix = bad_ix;
+        job->verified += verified;
+        if (job->show_progress)
+            set_progress(&job->ctx->progress, job->verified, job->total);
+        pthread_mutex_unlock(&job->lock);
+    }
+    return NULL;
+}
+
+bool verify_dest(struct copy_dest *dest, const struct verify_log *log, char **buffers, int count,
+                 bool show_progress)
+{
+    // Read back everything that was written to the destination and compare
+    // it against the hashes. Returns false and sets the error and the
+    // first bad offset in the destination if it doesn't match.
+    struct copy_context *ctx = dest->ctx;
+    struct verify_job job;
+    memset(&job, 0, sizeof(job));
+    job.ctx = ctx;
+    job.written = &log->written;
+    job.bad_ix = log->written.count;
+    job.show_progress = show_progress && !ctx->quiet && !ctx->numeric_progress;
+    int i;
+    for (i = 0; i < (int) log->written.count; i++)
+        job.total += log->written.ranges[i].len;
+
+    job.fd = open(dest->path, O_RDONLY | O_DIRECT);
+    if (job.fd >= 0) {
+        job.alignment = direct_io_alignment(job.fd);
+        if (job.alignment == 0) {
+            dest->error = errno;
+            close(job.fd);
+            return false;
+        }
+    } else if (errno == EINVAL) {
+        // Without O_DIRECT, drop what's cached so that the reads go to
+        // the memory card.
+        job.fd = open(dest->path, O_RDONLY);
+        if (job.fd >= 0)
+            posix_fadvise(job.fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    if (job.fd < 0) {
+        dest->error = errno;
+        return false;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    if (job.show_progress)
+        start_progress_phase(ctx, "Verifying ", job.total);
+
+    struct verify_worker workers[MAX_PIPELINE_DEPTH];
+    int started;
+    for (started = 0; started < count; started++) {
+        workers[started].job = &job;
+        workers[started].buffer = buffers[started];
+        if (pthread_create(&workers[started].thread, NULL, verify_thread, &workers[started])) {
+            fail(&ctx->failure, "Can't start verify thread");
+            break;
+        }
+    }
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+    if (job.show_progress)
+        end_progress(ctx);
+
+    pthread_mutex_destroy(&job.lock);
+    close(job.fd);
+
+    if (failed(&ctx->failure)) {
+        dest->error = ECANCELED;
+        return false;
+    }
+    if (job.error) {
+        dest->error = job.error;
+        return false;
+    }
+    if (job.bad_ix < log->written.count) {
+        dest->error = EIO;
+        dest->verify_failed = true;
+        dest->bad_offset = log->written.ranges[job.bad_ix].offset;
+        return false;
+    }
+    return true;
+}
+
+// --resume keeps a small journal file so that an interrupted write can
+// pick up where it left off. The journal is only updated after an
+// fdatasync, so everything before the committed offset is on the memory
+// card. It's deleted once the copy finishes.
+struct resume_journal
+{
+    const char *path;
+    char image_id[SHA256_DIGEST_LENGTH * 2 + 1];
+    char device_id[128];
+    off_t device_offset;    // Where the image starts on the memory card (-o)
+    size_t total;           // Amount being copied or 0 if unknown
+    off_t base;             // Image offset that this run started at
+    off_t committed;        // Image offset that's known to be on the memory card
+    bool failed;            // The journal couldn't be updated, so stop using it
+};
+
+bool resume_image_id(struct copy_context *ctx, int fd, char *out)
+{
+    // Identify the image by its file, size and modification time and a
+    // hash of the start and end. Hashing all of it would take about as
+    // long as the copy, and an image rebuilt in place only differs in the
+    // middle. A mismatch starts the copy over.
+    struct stat st;
+    if (fstat(fd, &st))
+        return fail_errno(&ctx->failure, "fstat");
+
+    struct sha256_ctx hash;
+    sha256_init(&hash);
+    uint64_t fields[5] = {
+        st.st_dev, st.st_ino, (uint64_t) st.st_size, (uint64_t) st.st_mtim.tv_sec, (uint64_t) st.st_mtim.tv_nsec
+    };
+    sha256_update(&hash, fields, sizeof(fields));
+
+    char *buffer = (char *) alloc_buffer(RESUME_SAMPLE_SIZE);
+    if (!buffer)
+        return fail_errno(&ctx->failure, "posix_memalign");
+    off_t offsets[2] = { 0, st.st_size > (off_t) RESUME_SAMPLE_SIZE ? st.st_size - (off_t) RESUME_SAMPLE_SIZE : 0 };
+    int i;
+    for (i = 0; i < 2; i++) {
+        size_t amount;
+        if (!pread_fully(fd, buffer, RESUME_SAMPLE_SIZE, offsets[i], &amount)) {
+            free(buffer);
+            return fail_errno(&ctx->failure, "read");
+        }
+        sha256_update(&hash, buffer, amount);
+    }
+    free(buffer);
+
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    sha256_final(&hash, digest);
+    sha256_to_hex(digest, out);
+    return true;
+}
+
+bool resume_device_id(struct copy_context *ctx, int fd, char *out, size_t len)
+{
+    // The device's path can change when a USB reader is plugged back in,
+    // so use its size and serial number. MMC and SD cards report a CID
+    // and most other devices have a serial number or WWID. Regular files
+    // grow as they're written, so they're identified by inode instead.
+    struct stat st;
+    if (fstat(fd, &st))
+        return fail_errno(&ctx->failure, "fstat");
+    if (!S_ISBLK(st.st_mode)) {
+        snprintf(out, len, "file-%llu-%llu", (unsigned long long) st.st_dev, (unsigned long long) st.st_ino);
+        return true;
+    }
+
+    uint64_t size = 0;
+    if (ioctl(fd, BLKGETSIZE64, &size) < 0)
+        return fail_errno(&ctx->failure, "BLKGETSIZE64");
+
+    char serial[96] = "";
+    static const char *attributes[] = { "device/cid", "device/serial", "device/wwid" };
+    size_t i;
+    for (i = 0; i < NUM_ELEMENTS(attributes) && !serial[0]; i++) {
+        char path[160];
+        sprintf(path, "/sys/dev/block/%u:%u/%s", major(st.st_rdev), minor(st.st_rdev), attributes[i]);
+        FILE *fp = fopen(path, "r");
+        if (!fp) {
+            sprintf(path, "/sys/dev/block/%u:%u/../%s", major(st.st_rdev), minor(st.st_rdev), attributes[i]);
+            fp = fopen(path, "r");
+        }
+        if (fp) {
+            if (fscanf(fp, "%95s", serial) != 1)
+                serial[0] = '\0';
+            fclose(fp);
+        }
+    }
+
+    snprintf(out, len, "%llu-%s", (unsigned long long) size, serial[0] ? serial : "none");
+    return true;
+}
+
+bool resume_save(const struct resume_journal *journal)
+{
+    // Write a new journal and rename it over the old one so that a crash
+    // never leaves a partial journal. Returns false with errno set on
+    // failure.
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", journal->path);
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp)
+        return false;
+
+    fprintf(fp, "mmccopy-resume 1\n");
+    fprintf(fp, "image %s\n", journal->image_id);
+    fprintf(fp, "device %s\n", journal->device_id);
+    fprintf(fp, "offset %lld\n", (long long) journal->device_offset);
+    fprintf(fp, "size %llu\n", (unsigned long long) journal->total);
+    fprintf(fp, "committed %lld\n", (long long) journal->committed);
+
+    bool ok = (fflush(fp) == 0 && fdatasync(fileno(fp)) == 0);
+    if (fclose(fp) != 0)
+        ok = false;
+    return ok && rename(tmp_path, journal->path) == 0;
+}
+
+bool resume_load(struct copy_context *ctx, struct resume_journal *journal)
+{
+    // Load the committed offset if the journal is for the same copy.
+    FILE *fp = fopen(journal->path, "r");
+    if (!fp) {
+        if (errno != ENOENT)
+            fail_errno(&ctx->failure, "%s", journal->path);
+        return false;
+    }
+
+    char image_id[sizeof(journal->image_id)];
+    char device_id[sizeof(journal->device_id)];
+    long long device_offset;
+    unsigned long long total;
+    long long committed;
+    bool ok = (fscanf(fp, "mmccopy-resume 1 image %64s device %127s offset %lld size %llu committed %lld",
+                      image_id, device_id, &device_offset, &total, &committed) == 5);
+    fclose(fp);
+
+    if (!ok)
+        warning(ctx, "%s isn't a resume journal. Starting from the beginning.", journal->path);
+    else if (strcmp(image_id, journal->image_id) != 0)
+        warning(ctx, "%s is for a different image. Starting from the beginning.", journal->path);
+    else if (strcmp(device_id, journal->device_id) != 0)
+        warning(ctx, "%s is for a different memory card. Starting from the beginning.", journal->path);
+    else if (device_offset != journal->device_offset || total != journal->total)
+        warning(ctx, "%s is for a different offset or size. Starting from the beginning.", journal->path);
+    else {
+        journal->committed = committed;
+        return true;
+    }
+    return false;
+}
+
+bool resume_start(struct copy_context *ctx, struct resume_journal *journal, const char *path, int image_fd,
+                  int mmc_fd, off_t device_offset, size_t total)
+{
+    // Returns true if an earlier copy is being continued. Errors are
+    // recorded in the context's failure.
+    memset(journal, 0, sizeof(*journal));
+    journal->path = path;
+    journal->device_offset = device_offset;
+    journal->total = total;
+    if (!resume_image_id(ctx, image_fd, journal->image_id) ||
+            !resume_device_id(ctx, mmc_fd, journal->device_id, sizeof(journal->device_id)))
+        return false;
+
+    bool resuming = resume_load(ctx, journal) && journal->committed > 0;
+    if (failed(&ctx->failure))
+        return false;
+    journal->base = journal->committed;
+
+    // Block map checksums cover whole ranges, so start at the beginning
+    // of the range that was being written.
+    const struct range_map *map = ctx->data_map;
+    if (map) {
+        size_t i;
+        for (i = 0; i < map->count; i++) {
+            const struct data_range *r = &map->ranges[i];
+            if (r->offset < journal->base && journal->base < r->offset + (off_t) r->len) {
+                journal->base = journal->committed = r->offset;
+                break;
+            }
+        }
+    }
+
+    if (!resume_save(journal))
+        return fail_errno(&ctx->failure, "%s", path);
+    return resuming;
+}
+
+void resume_checkpoint(struct copy_dest *dest)
+{
+    // Commit what's been written every so often. A journal that can't be
+    // updated only loses the ability to resume, so it doesn't stop the
+    // copy.
+    struct resume_journal *journal = dest->ctx->resume_journal;
+    if (journal->failed)
+        return;
+    off_t written = journal->base + (off_t) dest->written;
+    if (written - journal->committed < (off_t) RESUME_INTERVAL)
+        return;
+
+    if (!coalesce_flush(dest) || fdatasync(dest->fd) < 0)
+        return;
+    journal->committed = written;
+    if (!resume_save(journal)) {
+        warning_errno(dest->ctx, "%s", journal->path);
+        journal->failed = true;
+    }
+}
+
+bool resume_skip_image(struct copy_context *ctx, int fd, off_t base, size_t *total_to_copy)
+{
+    if (ctx->image_decompressor) {
+        char *buffer = (char *) alloc_buffer(ONE_MiB);
+        if (!buffer)
+            return fail_errno(&ctx->failure, "posix_memalign");
+        off_t skipped = 0;
+        while (skipped < base && !failed(&ctx->failure)) {
+            size_t len = base - skipped < (off_t) ONE_MiB ? (size_t) (base - skipped) : ONE_MiB;
+            ssize_t amount = decompressor_read(ctx->image_decompressor, buffer, len);
+            if (amount >= 0 && (size_t) amount != len)
+                fail(&ctx->failure, "Image ended before the resume offset");
+            skipped += amount;
+        }
+        free(buffer);
+        if (failed(&ctx->failure))
+            return false;
+    } else if (lseek(fd, base, SEEK_SET) < 0)
+        return fail_errno(&ctx->failure, "lseek");
+
+    if (*total_to_copy)
+        *total_to_copy -= base;
+
+    if (!ctx->quiet) {
+        char sizestr[32];
+        pretty_size(base, sizestr);
+        fprintf(stderr, "Resuming after %s\n", sizestr);
+    }
+    return true;
+}
+
+void resume_finish(struct copy_context *ctx)
+{
+    struct resume_journal *journal = ctx->resume_journal;
+    if (journal && !journal->failed && unlink(journal->path) < 0)
+        warning_errno(ctx, "%s", journal->path);
+}
+
+uint64_t slowest_dest_seq(struct copy_ring *ring, int *active)
+{
+    // Find the oldest buffer that a destination still needs. Call with the
+    // lock held.
+    uint64_t seq = ring->fill_seq;
+    int i;
+    *active = 0;
+    for (i = 0; i < ring->dest_count; i++) {
+        struct copy_dest *dest = &ring->dests[i];
+        if (dest->done)
+            continue;
+        (*active)++;
+        if (dest->drain_seq < seq)
+            seq = dest->drain_seq;
+    }
+    return seq;
+}
+
+void *copy_reader(void *arg)
+{
+    struct copy_ring *ring = (struct copy_ring *) arg;
+    struct copy_context *ctx = ring->source.ctx;
+    bool more = true;
+
+    while (more) {
+        int active;
+        double wait_start = telemetry_active(&ctx->telemetry) ? monotonic_seconds() : 0;
+        pthread_mutex_lock(&ring->lock);
+        while (ring->fill_seq - slowest_dest_seq(ring, &active) == (uint64_t) ring->depth && active > 0)
+            pthread_cond_wait(&ring->cond, &ring->lock);
+        struct copy_buffer *buffer = &ring->buffers[ring->fill_seq % ring->depth];
+        pthread_mutex_unlock(&ring->lock);
+        if (wait_start)
+            telemetry_wait(&ctx->telemetry, false, monotonic_seconds() - wait_start);
+
+        // Stop if every destination has failed or the copy failed
+        if (active == 0 || failed(&ctx->failure)) {
+            buffer->len = 0;
+            more = false;
+        } else {
+            more = source_fill(&ring->source, buffer);
+        }
+
+        pthread_mutex_lock(&ring->lock);
+        if (buffer->len > 0 && active > 0)
+            ring->fill_seq++;
+        ring->eof = !more;
+        pthread_cond_broadcast(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+    }
+    return NULL;
+}
+
+void *copy_writer(void *arg)
+{
+    struct copy_dest *dest = (struct copy_dest *) arg;
+    struct copy_ring *ring = dest->ring;
+    struct copy_context *ctx = dest->ctx;
+
+    // Chunk sizes are tuned to the first memory card and telemetry
+    // follows it too.
+    bool timed = dest == ring->dests && (ring->tuner || telemetry_active(&ctx->telemetry));
+
+    for (;;) {
+        double wait_start = timed ? monotonic_seconds() : 0;
+        pthread_mutex_lock(&ring->lock);
+        while (dest->drain_seq == ring->fill_seq && !ring->eof)
+            pthread_cond_wait(&ring->cond, &ring->lock);
+        if (dest->drain_seq == ring->fill_seq) {
+            pthread_mutex_unlock(&ring->lock);
+            break;
+        }
+        struct copy_buffer *buffer = &ring->buffers[dest->drain_seq % ring->depth];
+        pthread_mutex_unlock(&ring->lock);
+
+        double start = timed ? monotonic_seconds() : 0;
+        if (timed)
+            telemetry_wait(&ctx->telemetry, true, start - wait_start);
+        if (failed(&ctx->failure)) {
+            dest->error = ECANCELED;
+            break;
+        }
+        if (!write_buffer(dest, buffer)) {
+            dest->error = errno;
+            break;
+        }
+        dest->written += buffer->len;
+        if (timed && !buffer->hole) {
+            double seconds = monotonic_seconds() - start;
+            telemetry_write_latency(&ctx->telemetry, seconds);
+            if (ring->tuner)
+                tuner_record(ring->tuner, &ring->source.chunk_size, buffer->len, seconds);
+        }
+
+        if (ctx->resume_journal && dest == ring->dests)
+            resume_checkpoint(dest);
+
+        // Only report progress after the write completes so that the
+        // percentages track completed writes. Skipped holes count as
+        // written.
+        report_dest_progress(ring, dest, false);
+
+        pthread_mutex_lock(&ring->lock);
+        dest->drain_seq++;
+        pthread_cond_broadcast(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+    }
+
+    if (!dest->error) {
+        // Wait for the reader so that the final size is known
+        pthread_mutex_lock(&ring->lock);
+        while (!ring->eof)
+            pthread_cond_wait(&ring->cond, &ring->lock);
+        pthread_mutex_unlock(&ring->lock);
+
+        if (failed(&ctx->failure))
+            dest->error = ECANCELED;
+        else if (!finish_copy(dest, &ring->source))
+            dest->error = errno;
+        else if (dest->alignment || dest->coalesce)
+            report_dest_progress(ring, dest, true);
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    dest->done = true;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+void report_unchanged(const struct copy_dest *dest)
+{
+    char sizestr[32];
+    pretty_size(dest->unchanged, sizestr);
+    fflush(dest->ctx->progress_out);
+    fprintf(stderr, "%s: %s was already up to date\n", dest->path, sizestr);
+}
+
+bool dest_failed(const struct copy_dest *dest)
+{
+    // Record why the copy to the destination failed. Always returns false.
+    struct copy_context *ctx = dest->ctx;
+    if (dest->verify_failed)
+        return fail(&ctx->failure, "%s: verify failed. The first bad block is at offset %lld",
+                    dest->path, (long long) dest->bad_offset);
+
+    errno = dest->error;
+    return fail_errno(&ctx->failure, "%s", dest->path);
+}
+
+void stop_dests(struct copy_ring *ring, int first)
+{
+    // Mark destinations whose writers never started as done so that the
+    // reader doesn't wait for them
+    pthread_mutex_lock(&ring->lock);
+    int i;
+    for (i = first; i < ring->dest_count; i++) {
+        ring->dests[i].error = ECANCELED;
+        ring->dests[i].done = true;
+    }
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+// Copy from one source to one or more destinations. When there's only one
+// destination, its failure fails the copy. Otherwise, each destination's
+// result is printed and the copy fails if any of them did. Returns false
+// after recording an error in the context's failure.
+bool copy(struct copy_context *ctx, int from_fd, struct copy_dest *dests, int dest_count, size_t total_to_copy)
+{
+    struct copy_ring ring;
+    int i;
+
+    memset(&ring, 0, sizeof(ring));
+    ring.depth = ctx->pipeline_depth;
+    ring.dests = dests;
+    ring.dest_count = dest_count;
+    if (!source_init(ctx, &ring.source, from_fd, dests, dest_count, total_to_copy))
+        return false;
+    if (ctx->mmap_input)
+        source_map(&ring.source, ring.depth);
+    ring.buffers = (struct copy_buffer *) calloc(ring.depth, sizeof(struct copy_buffer));
+    if (!ring.buffers)
+        fail_errno(&ctx->failure, "calloc");
+    for (i = 0; ring.buffers && i < ring.depth && !failed(&ctx->failure); i++) {
+        ring.buffers[i].storage = (char *) alloc_buffer(ctx->copy_buffer_size);
+        if (!ring.buffers[i].storage)
+            fail_errno(&ctx->failure, "posix_memalign");
+    }
+    for (i = 0; i < dest_count && !failed(&ctx->failure); i++) {
+        dests[i].ring = &ring;
+        if (ctx->delta_write) {
+            dests[i].compare = (char *) alloc_buffer(ctx->copy_buffer_size);
+            if (!dests[i].compare)
+                fail_errno(&ctx->failure, "posix_memalign");
+        }
+        if (ctx->coalesce_writes && !coalesce_init(&dests[i]))
+            fail_errno(&ctx->failure, "%s", dests[i].path);
+    }
+    pthread_mutex_init(&ring.lock, NULL);
+    pthread_cond_init(&ring.cond, NULL);
+
+    struct chunk_tuner tuner;
+    if (ctx->adaptive_chunks) {
+        tuner_init(&tuner, dests[0].fd);
+        ring.tuner = &tuner;
+        ring.source.chunk_size = tuner.start_size;
+    }
+
+    pthread_t reader;
+    bool reader_started = false;
+    if (!failed(&ctx->failure)) {
+        if (pthread_create(&reader, NULL, copy_reader, &ring))
+            fail(&ctx->failure, "Can't start reader thread");
+        else
+            reader_started = true;
+    }
+
+    // The calling thread writes to the first destination
+    int started = 1;
+    if (reader_started) {
+        for (; started < dest_count; started++) {
+            if (pthread_create(&dests[started].thread, NULL, copy_writer, &dests[started])) {
+                fail(&ctx->failure, "Can't start writer thread");
+                stop_dests(&ring, started);
+                break;
+            }
+        }
+        copy_writer(&dests[0]);
+        for (i = 1; i < started; i++)
+            pthread_join(dests[i].thread, NULL);
+        pthread_join(reader, NULL);
+    }
+
+    if (ring.source.verify) {
+        // Reuse the pipeline's buffers for reading back
+        char *buffers[MAX_PIPELINE_DEPTH];
+        int j;
+        for (j = 0; j < ring.depth; j++)
+            buffers[j] = ring.buffers[j].storage;
+
+        verify_end_block(ring.source.verify);
+        end_progress(ctx);
+        for (i = 0; i < dest_count && !failed(&ctx->failure); i++) {
+            if (!dests[i].error)
+                verify_dest(&dests[i], ring.source.verify, buffers, ring.depth, dest_count == 1);
+        }
+        verify_free(ring.source.verify);
+    }
+
+    pthread_cond_destroy(&ring.cond);
+    pthread_mutex_destroy(&ring.lock);
+    source_unmap(&ring.source);
+    for (i = 0; ring.buffers && i < ring.depth; i++)
+        free(ring.buffers[i].storage);
+    free(ring.buffers);
+    for (i = 0; i < dest_count; i++) {
+        free(dests[i].compare);
+        free(dests[i].pending);
+        free(dests[i].scratch);
+        dests[i].compare = dests[i].pending = dests[i].scratch = NULL;
+    }
+
+    if (!reader_started)
+        return false;
+    if (!ctx->verify_writes)
+        end_progress(ctx);
+    if (failed(&ctx->failure))
+        return false;
+
+    if (dest_count == 1) {
+        if (dests[0].error)
+            return dest_failed(&dests[0]);
+        if (ctx->delta_write && !ctx->quiet)
+            report_unchanged(&dests[0]);
+        if (ring.tuner && !ctx->quiet)
+            report_chunk_size(ctx, ring.tuner);
+        return true;
+    }
+
+    if (ring.tuner && !ctx->quiet)
+        report_chunk_size(ctx, ring.tuner);
+
+    int failures = 0;
+    for (i = 0; i < dest_count; i++) {
+        if (dests[i].error)
+            failures++;
+        if (ctx->library)
+            continue;
+
+        if (dests[i].verify_failed) {
+            fprintf(stderr, "%s: failed: verify failed at offset %lld\n", dests[i].path,
+                    (long long) dests[i].bad_offset);
+        } else if (dests[i].error) {
+            fprintf(stderr, "%s: failed: %s\n", dests[i].path, strerror(dests[i].error));
+        } else if (!ctx->quiet) {
+            fprintf(stderr, "%s: ok\n", dests[i].path);
+            if (ctx->delta_write)
+                report_unchanged(&dests[i]);
+        }
+    }
+    if (failures)
+        return fail(&ctx->failure, "%d of %d memory cards failed", failures, dest_count);
+    return true;
+}
+
+#ifdef USE_IO_URING
+// Minimal io_uring support using the raw system calls so that there's no
+// dependency on liburing. Only what's needed to keep a queue of writes in
+// flight to the memory card is implemented.
+struct uring
+{
+    int fd;
+
+    void *sq_ptr;
+    size_t sq_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    void *cq_ptr;
+    size_t cq_len;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+struct uring_write
+{
+    struct copy_buffer buffer;
+    size_t pos;       // Start of the current write in the buffer
+    size_t run;       // Length of the current write
+    size_t tail;      // Unaligned bytes after the run already written
+    size_t done;      // Bytes of the current write completed (for short writes)
+    double submitted; // When the current write was queued (for telemetry)
+    bool in_flight;
+};
+
+int uring_init(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = 0;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto fail;
+
+    if (ring->cq_len) {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            munmap(ring->sq_ptr, ring->sq_len);
+            goto fail;
+        }
+    } else
+        ring->cq_ptr = ring->sq_ptr;
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_len)
+            munmap(ring->cq_ptr, ring->cq_len);
+        munmap(ring->sq_ptr, ring->sq_len);
+        goto fail;
+    }
+
+    char *sq = (char *) ring->sq_ptr;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+    char *cq = (char *) ring->cq_ptr;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return 0;
+
+fail:
+    close(ring->fd);
+    return -1;
+}
+
+void uring_free(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_len)
+        munmap(ring->cq_ptr, ring->cq_len);
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+}
+
+bool uring_submit_write(struct uring *ring, int fd, struct uring_write *w, int index, bool fixed)
+{
+    // Returns false with errno set on failure
+    unsigned tail = *ring->sq_tail;
+    unsigned ix = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[ix];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) (w->buffer.data + w->pos + w->done);
+    sqe->len = w->run - w->done;
+    sqe->off = w->buffer.offset + w->pos + w->done;
+    sqe->buf_index = fixed ? index : 0;
+    sqe->user_data = index;
+    ring->sq_array[ix] = ix;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    for (;;) {
+        int rc = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+        if (rc >= 0)
+            break;
+        if (errno != EINTR) {
+            // The submission is still in the ring, so take it back out
+            __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+            return false;
+        }
+    }
+    w->in_flight = true;
+    return true;
+}
+
+bool uring_wait(struct uring *ring)
+{
+    // Returns false with errno set on failure
+    while (__atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) == *ring->cq_head) {
+        int rc = syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc < 0 && errno != EINTR)
+            return false;
+    }
+    return true;
+}
+
+// Queue the next write from a buffer. Zero blocks are skipped in sparse
+// mode and unaligned O_DIRECT pieces are written synchronously. Returns
+// the number of bytes that were finished without going through io_uring.
+// Errors are recorded in the context's failure.
+size_t uring_queue_next(struct copy_dest *dest, struct uring *ring, struct uring_write *w,
+                        int index, bool fixed, size_t alignment)
+{
+    struct copy_context *ctx = dest->ctx;
+    struct copy_buffer *buffer = &w->buffer;
+    int fd = dest->fd;
+    size_t finished = 0;
+
+    while (w->pos < buffer->len) {
+        size_t start = w->pos;
+        size_t run;
+        if (buffer->hole) {
+            w->pos = buffer->len;
+            run = 0;
+        } else if (ctx->sparse_write)
+            run = next_data_run(buffer->data, buffer->len, &w->pos);
+        else
+            run = buffer->len - w->pos;
+        finished += w->pos - start;
+        discard_skipped(dest->discards, buffer->offset + start, w->pos - start);
+        if (run == 0)
+            break;
+
+        // The unaligned head and tail need a read-modify-write, so do them
+        // here. They don't share blocks with the writes in flight.
+        off_t offset = buffer->offset + w->pos;
+        w->tail = 0;
+        if (alignment) {
+            if (offset % alignment) {
+                if (!write_chunk(fd, buffer->data + w->pos, run, offset, alignment)) {
+                    fail_errno(&ctx->failure, "%s", dest->path);
+                    return finished;
+                }
+                w->pos += run;
+                finished += run;
+                continue;
+            }
+
+            w->tail = run % alignment;
+            run -= w->tail;
+            if (w->tail && !write_chunk(fd, buffer->data + w->pos + run, w->tail, offset + run, alignment)) {
+                fail_errno(&ctx->failure, "%s", dest->path);
+                return finished;
+            }
+            if (run == 0) {
+                w->pos += w->tail;
+                finished += w->tail;
+                continue;
+            }
+        }
+
+        w->run = run;
+        w->done = 0;
+        w->submitted = telemetry_active(&ctx->telemetry) ? monotonic_seconds() : 0;
+        if (!uring_submit_write(ring, fd, w, index, fixed))
+            fail_errno(&ctx->failure, "io_uring_enter");
+        return finished;
+    }
+    return finished;
+}
+
+// Copy to the memory card using io_uring so that several writes can be
+// outstanding at once. Returns false if io_uring isn't available so that
+// the caller can fall back to the read/write pipeline, or after recording
+// an error in the context's failure.
+bool copy_uring(struct copy_context *ctx, int from_fd, struct copy_dest *dest, size_t total_to_copy)
+{
+    if (dest->offset < 0)
+        return false;
+
+    struct uring ring;
+    if (uring_init(&ring, ctx->queue_depth) < 0)
+        return false;
+
+    int to_fd = dest->fd;
+    int queue_depth = ctx->queue_depth;
+    struct copy_source src;
+    if (!source_init(ctx, &src, from_fd, dest, 1, total_to_copy)) {
+        uring_free(&ring);
+        return false;
+    }
+
+    struct uring_write writes[MAX_QUEUE_DEPTH];
+    struct iovec iovecs[MAX_QUEUE_DEPTH];
+    int i;
+    memset(writes, 0, sizeof(writes));
+    for (i = 0; i < queue_depth; i++) {
+        writes[i].buffer.storage = (char *) alloc_buffer(ctx->copy_buffer_size);
+        if (!writes[i].buffer.storage && !failed(&ctx->failure))
+            fail_errno(&ctx->failure, "posix_memalign");
+        iovecs[i].iov_base = writes[i].buffer.storage;
+        iovecs[i].iov_len = ctx->copy_buffer_size;
+    }
+
+    // Registered buffers save the kernel from mapping the pages on every
+    // write. They count against RLIMIT_MEMLOCK on older kernels, so fall
+    // back to normal writes if registration fails.
+    bool fixed = !failed(&ctx->failure) &&
+                 syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iovecs, queue_depth) == 0;
+
+    // After a failure, nothing more is queued, but the writes in flight
+    // still have to complete before their buffers can be freed.
+    size_t total_written = 0;
+    int in_flight = 0;
+    bool more = !failed(&ctx->failure);
+    while (more || in_flight > 0) {
+        // Keep the queue full. The next buffer is read while the previous
+        // writes are still in progress.
+        for (i = 0; i < queue_depth && more; i++) {
+            struct uring_write *w = &writes[i];
+            if (w->in_flight)
+                continue;
+
+            double fill_start = telemetry_active(&ctx->telemetry) ? monotonic_seconds() : 0;
+            more = source_fill(&src, &w->buffer);
+            if (fill_start)
+                telemetry_wait(&ctx->telemetry, true, monotonic_seconds() - fill_start);
+            w->pos = 0;
+            if (!failed(&ctx->failure))
+                total_written += uring_queue_next(dest, &ring, w, i, fixed, src.alignment);
+            if (w->in_flight)
+                in_flight++;
+            else if (!src.alignment || total_written != total_to_copy)
+                report_progress(ctx, total_written, total_to_copy);
+            if (failed(&ctx->failure))
+                more = false;
+        }
+
+        if (in_flight == 0)
+            continue;
+
+        double wait_start = telemetry_active(&ctx->telemetry) ? monotonic_seconds() : 0;
+        if (!uring_wait(&ring)) {
+            // Without completions, the kernel may still be using the
+            // buffers of the writes in flight, so leak them rather than
+            // freeing them.
+            fail_errno(&ctx->failure, "io_uring_enter");
+            for (i = 0; i < queue_depth; i++) {
+                if (writes[i].in_flight)
+                    writes[i].buffer.storage = NULL;
+            }
+            break;
+        }
+        if (wait_start)
+            telemetry_wait(&ctx->telemetry, false, monotonic_seconds() - wait_start);
+        unsigned head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            int index = cqe->user_data;
+            struct uring_write *w = &writes[index];
+            int res = cqe->res;
+            head++;
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+            w->in_flight = false;
+            if (res < 0 && (res == -EINTR || res == -EAGAIN) && !failed(&ctx->failure)) {
+                if (!uring_submit_write(&ring, to_fd, w, index, fixed))
+                    fail_errno(&ctx->failure, "io_uring_enter");
+            } else if (res < 0) {
+                errno = -res;
+                fail_errno(&ctx->failure, "%s", dest->path);
+            } else if (res == 0) {
+                fail(&ctx->failure, "%s: no progress writing to memory card", dest->path);
+            } else {
+                w->done += res;
+                if (w->done < w->run) {
+                    // Short write, so queue up the rest
+                    if (!failed(&ctx->failure) && !uring_submit_write(&ring, to_fd, w, index, fixed))
+                        fail_errno(&ctx->failure, "io_uring_enter");
+                } else {
+                    if (w->submitted)
+                        telemetry_write_latency(&ctx->telemetry, monotonic_seconds() - w->submitted);
+                    total_written += w->run + w->tail;
+                    w->pos += w->run + w->tail;
+                    if (!failed(&ctx->failure))
+                        total_written += uring_queue_next(dest, &ring, w, index, fixed, src.alignment);
+                    if (!src.alignment || total_written != total_to_copy)
+                        report_progress(ctx, total_written, total_to_copy);
+                }
+            }
+            if (!w->in_flight)
+                in_flight--;
+            if (failed(&ctx->failure))
+                more = false;
+        }
+    }
+    uring_free(&ring);
+
+    bool ok = !failed(&ctx->failure);
+    if (ok && !finish_copy(dest, &src))
+        ok = fail_errno(&ctx->failure, "%s", dest->path);
+    if (ok && src.alignment)
+        report_progress(ctx, total_written, total_to_copy);
+    end_progress(ctx);
+
+    if (src.verify) {
+        char *buffers[MAX_QUEUE_DEPTH];
+        for (i = 0; i < queue_depth; i++)
+            buffers[i] = writes[i].buffer.storage;
+
+        verify_end_block(src.verify);
+        if (ok && !verify_dest(dest, src.verify, buffers, queue_depth, true))
+            ok = failed(&ctx->failure) ? false : dest_failed(dest);
+        verify_free(src.verify);
+    }
+
+    for (i = 0; i < queue_depth; i++)
+        free(writes[i].buffer.storage);
+    return ok;
+}
+#else
+bool copy_uring(struct copy_context *ctx, int from_fd, struct copy_dest *dest, size_t total_to_copy)
+{
+    return false;
+}
+#endif
+
+// Reading from the memory card can use several threads at once. Each one
+// claims the next chunk and reads it with pread. When the output can seek,
+// the thread writes the chunk at the matching offset. Otherwise, it leaves
+// the chunk in a slot for the calling thread to write in order.
+struct read_slot
+{
+    char *data;
+    size_t len;
+    uint64_t seq;
+    bool ready;
+};
+
+struct parallel_read
+{
+    struct copy_context *ctx;
+    int from_fd;
+    int to_fd;
+    off_t from_offset;
+    off_t to_offset;        // -1 when writing in order
+    size_t total;
+    size_t chunk;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t next_seq;      // Next chunk to claim
+    uint64_t written_seq;   // Next chunk to write in order
+    uint64_t end_seq;       // Chunks from here on are past the end of the card
+    size_t done;            // Bytes copied for progress
+
+    struct read_slot *slots;
+    int slot_count;
+};
+
+struct parallel_reader
+{
+    struct parallel_read *job;
+    char *buffer;           // Used when writing at offsets
+    pthread_t thread;
+};
+
+void *parallel_read_thread(void *arg)
+{
+    struct parallel_reader *reader = (struct parallel_reader *) arg;
+    struct parallel_read *job = reader->job;
+    bool ordered = job->to_offset < 0;
+
+    for (;;) {
+        // A failure anywhere ends the copy at the first chunk
+        pthread_mutex_lock(&job->lock);
+        if (failed(&job->ctx->failure))
+            job->end_seq = 0;
+        uint64_t seq = job->next_seq;
+        while (ordered && seq < job->end_seq && seq - job->written_seq >= (uint64_t) job->slot_count) {
+            pthread_cond_wait(&job->cond, &job->lock);
+            seq = job->next_seq;
+        }
+        off_t offset = seq * job->chunk;
+        if ((size_t) offset >= job->total || seq >= job->end_seq) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        job->next_seq++;
+        pthread_mutex_unlock(&job->lock);
+
+        struct read_slot *slot = ordered ? &job->slots[seq % job->slot_count] : NULL;
+        char *buffer = ordered ? slot->data : reader->buffer;
+        size_t len = job->total - offset < job->chunk ? job->total - offset : job->chunk;
+        ssize_t amount = read_fully_at(job->from_fd, buffer, len, job->from_offset + offset);
+        if (amount < 0)
+            fail_errno(&job->ctx->failure, "read");
+        size_t amount_read = amount < 0 ? 0 : amount;
+
+        if (!ordered && amount_read > 0) {
+            struct telemetry *telemetry = &job->ctx->telemetry;
+            double start = telemetry_active(telemetry) ? monotonic_seconds() : 0;
+            if (!pwrite_fully(job->to_fd, buffer, amount_read, job->to_offset + offset))
+                fail_errno(&job->ctx->failure, "write");
+            else if (start)
+                telemetry_write_latency(telemetry, monotonic_seconds() - start);
+        }
+
+        pthread_mutex_lock(&job->lock);
+        if (failed(&job->ctx->failure))
+            job->end_seq = 0;
+        else if (amount_read < len && seq + 1 < job->end_seq)
+            job->end_seq = seq + 1;
+        if (ordered) {
+            slot->len = amount_read;
+            slot->seq = seq;
+            slot->ready = true;
+        } else {
+            job->done += amount_read;
+            report_progress(job->ctx, job->done, job->total);
+        }
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+    return NULL;
+}
+
+bool copy_parallel_read(struct copy_context *ctx, int from_fd, int to_fd, size_t total_to_copy,
+                        struct compressor *compressor)
+{
+    // Returns false after recording an error in the context's failure.
+    // The compressor is finished either way.
+    struct parallel_read job;
+    memset(&job, 0, sizeof(job));
+    job.ctx = ctx;
+    job.from_fd = from_fd;
+    job.to_fd = to_fd;
+    job.from_offset = lseek(from_fd, 0, SEEK_CUR);
+    job.to_offset = compressor ? -1 : lseek(to_fd, 0, SEEK_CUR);
+    job.total = total_to_copy;
+    job.chunk = ctx->chunk_size;
+    job.end_seq = UINT64_MAX;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    // Give each reader two slots so that they can keep reading while the
+    // output is written.
+    bool ordered = job.to_offset < 0;
+    int i;
+    if (ordered) {
+        job.slot_count = 2 * ctx->reader_count;
+        job.slots = (struct read_slot *) calloc(job.slot_count, sizeof(struct read_slot));
+        if (!job.slots) {
+            fail_errno(&ctx->failure, "calloc");
+            job.slot_count = 0;
+        }
+        for (i = 0; i < job.slot_count; i++) {
+            job.slots[i].data = (char *) alloc_buffer(job.chunk);
+            if (!job.slots[i].data && !failed(&ctx->failure))
+                fail_errno(&ctx->failure, "posix_memalign");
+        }
+    }
+
+    struct parallel_reader readers[MAX_READERS];
+    int started;
+    for (started = 0; started < ctx->reader_count && !failed(&ctx->failure); started++) {
+        readers[started].job = &job;
+        readers[started].buffer = NULL;
+        if (!ordered) {
+            readers[started].buffer = (char *) alloc_buffer(job.chunk);
+            if (!readers[started].buffer) {
+                fail_errno(&ctx->failure, "posix_memalign");
+                break;
+            }
+        }
+        if (pthread_create(&readers[started].thread, NULL, parallel_read_thread, &readers[started])) {
+            fail(&ctx->failure, "Can't start reader thread");
+            free(readers[started].buffer);
+            break;
+        }
+    }
+
+    if (ordered) {
+        pthread_mutex_lock(&job.lock);
+        while (job.written_seq < job.end_seq && job.written_seq * job.chunk < job.total &&
+               !failed(&ctx->failure)) {
+            struct read_slot *slot = &job.slots[job.written_seq % job.slot_count];
+            if (!slot->ready || slot->seq != job.written_seq) {
+                pthread_cond_wait(&job.cond, &job.lock);
+                continue;
+            }
+            pthread_mutex_unlock(&job.lock);
+
+            double start = telemetry_active(&ctx->telemetry) ? monotonic_seconds() : 0;
+            if (compressor && is_zero(slot->data, slot->len))
+                compressor_write_zeros(compressor, slot->len);
+            else if (compressor)
+                compressor_write(compressor, slot->data, slot->len);
+            else if (!write_fully(to_fd, slot->data, slot->len))
+                fail_errno(&ctx->failure, "write");
+            if (start)
+                telemetry_write_latency(&ctx->telemetry, monotonic_seconds() - start);
+
+            pthread_mutex_lock(&job.lock);
+            job.done += slot->len;
+            slot->ready = false;
+            job.written_seq++;
+            pthread_cond_broadcast(&job.cond);
+            report_progress(ctx, job.done, job.total);
+        }
+
+        // Let readers waiting for a slot see the failure
+        if (failed(&ctx->failure))
+            job.end_seq = 0;
+        pthread_cond_broadcast(&job.cond);
+        pthread_mutex_unlock(&job.lock);
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(readers[i].thread, NULL);
+        free(readers[i].buffer);
+    }
+    for (i = 0; i < job.slot_count; i++)
+        free(job.slots[i].data);
+    free(job.slots);
+    if (compressor)
+        compressor_finish(compressor);
+
+    // Leave the output positioned after the data like a normal copy
+    if (!ordered && !failed(&ctx->failure) && lseek(to_fd, job.to_offset + job.done, SEEK_SET) < 0)
+        fail_errno(&ctx->failure, "lseek");
+
+    pthread_cond_destroy(&job.cond);
+    pthread_mutex_destroy(&job.lock);
+    end_progress(ctx);
+    return !failed(&ctx->failure);
+}
+
+enum kernel_copy_method {
+    KERNEL_COPY_FILE_RANGE,
+    KERNEL_SENDFILE,
+    KERNEL_SPLICE
+};
+
+ssize_t kernel_copy(enum kernel_copy_method method, int from_fd, off_t *from_offset,
+                    int to_fd, off_t *to_offset, size_t len)
+{
+    switch (method) {
+    case KERNEL_COPY_FILE_RANGE:
+        return copy_file_range(from_fd, from_offset, to_fd, to_offset, len, 0);
+    case KERNEL_SENDFILE:
+        // sendfile writes at the current position, which is kept in sync
+        // with to_offset.
+        {
+            ssize_t amount = sendfile(to_fd, from_fd, from_offset, len);
+            if (amount > 0)
+                *to_offset += amount;
+            return amount;
+        }
+    case KERNEL_SPLICE:
+    default:
+        return splice(from_fd, NULL, to_fd, to_offset, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+    }
+}
+
+bool copy_zero_copy(struct copy_context *ctx, int from_fd, struct copy_dest *dest, size_t total_to_copy)
+{
+    // Have the kernel move the data directly from the image to the memory
+    // card. This only works when nothing needs to look at the data on the
+    // way. Files use copy_file_range or sendfile and pipes use splice.
+    // Returns false if the kernel doesn't support any of them so that the
+    // regular copy can be used, or after recording an error in the
+    // context's failure.
+    if (ctx->image_decompressor || ctx->sparse_write || ctx->verify_writes || ctx->delta_write ||
+            dest->alignment || dest->offset < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(from_fd, &st))
+        return fail_errno(&ctx->failure, "fstat");
+
+    enum kernel_copy_method method;
+    if (S_ISREG(st.st_mode))
+        method = KERNEL_COPY_FILE_RANGE;
+    else if (S_ISFIFO(st.st_mode))
+        method = KERNEL_SPLICE;
+    else
+        return false;
+
+    // Block maps can be followed by skipping between the ranges as long
+    // as there are no checksums to check and nothing to discard.
+    if (ctx->data_map) {
+        size_t i;
+        if (method != KERNEL_COPY_FILE_RANGE || dest->discards)
+            return false;
+        for (i = 0; i < ctx->data_map->count; i++) {
+            if (ctx->data_map->ranges[i].has_checksum)
+                return false;
+        }
+    }
+
+    struct copy_source src;
+    if (!source_init(ctx, &src, from_fd, dest, 1, total_to_copy))
+        return false;
+
+    // Each splice writes at most what fits in the pipe, so grow it to a
+    // chunk if possible. This fails harmlessly when the chunk is over the
+    // system's limit.
+    if (method == KERNEL_SPLICE)
+        fcntl(from_fd, F_SETPIPE_SZ, (int) src.chunk_size);
+
+    off_t from_offset = src.seekable ? src.from_offset : 0;
+    off_t to_offset = dest->offset;
+    bool copied = false;
+    while (!failed(&ctx->failure)) {
+        size_t remaining = total_to_copy ? total_to_copy - src.total_read : SIZE_MAX;
+        if (src.seekable && (uint64_t) (src.from_size - from_offset) < remaining)
+            remaining = src.from_size - from_offset;
+        if (remaining == 0)
+            break;
+
+        off_t data_end = OFF_MAX;
+        if (src.map) {
+            src.from_offset = from_offset;
+            off_t data = source_next_data(&src, &data_end);
+            if (data > from_offset) {
+                size_t skip = remaining;
+                if ((uint64_t) (data - from_offset) < skip)
+                    skip = data - from_offset;
+                from_offset += skip;
+                to_offset += skip;
+                src.total_read += skip;
+                if (method == KERNEL_SENDFILE && lseek(dest->fd, to_offset, SEEK_SET) < 0)
+                    return fail_errno(&ctx->failure, "lseek");
+                report_progress(ctx, src.total_read, total_to_copy);
+                continue;
+            }
+        }
+
+        size_t len = next_chunk_size(to_offset, remaining, 0, src.chunk_size, src.erase_size);
+        if ((uint64_t) (data_end - from_offset) < len)
+            len = data_end - from_offset;
+        double start = telemetry_active(&ctx->telemetry) ? monotonic_seconds() : 0;
+        ssize_t amount = kernel_copy(method, from_fd, src.seekable ? &from_offset : NULL,
+                                     dest->fd, &to_offset, len);
+        if (start && amount > 0)
+            telemetry_write_latency(&ctx->telemetry, monotonic_seconds() - start);
+        if (amount < 0) {
+            if (errno == EINTR)
+                continue;
+
+            // copy_file_range only works between regular files. Try
+            // sendfile for block devices. Give up if nothing works.
+            bool unsupported = (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+                                errno == EOPNOTSUPP || errno == EBADF);
+            if (unsupported && method == KERNEL_COPY_FILE_RANGE) {
+                method = KERNEL_SENDFILE;
+                if (lseek(dest->fd, to_offset, SEEK_SET) < 0)
+                    return fail_errno(&ctx->failure, "lseek");
+                continue;
+            }
+            if (unsupported && !copied) {
+                if (lseek(dest->fd, dest->offset, SEEK_SET) < 0)
+                    return fail_errno(&ctx->failure, "lseek");
+                return false;
+            }
+            return fail_errno(&ctx->failure, "%s", dest->path);
+        }
+        if (amount == 0)
+            break;
+        copied = true;
+
+        // Report progress in chunk sized steps even if the kernel copies
+        // less at a time.
+        size_t last_chunk = src.total_read / src.chunk_size;
+        src.total_read += amount;
+        if (src.total_read / src.chunk_size != last_chunk || src.total_read == total_to_copy)
+            report_progress(ctx, src.total_read, total_to_copy);
+    }
+    if (failed(&ctx->failure))
+        return false;
+
+    // sendfile and splice leave the file position alone or at the end of
+    // what they wrote. Put it there either way for finish_copy.
+    if (lseek(dest->fd, to_offset, SEEK_SET) < 0)
+        return fail_errno(&ctx->failure, "lseek");
+
+    if (!finish_copy(dest, &src))
+        return fail_errno(&ctx->failure, "%s", dest->path);
+    end_progress(ctx);
+    return true;
+}
+
+// --partition copies only the selected partitions of the image. They're
+// turned into a block map so that everything else is skipped the same way
+// as with --bmap. The selected partitions are kept in the context for
+// check_card_partitions.
+
+struct image_reader
+{
+    int fd;
+    struct decompressor *decoder;
+    uint64_t pos;       // Decompressed bytes read so far
+};
+
+bool read_image_at(void *context, void *buffer, size_t len, uint64_t offset)
+{
+    struct image_reader *r = (struct image_reader *) context;
+    size_t amount;
+    if (!r->decoder)
+        return pread_fully(r->fd, (char *) buffer, len, offset, &amount) && amount == len;
+
+    // Compressed images can only be read forward
+    if (offset < r->pos)
+        return false;
+    char scratch[64 * 1024];
+    ssize_t n;
+    while (r->pos < offset) {
+        size_t skip = offset - r->pos < sizeof(scratch) ? offset - r->pos : sizeof(scratch);
+        n = decompressor_read(r->decoder, scratch, skip);
+        if (n < 0)
+            return false;
+        r->pos += n;
+        if ((size_t) n != skip)
+            return false;
+    }
+    n = decompressor_read(r->decoder, (char *) buffer, len);
+    if (n < 0)
+        return false;
+    r->pos += n;
+    return (size_t) n == len;
+}
+
+bool read_card_at(void *context, void *buffer, size_t len, uint64_t offset)
+{
+    struct image_reader *r = (struct image_reader *) context;
+    size_t amount;
+    return pread_fully(r->fd, (char *) buffer, len, r->pos + offset, &amount) && amount == len;
+}
+
+bool select_partition(struct copy_context *ctx, const struct partition *p)
+{
+    struct partition_table *selected = &ctx->selected_partitions;
+    struct partition *partitions = (struct partition *) realloc(selected->partitions,
+                                   (selected->count + 1) * sizeof(struct partition));
+    if (!partitions)
+        return fail_errno(&ctx->failure, "realloc");
+    selected->partitions = partitions;
+    selected->partitions[selected->count++] = *p;
+    return true;
+}
+
+struct range_map *partition_map(struct copy_context *ctx, const char *path, const char *selectors)
+{
+    // Returns NULL after recording an error in the context's failure.
+    // Use a separate file descriptor so that the copy still starts at the
+    // beginning of the image.
+    struct image_reader reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.fd = open(path, O_RDONLY);
+    if (reader.fd < 0) {
+        fail_errno(&ctx->failure, "%s", path);
+        return NULL;
+    }
+    uint64_t size = 0;
+    if (ctx->auto_decompress)
+        reader.decoder = decompressor_open(reader.fd, &size, &ctx->failure);
+
+    struct partition_table table;
+    bool have_table = !failed(&ctx->failure) &&
+                      partition_table_read(&table, read_image_at, &reader, &ctx->failure);
+    if (reader.decoder)
+        decompressor_free(reader.decoder);
+    close(reader.fd);
+    if (!have_table) {
+        if (!failed(&ctx->failure))
+            fail(&ctx->failure, "%s doesn't have a partition table", path);
+        return NULL;
+    }
+
+    struct range_map *map = (struct range_map *) calloc(1, sizeof(struct range_map));
+    char *list = strdup(selectors);
+    if (!map || !list) {
+        fail_errno(&ctx->failure, "calloc");
+        free(map);
+        free(list);
+        partition_table_free(&table);
+        return NULL;
+    }
+    size_t capacity = 0;
+
+    char *selector;
+    char *saveptr;
+    for (selector = strtok_r(list, ",", &saveptr); selector; selector = strtok_r(NULL, ",", &saveptr)) {
+        const struct partition *p = partition_find(&table, selector);
+        if (!p) {
+            fail(&ctx->failure, "%s doesn't have a partition %s", path, selector);
+            break;
+        }
+        if (partition_find(&ctx->selected_partitions, selector))
+            continue;
+
+        if (!select_partition(ctx, p))
+            break;
+        if (!add_data_range(map, &capacity, p->offset, p->size)) {
+            fail_errno(&ctx->failure, "realloc");
+            break;
+        }
+    }
+    free(list);
+    partition_table_free(&table);
+    if (!failed(&ctx->failure) && map->count == 0)
+        fail(&ctx->failure, "No partitions selected");
+    if (failed(&ctx->failure)) {
+        free_range_map(map);
+        return NULL;
+    }
+
+    // Merge partitions that are next to each other into one range so
+    // that they're written with big sequential writes.
+    qsort(map->ranges, map->count, sizeof(struct data_range), compare_data_ranges);
+    size_t i, merged = 0;
+    for (i = 0; i < map->count; i++) {
+        const struct data_range *r = &map->ranges[i];
+        struct data_range *prev = merged > 0 ? &map->ranges[merged - 1] : NULL;
+        if (prev && prev->offset + (off_t) prev->len >= r->offset) {
+            off_t end = r->offset + r->len;
+            if (end > prev->offset + (off_t) prev->len)
+                prev->len = end - prev->offset;
+        } else
+            map->ranges[merged++] = *r;
+    }
+    map->count = merged;
+
+    // The copy can stop after the last partition
+    const struct data_range *last = &map->ranges[map->count - 1];
+    map->image_size = last->offset + last->len;
+    return map;
+}
+
+bool check_card_partitions(struct copy_context *ctx, const char *mmc_device, off_t seek_offset)
+{
+    // Only write partitions into a memory card with the same layout.
+    // Otherwise they'd land on top of something else. Returns false after
+    // recording an error in the context's failure.
+    struct image_reader reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.fd = open(mmc_device, O_RDONLY);
+    if (reader.fd < 0)
+        return fail_errno(&ctx->failure, "%s", mmc_device);
+    reader.pos = seek_offset;
+
+    struct partition_table table;
+    bool have_table = partition_table_read(&table, read_card_at, &reader, &ctx->failure);
+    close(reader.fd);
+    if (!have_table) {
+        if (failed(&ctx->failure))
+            return false;
+        return fail(&ctx->failure, "%s doesn't have a partition table. Write the whole image first.", mmc_device);
+    }
+
+    int i;
+    for (i = 0; i < ctx->selected_partitions.count; i++) {
+        const struct partition *want = &ctx->selected_partitions.partitions[i];
+        char number[16];
+        sprintf(number, "%d", want->number);
+        const struct partition *have = partition_find(&table, number);
+        if (!have || have->offset != want->offset || have->size != want->size) {
+            fail(&ctx->failure, "Partition %d on %s doesn't match the image. Write the whole image first.",
+                 want->number, mmc_device);
+            break;
+        }
+    }
+    partition_table_free(&table);
+    return !failed(&ctx->failure);
+}
+
+// A --job file lists several images to write in one run. Each line is
+// "<image> <offset> [size] [trim]". Blank lines and everything after a
+// '#' are ignored. Relative image paths are relative to the job file.
+int compare_job_segments(const void *a, const void *b)
+{
+    off_t x = ((const struct job_segment *) a)->offset;
+    off_t y = ((const struct job_segment *) b)->offset;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+bool add_job_segment(struct copy_context *ctx, struct copy_job *job, const char *job_path, int line_number,
+                     char *image, const char *offset, const char *size, bool trim)
+{
+    struct job_segment *segments = (struct job_segment *) realloc(job->segments,
+                                   (job->count + 1) * sizeof(struct job_segment));
+    if (!segments)
+        return fail_errno(&ctx->failure, "realloc");
+    job->segments = segments;
+    struct job_segment *segment = &job->segments[job->count++];
+    memset(segment, 0, sizeof(*segment));
+    segment->fd = -1;
+
+    const char *slash = strrchr(job_path, '/');
+    if (image[0] != '/' && slash) {
+        char *path = (char *) malloc(slash - job_path + strlen(image) + 2);
+        if (!path)
+            return fail_errno(&ctx->failure, "malloc");
+        sprintf(path, "%.*s/%s", (int) (slash - job_path), job_path, image);
+        segment->path = path;
+    } else {
+        segment->path = strdup(image);
+        if (!segment->path)
+            return fail_errno(&ctx->failure, "strdup");
+    }
+
+    segment->fd = open(segment->path, O_RDONLY);
+    if (segment->fd < 0)
+        return fail_errno(&ctx->failure, "%s", segment->path);
+
+    struct stat st;
+    if (fstat(segment->fd, &st))
+        return fail_errno(&ctx->failure, "fstat");
+    uint64_t image_size = st.st_size;
+    if (ctx->auto_decompress) {
+        segment->decoder = decompressor_open(segment->fd, &image_size, &ctx->failure);
+        if (failed(&ctx->failure))
+            return false;
+    }
+
+    size_t segment_offset;
+    if (!parse_size(ctx, offset, &segment_offset))
+        return false;
+    segment->offset = segment_offset;
+    segment->size = 0;
+    if (size && !parse_size(ctx, size, &segment->size))
+        return false;
+    if (image_size != 0 && (segment->size == 0 || image_size < segment->size))
+        segment->size = image_size;
+    if (segment->size == 0)
+        return fail(&ctx->failure, "%s:%d: Specify the size of %s", job_path, line_number, segment->path);
+    segment->trim = trim;
+    return true;
+}
+
+void free_job(struct copy_job *job)
+{
+    int i;
+    for (i = 0; i < job->count; i++) {
+        if (job->segments[i].decoder)
+            decompressor_free(job->segments[i].decoder);
+        if (job->segments[i].fd >= 0)
+            close(job->segments[i].fd);
+        free((char *) job->segments[i].path);
+    }
+    free(job->segments);
+    free(job);
+}
+
+struct copy_job *load_job(struct copy_context *ctx, const char *path)
+{
+    // Returns NULL after recording an error in the context's failure
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fail_errno(&ctx->failure, "%s", path);
+        return NULL;
+    }
+
+    struct copy_job *job = (struct copy_job *) calloc(1, sizeof(struct copy_job));
+    if (!job) {
+        fail_errno(&ctx->failure, "calloc");
+        fclose(fp);
+        return NULL;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    int line_number = 0;
+    while (!failed(&ctx->failure) && getline(&line, &line_size, fp) >= 0) {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+
+        char *fields[4];
+        int count = 0;
+        char *saveptr;
+        char *field;
+        for (field = strtok_r(line, " \t\r\n", &saveptr); field; field = strtok_r(NULL, " \t\r\n", &saveptr)) {
+            if (count == NUM_ELEMENTS(fields)) {
+                fail(&ctx->failure, "%s:%d: Too many fields", path, line_number);
+                break;
+            }
+            fields[count++] = field;
+        }
+        if (failed(&ctx->failure) || count == 0)
+            continue;
+
+        bool trim = (count > 2 && strcmp(fields[count - 1], "trim") == 0);
+        if (trim)
+            count--;
+        if (count < 2 || count > 3)
+            fail(&ctx->failure, "%s:%d: Expecting \"<image> <offset> [size] [trim]\"", path, line_number);
+        else
+            add_job_segment(ctx, job, path, line_number, fields[0], fields[1], count == 3 ? fields[2] : NULL, trim);
+    }
+    free(line);
+    fclose(fp);
+
+    if (!failed(&ctx->failure) && job->count == 0)
+        fail(&ctx->failure, "%s doesn't list anything to write", path);
+
+    if (!failed(&ctx->failure)) {
+        qsort(job->segments, job->count, sizeof(struct job_segment), compare_job_segments);
+        int i;
+        for (i = 0; i < job->count; i++) {
+            const struct job_segment *segment = &job->segments[i];
+            if (i > 0 && job->segments[i - 1].offset + (off_t) job->segments[i - 1].size > segment->offset) {
+                fail(&ctx->failure, "%s: %s overlaps %s", path, job->segments[i - 1].path, segment->path);
+                break;
+            }
+            job->total += segment->size;
+        }
+    }
+    if (failed(&ctx->failure)) {
+        free_job(job);
+        return NULL;
+    }
+    return job;
+}
+
+// Benchmark mode. Everything runs on the region given by -o and -s, so
+// the rest of the memory card is left alone until the TRIM at the end.
+struct bench_mode
+{
+    const char *name;
+    int flags;
+};
+
+static const struct bench_mode bench_modes[] = {
+    {"buffered", 0},
+    {"sync", O_SYNC},
+    {"direct", O_DIRECT}
+};
+
+static const size_t bench_chunk_sizes[] = {
+    64 * ONE_KiB, 256 * ONE_KiB, ONE_MiB, 4 * ONE_MiB
+};
+
+static const int bench_queue_depths[] = { 1, 2, 4, 8, 16, 32 };
+
+void bench_report(const struct copy_context *ctx, const char *test, const char *mode, size_t chunk, int depth,
+                  double seconds, size_t bytes, size_t ops)
+{
+    double mbps = seconds > 0 ? bytes / seconds / 1e6 : 0;
+    double iops = seconds > 0 ? ops / seconds : 0;
+
+    if (ctx->bench_json) {
+        printf("{\"test\":\"%s\",\"mode\":\"%s\",\"chunk\":%llu,\"queue_depth\":%d,"
+               "\"seconds\":%.3f,\"bytes\":%llu,\"mbps\":%.2f,\"iops\":%.1f}\n",
+               test, mode, (unsigned long long) chunk, depth, seconds,
+               (unsigned long long) bytes, mbps, iops);
+    } else {
+        char chunkstr[32] = "-";
+        char depthstr[16] = "-";
+        if (chunk)
+            pretty_size(chunk, chunkstr);
+        if (depth)
+            sprintf(depthstr, "%d", depth);
+        printf("%-8s %-9s %10s %6s %9.3f %9.2f %9.1f\n",
+               test, mode, chunkstr, depthstr, seconds, mbps, iops);
+    }
+    fflush(stdout);
+}
+
+// Pick O_DIRECT if the memory card supports it and O_SYNC otherwise
+const struct bench_mode *bench_unbuffered_mode(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECT);
+    if (fd < 0)
+        return &bench_modes[1];
+    close(fd);
+    return &bench_modes[2];
+}
+
+int bench_open(struct copy_context *ctx, const char *path, int flags, const char *mode)
+{
+    // Returns -1 if the mode isn't supported or after recording an error
+    // in the context's failure
+    int fd = open_mmc(path, flags, &ctx->failure);
+    if (fd < 0 && !failed(&ctx->failure)) {
+        if (errno != EINVAL)
+            fail_errno(&ctx->failure, "%s", path);
+        else
+            warnx("%s doesn't support %s I/O. Skipping.", path, mode);
+    }
+    return fd;
+}
+
+// Time a sequential write of the benchmark image. Buffered writes are
+// timed until they're on the memory card.
+// Timing functions return -1 if the test can't run on the memory card or
+// after recording an error in the context's failure.
+double bench_write(struct copy_context *ctx, const char *path, const struct bench_mode *mode,
+                   int image_fd, off_t offset, size_t size, bool uring)
+{
+    int fd = bench_open(ctx, path, O_RDWR | mode->flags, mode->name);
+    if (fd < 0)
+        return -1;
+    if (lseek(fd, offset, SEEK_SET) < 0 || lseek(image_fd, 0, SEEK_SET) < 0) {
+        fail_errno(&ctx->failure, "lseek");
+        close(fd);
+        return -1;
+    }
+
+    struct copy_dest dest;
+    if (!dest_init(ctx, &dest, path, fd)) {
+        close(fd);
+        return -1;
+    }
+
+    double start = monotonic_seconds();
+    bool ok;
+    if (uring)
+        ok = copy_uring(ctx, image_fd, &dest, size);
+    else
+        ok = copy(ctx, image_fd, &dest, 1, size);
+    if (ok && fdatasync(fd) < 0)
+        ok = fail_errno(&ctx->failure, "fdatasync");
+    double seconds = monotonic_seconds() - start;
+
+    close(fd);
+    return ok ? seconds : -1;
+}
+
+double bench_read(struct copy_context *ctx, const char *path, const struct bench_mode *mode,
+                  off_t offset, size_t size)
+{
+    int fd = bench_open(ctx, path, O_RDONLY | mode->flags, mode->name);
+    if (fd < 0)
+        return -1;
+    if (lseek(fd, offset, SEEK_SET) < 0) {
+        fail_errno(&ctx->failure, "lseek");
+        close(fd);
+        return -1;
+    }
+
+    // Drop what the write tests left in the page cache
+    posix_fadvise(fd, offset, size, POSIX_FADV_DONTNEED);
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd < 0) {
+        fail_errno(&ctx->failure, "/dev/null");
+        close(fd);
+        return -1;
+    }
+    struct copy_dest out;
+    double start = monotonic_seconds();
+    bool ok = dest_init(ctx, &out, "/dev/null", null_fd) && copy(ctx, fd, &out, 1, size);
+    double seconds = monotonic_seconds() - start;
+
+    close(null_fd);
+    close(fd);
+    return ok ? seconds : -1;
+}
+
+uint64_t bench_random(uint64_t *state)
+{
+    // xorshift64 is plenty for picking offsets and filling the image
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+// Random 4K writes over the benchmark region for a few seconds
+bool bench_random_writes(struct copy_context *ctx, const char *path, off_t offset, size_t size)
+{
+    const struct bench_mode *mode = bench_unbuffered_mode(path);
+    int fd = bench_open(ctx, path, O_WRONLY | mode->flags, mode->name);
+    if (fd < 0)
+        return !failed(&ctx->failure);
+
+    uint64_t state = 0x6d6d63636f7079;
+    char *buffer = (char *) alloc_buffer(BENCH_RANDOM_BLOCK_SIZE);
+    if (!buffer) {
+        close(fd);
+        return fail_errno(&ctx->failure, "posix_memalign");
+    }
+    size_t i;
+    for (i = 0; i < BENCH_RANDOM_BLOCK_SIZE; i += sizeof(uint64_t)) {
+        uint64_t r = bench_random(&state);
+        memcpy(buffer + i, &r, sizeof(r));
+    }
+
+    size_t blocks = size / BENCH_RANDOM_BLOCK_SIZE;
+    size_t ops = 0;
+    double start = monotonic_seconds();
+    double seconds = 0;
+    do {
+        off_t block_offset = offset + (off_t) (bench_random(&state) % blocks) * BENCH_RANDOM_BLOCK_SIZE;
+        if (!pwrite_fully(fd, buffer, BENCH_RANDOM_BLOCK_SIZE, block_offset)) {
+            fail_errno(&ctx->failure, "%s", path);
+            break;
+        }
+        ops++;
+        seconds = monotonic_seconds() - start;
+    } while (seconds < BENCH_RANDOM_SECONDS);
+
+    if (!failed(&ctx->failure))
+        bench_report(ctx, "random", mode->name, BENCH_RANDOM_BLOCK_SIZE, 0, seconds,
+                     ops * BENCH_RANDOM_BLOCK_SIZE, ops);
+    free(buffer);
+    close(fd);
+    return !failed(&ctx->failure);
+}
+
+int bench_image(struct copy_context *ctx, size_t size)
+{
+    // Returns -1 after recording an error in the context's failure
+    // The test image is random so that memory cards that compress or
+    // deduplicate data don't look faster than they are.
+#ifdef HAVE_MEMFD_CREATE
+    int fd = memfd_create("mmccopy-bench", 0);
+#else
+    int fd = fileno(tmpfile());
+#endif
+    if (fd < 0) {
+        fail_errno(&ctx->failure, "Can't create benchmark image");
+        return -1;
+    }
+
+    char *buffer = (char *) alloc_buffer(ONE_MiB);
+    if (!buffer) {
+        fail_errno(&ctx->failure, "posix_memalign");
+        close(fd);
+        return -1;
+    }
+    uint64_t state = 0x62656e6368;
+    size_t written;
+    for (written = 0; written < size; written += ONE_MiB) {
+        size_t i;
+        for (i = 0; i < ONE_MiB; i += sizeof(uint64_t)) {
+            uint64_t r = bench_random(&state);
+            memcpy(buffer + i, &r, sizeof(r));
+        }
+        size_t len = size - written < ONE_MiB ? size - written : ONE_MiB;
+        if (!write_fully(fd, buffer, len)) {
+            fail_errno(&ctx->failure, "Can't create benchmark image");
+            close(fd);
+            fd = -1;
+            break;
+        }
+    }
+    free(buffer);
+    return fd;
+}
+
+bool run_bench(struct copy_context *ctx, const char *path, off_t offset, size_t size)
+{
+    // Returns false after recording an error in the context's failure
+    if (offset % BENCH_RANDOM_BLOCK_SIZE || size % BENCH_RANDOM_BLOCK_SIZE || size == 0)
+        return fail(&ctx->failure, "--bench needs -o and -s to be multiples of 4 KiB");
+    if ((uint64_t) offset + size > device_size(path))
+        return fail(&ctx->failure, "--bench region doesn't fit on %s", path);
+
+    // The copy engine's progress would get mixed up with the results
+    ctx->quiet = true;
+    int image_fd = bench_image(ctx, size);
+    if (image_fd < 0)
+        return false;
+
+    if (!ctx->bench_json)
+        printf("%-8s %-9s %10s %6s %9s %9s %9s\n",
+               "test", "mode", "chunk", "depth", "seconds", "MB/s", "IOPS");
+
+    // Sequential writes and reads through the read/write pipeline
+    size_t i, j;
+    for (i = 0; i < NUM_ELEMENTS(bench_modes) && !failed(&ctx->failure); i++) {
+        for (j = 0; j < NUM_ELEMENTS(bench_chunk_sizes); j++) {
+            ctx->chunk_size = ctx->copy_buffer_size = bench_chunk_sizes[j];
+            double seconds = bench_write(ctx, path, &bench_modes[i], image_fd, offset, size, false);
+            if (seconds < 0)
+                break;
+            bench_report(ctx, "write", bench_modes[i].name, ctx->chunk_size, 0, seconds, size,
+                         size / ctx->chunk_size);
+        }
+    }
+    for (i = 0; i < NUM_ELEMENTS(bench_modes) && !failed(&ctx->failure); i += 2) {
+        for (j = 0; j < NUM_ELEMENTS(bench_chunk_sizes); j++) {
+            ctx->chunk_size = ctx->copy_buffer_size = bench_chunk_sizes[j];
+            double seconds = bench_read(ctx, path, &bench_modes[i], offset, size);
+            if (seconds < 0)
+                break;
+            bench_report(ctx, "read", bench_modes[i].name, ctx->chunk_size, 0, seconds, size,
+                         size / ctx->chunk_size);
+        }
+    }
+
+    // Queue depths with io_uring. O_DIRECT is what lets several writes be
+    // in flight on most kernels.
+    ctx->chunk_size = ctx->copy_buffer_size = DEFAULT_CHUNK_SIZE;
+    const struct bench_mode *mode = bench_unbuffered_mode(path);
+    for (i = 0; i < NUM_ELEMENTS(bench_queue_depths) && !failed(&ctx->failure); i++) {
+        ctx->queue_depth = bench_queue_depths[i];
+        double seconds = bench_write(ctx, path, mode, image_fd, offset, size, true);
+        if (seconds < 0) {
+            if (!failed(&ctx->failure))
+                warnx("io_uring isn't available. Skipping queue depths.");
+            break;
+        }
+        bench_report(ctx, "write", mode->name, ctx->chunk_size, ctx->queue_depth, seconds, size,
+                     size / ctx->chunk_size);
+    }
+
+    if (!failed(&ctx->failure))
+        bench_random_writes(ctx, path, offset, size);
+
+    // TRIM the whole memory card like -t does
+    if (!failed(&ctx->failure)) {
+        int fd = open_mmc(path, O_WRONLY, &ctx->failure);
+        if (fd < 0) {
+            if (!failed(&ctx->failure))
+                fail_errno(&ctx->failure, "%s", path);
+        } else {
+            double start = monotonic_seconds();
+            if (trim_mmc(fd, ctx->raw_mmc))
+                bench_report(ctx, "trim", "-", 0, 0, monotonic_seconds() - start, device_size(path), 0);
+            else
+                warn("TRIM isn't supported on %s. Skipping", path);
+            close(fd);
+        }
+    }
+    close(image_fd);
+    return !failed(&ctx->failure);
+}
+
+struct copy_context *copy_context_new(bool library)
+{
+    struct copy_context *ctx = (struct copy_context *) calloc(1, sizeof(struct copy_context));
+    if (!ctx)
+        return NULL;
+
+    ctx->library = library;
+    ctx->data_pathname = "-";
+    ctx->pipeline_depth = DEFAULT_PIPELINE_DEPTH;
+    ctx->queue_depth = DEFAULT_QUEUE_DEPTH;
+    ctx->auto_decompress = true;
+    ctx->chunk_size = DEFAULT_CHUNK_SIZE;
+    ctx->copy_buffer_size = DEFAULT_CHUNK_SIZE;
+    ctx->reader_count = 1;
+
+    // Library jobs never print or prompt
+    ctx->quiet = library;
+    ctx->accept_found_device = library;
+
+    ctx->progress_out = stdout;
+    ctx->telemetry.fd = -1;
+    ctx->data_fd = -1;
+    pthread_mutex_init(&ctx->telemetry.lock, NULL);
+    pthread_mutex_init(&ctx->progress.lock, NULL);
+    pthread_cond_init(&ctx->progress.cond, NULL);
+    return ctx;
+}
+
+void copy_set_progress_callback(struct copy_context *ctx,
+                                void (*callback)(const struct mmccopy_progress *progress, void *arg),
+                                void *arg)
+{
+    ctx->telemetry.callback = callback;
+    ctx->telemetry.callback_arg = arg;
+}
+
+bool check_options(struct copy_context *ctx)
+{
+    // Reject combinations of options that don't work together. Returns
+    // false after recording why in the context's failure.
+    if (ctx->quiet && ctx->numeric_progress && !ctx->library)
+        return fail(&ctx->failure, "pick either -n or -q, but not both.");
+
+    if (ctx->read_from_mmc && ctx->total_to_copy == 0)
+        return fail(&ctx->failure, "Specify the amount to copy (-s) when reading from memory card.");
+
+    if (ctx->read_from_mmc && ctx->sparse_write)
+        return fail(&ctx->failure, "--sparse is only supported when writing to the memory card.");
+
+    if (ctx->read_from_mmc && ctx->bmap_path)
+        return fail(&ctx->failure, "--bmap is only supported when writing to the memory card.");
+
+    if (ctx->read_from_mmc && ctx->direct_io)
+        return fail(&ctx->failure, "--direct is only supported when writing to the memory card.");
+
+    if (ctx->read_from_mmc && ctx->verify_writes)
+        return fail(&ctx->failure, "--verify is only supported when writing to the memory card.");
+
+    if (!ctx->read_from_mmc && ctx->output_compression)
+        return fail(&ctx->failure, "--compress is only supported when reading from the memory card.");
+
+    if (ctx->read_from_mmc && ctx->adaptive_chunks)
+        return fail(&ctx->failure, "-b auto is only supported when writing to the memory card.");
+
+    if (ctx->read_from_mmc && ctx->mmap_input)
+        return fail(&ctx->failure, "--mmap is only supported when writing to the memory card.");
+
+    if (ctx->read_from_mmc && ctx->delta_write)
+        return fail(&ctx->failure, "--delta is only supported when writing to the memory card.");
+
+    if (ctx->read_from_mmc && ctx->coalesce_writes)
+        return fail(&ctx->failure, "--coalesce is only supported when writing to the memory card.");
+
+    if (ctx->trim_mmc_device && ctx->delta_write)
+        return fail(&ctx->failure, "-t erases everything that --delta would compare against.");
+
+    if (ctx->read_from_mmc && (ctx->trim_mmc_device || ctx->trim_unused))
+        return fail(&ctx->failure, "You probably don't want to TRIM the device if you're going to read from it.");
+
+    if (ctx->trim_mmc_device && ctx->trim_unused)
+        return fail(&ctx->failure, "pick either -t or --trim-unused, but not both.");
+
+    if (ctx->read_from_mmc && ctx->mmc_device_count > 1)
+        return fail(&ctx->failure, "Only one memory card can be read at a time.");
+
+    bool from_stdin = strcmp(ctx->data_pathname, "-") == 0;
+    if (ctx->resume_path && (ctx->read_from_mmc || ctx->mmc_device_count > 1 || from_stdin))
+        return fail(&ctx->failure, "--resume only works when writing an image file to one memory card.");
+
+    if (ctx->bench && (ctx->read_from_mmc || ctx->mmc_device_count > 1 || !from_stdin))
+        return fail(&ctx->failure, "--bench takes one memory card and no image.");
+
+    if (ctx->partition_list && (ctx->read_from_mmc || from_stdin))
+        return fail(&ctx->failure, "--partition only works when writing an image file.");
+
+    if (ctx->partition_list && (ctx->bmap_path || ctx->trim_mmc_device || ctx->trim_unused))
+        return fail(&ctx->failure, "--partition can't be used with --bmap, -t or --trim-unused.");
+
+    if (ctx->job_path && (ctx->read_from_mmc || !from_stdin || ctx->total_to_copy ||
+                          ctx->bmap_path || ctx->partition_list || ctx->resume_path || ctx->mmap_input))
+        return fail(&ctx->failure, "--job can't be used with an image path, -r, -s, --bmap, --partition, --resume or --mmap.");
+
+    if (ctx->wait_for_card && ctx->mmc_device_count > 0)
+        return fail(&ctx->failure, "--wait finds the memory card, so don't pass -d.");
+
+    if (ctx->raw_mmc && (ctx->read_from_mmc || ctx->coalesce_writes))
+        return fail(&ctx->failure, "--raw-mmc only works when writing to the memory card and not with --coalesce.");
+
+    if (ctx->json_progress && ctx->telemetry.fd >= 0)
+        return fail(&ctx->failure, "Pick either --progress-json or --telemetry-fd, but not both.");
+
+    if (ctx->prefetch_size && (ctx->read_from_mmc || ctx->job_path))
+        return fail(&ctx->failure, "--prefetch is only supported when writing one image to the memory card.");
+
+    bool http_image = strncmp(ctx->data_pathname, "http://", 7) == 0 ||
+                      strncmp(ctx->data_pathname, "https://", 8) == 0;
+    if (http_image && (ctx->read_from_mmc || ctx->resume_path || ctx->partition_list || ctx->mmap_input))
+        return fail(&ctx->failure, "HTTP images can't be used with -r, --resume, --partition or --mmap.");
+
+    if (ctx->cache_dir && (ctx->read_from_mmc || ctx->job_path || ctx->resume_path || ctx->bmap_path ||
+                           ctx->partition_list || http_image || from_stdin))
+        return fail(&ctx->failure, "--cache needs an image file and can't be used with -r, --job, --resume, --bmap or --partition.");
+
+    return true;
+}
+
+// getopt keeps its state in globals, so only one copy can parse at a time
+static pthread_mutex_t getopt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+enum copy_parse_result parse_option(struct copy_context *ctx, int opt, const char *arg)
+{
+    switch (opt) {
+    case 'b':
+        if (strcmp(arg, "auto") == 0) {
+            ctx->adaptive_chunks = true;
+            break;
+        }
+        ctx->adaptive_chunks = false;
+        ctx->fixed_chunk_size = true;
+        if (!parse_size(ctx, arg, &ctx->chunk_size))
+            return COPY_PARSE_ERROR;
+        if (ctx->chunk_size < MIN_CHUNK_SIZE || ctx->chunk_size > MAX_CHUNK_SIZE ||
+                ctx->chunk_size % MIN_CHUNK_SIZE) {
+            fail(&ctx->failure, "-b must be a multiple of 4 KiB between 4 KiB and 64 MiB");
+            return COPY_PARSE_ERROR;
+        }
+        break;
+    case 'd':
+        if (ctx->mmc_device_count == MAX_DEVICES) {
+            fail(&ctx->failure, "Too many memory cards. The maximum is %d", MAX_DEVICES);
+            return COPY_PARSE_ERROR;
+        }
+        ctx->mmc_devices[ctx->mmc_device_count++] = arg;
+        break;
+    case 'f':
+        if (ctx->library) {
+            fail(&ctx->failure, "-f isn't supported by library jobs. Use mmccopy_find_device.");
+            return COPY_PARSE_ERROR;
+        } else {
+            char *found = find_mmc_device(&ctx->failure);
+            if (!found)
+                return COPY_PARSE_ERROR;
+            printf("%s", found);
+            free(found);
+        }
+        return COPY_PARSE_DONE;
+    case 's':
+        if (!parse_size(ctx, arg, &ctx->total_to_copy))
+            return COPY_PARSE_ERROR;
+        ctx->size_given = true;
+        break;
+    case 'o': {
+        size_t offset;
+        if (!parse_size(ctx, arg, &offset))
+            return COPY_PARSE_ERROR;
+        ctx->seek_offset = offset;
+        break;
+    }
+    case 'n':
+        ctx->numeric_progress = true;
+        break;
+    case 'p':
+        // This is now the default. Keep parameter around since I wrote
+        // some docs that include it.
+        break;
+    case 'q':
+        ctx->quiet = true;
+        break;
+    case 'r':
+        ctx->read_from_mmc = true;
+        break;
+    case 't':
+        ctx->trim_mmc_device = true;
+        break;
+    case 'w':
+        ctx->read_from_mmc = false;
+        break;
+    case 'y':
+        ctx->accept_found_device = true;
+        break;
+    case 'v':
+        if (ctx->library) {
+            fail(&ctx->failure, "-v isn't supported by library jobs");
+            return COPY_PARSE_ERROR;
+        }
+        print_version();
+        return COPY_PARSE_DONE;
+    case OPT_BUFFERS:
+        ctx->pipeline_depth = strtol(arg, NULL, 10);
+        if (ctx->pipeline_depth < 1 || ctx->pipeline_depth > MAX_PIPELINE_DEPTH) {
+            fail(&ctx->failure, "--buffers must be between 1 and %d", MAX_PIPELINE_DEPTH);
+            return COPY_PARSE_ERROR;
+        }
+        break;
+    case OPT_QUEUE_DEPTH:
+        ctx->queue_depth = strtol(arg, NULL, 10);
+        if (ctx->queue_depth < 0 || ctx->queue_depth > MAX_QUEUE_DEPTH) {
+            fail(&ctx->failure, "--queue-depth must be between 0 and %d", MAX_QUEUE_DEPTH);
+            return COPY_PARSE_ERROR;
+        }
+        break;
+    case OPT_DIRECT:
+        ctx->direct_io = true;
+        break;
+    case OPT_SPARSE:
+        ctx->sparse_write = true;
+        break;
+    case OPT_BMAP:
+        ctx->bmap_path = arg;
+        break;
+    case OPT_TRIM_UNUSED:
+        ctx->trim_unused = true;
+        break;
+    case OPT_NO_DECOMPRESS:
+        ctx->auto_decompress = false;
+        break;
+    case OPT_VERIFY:
+        ctx->verify_writes = true;
+        break;
+    case OPT_DELTA:
+        ctx->delta_write = true;
+        break;
+    case OPT_ZERO_COPY:
+        ctx->zero_copy = true;
+        break;
+    case OPT_MMAP:
+        ctx->mmap_input = true;
+        break;
+    case OPT_READERS:
+        ctx->reader_count = strtol(arg, NULL, 10);
+        if (ctx->reader_count < 1 || ctx->reader_count > MAX_READERS) {
+            fail(&ctx->failure, "--readers must be between 1 and %d", MAX_READERS);
+            return COPY_PARSE_ERROR;
+        }
+        break;
+    case OPT_COMPRESS:
+        ctx->output_compression = arg;
+        break;
+    case OPT_TELEMETRY_FD:
+        ctx->telemetry.fd = strtol(arg, NULL, 10);
+        if (ctx->telemetry.fd < 0 || fcntl(ctx->telemetry.fd, F_GETFD) < 0) {
+            fail(&ctx->failure, "--telemetry-fd %s isn't an open file descriptor", arg);
+            ctx->telemetry.fd = -1;
+            return COPY_PARSE_ERROR;
+        }
+        break;
+    case OPT_BENCH:
+        if (ctx->library) {
+            fail(&ctx->failure, "--bench isn't supported by library jobs");
+            return COPY_PARSE_ERROR;
+        }
+        ctx->bench = true;
+        if (arg && strcmp(arg, "json") == 0)
+            ctx->bench_json = true;
+        else if (arg) {
+            fail(&ctx->failure, "--bench only supports json output");
+            return COPY_PARSE_ERROR;
+        }
+        break;
+    case OPT_RESUME:
+        ctx->resume_path = arg;
+        break;
+    case OPT_WAIT:
+        ctx->wait_for_card = true;
+        break;
+    case OPT_PARTITION:
+        ctx->partition_list = arg;
+        break;
+    case OPT_JOB:
+        ctx->job_path = arg;
+        break;
+    case OPT_COALESCE:
+        ctx->coalesce_writes = true;
+        break;
+    case OPT_RAW_MMC:
+        ctx->raw_mmc = true;
+        break;
+    case OPT_PROGRESS_JSON:
+        ctx->json_progress = true;
+        break;
+    case OPT_CACHE:
+        ctx->cache_dir = arg;
+        break;
+    case OPT_PREFETCH:
+        if (!parse_size(ctx, arg, &ctx->prefetch_size))
+            return COPY_PARSE_ERROR;
+        if (ctx->prefetch_size < PREFETCH_BLOCK_SIZE || ctx->prefetch_size > MAX_PREFETCH_SIZE) {
+            fail(&ctx->failure, "--prefetch must be between 1 MiB and 1 GiB");
+            return COPY_PARSE_ERROR;
+        }
+        break;
+    default: /* '?' */
+        return COPY_PARSE_USAGE;
+    }
+    return COPY_PARSE_RUN;
+}
+
+enum copy_parse_result copy_parse_options(struct copy_context *ctx, int argc, char *argv[])
+{
+    // Memory cards are too big to bother with systems
+    // that don't support large file sizes any more.
+    if (sizeof(off_t) != 8) {
+        fail(&ctx->failure, "recompile with largefile support");
+        return COPY_PARSE_ERROR;
+    }
+
+    pthread_mutex_lock(&getopt_lock);
+    optind = 0;
+    opterr = !ctx->library;
+    enum copy_parse_result result = COPY_PARSE_RUN;
+    int opt;
+    while (result == COPY_PARSE_RUN &&
+           (opt = getopt_long(argc, argv, "b:d:fno:pqrs:tvwy", long_options, NULL)) != -1)
+        result = parse_option(ctx, opt, optarg);
+
+    // Library jobs don't print the usage, so say which option was wrong
+    if (result == COPY_PARSE_USAGE && ctx->library) {
+        fail(&ctx->failure, "Unknown option or missing argument: %s",
+             optind > 0 && optind <= argc ? argv[optind - 1] : "?");
+        result = COPY_PARSE_ERROR;
+    }
+    if (result == COPY_PARSE_RUN && optind < argc)
+        ctx->data_pathname = argv[optind];
+    pthread_mutex_unlock(&getopt_lock);
+
+    if (result != COPY_PARSE_RUN)
+        return result;
+
+    // Buffers need to hold the biggest chunk that adaptive sizing can pick
+    // and a verify block with room for O_DIRECT alignment on either side.
+    ctx->copy_buffer_size = ctx->adaptive_chunks ? TUNE_MAX_CHUNK_SIZE : ctx->chunk_size;
+    if (ctx->verify_writes && ctx->copy_buffer_size < 2 * VERIFY_BLOCK_SIZE)
+        ctx->copy_buffer_size = 2 * VERIFY_BLOCK_SIZE;
+
+    return check_options(ctx) ? COPY_PARSE_RUN : COPY_PARSE_ERROR;
+}
+
+bool open_image(struct copy_context *ctx)
+{
+    // Open the image, or where the memory card is read to, and work out
+    // how much to copy. Returns false after recording an error in the
+    // context's failure.
+    bool http_image = strncmp(ctx->data_pathname, "http://", 7) == 0 ||
+                      strncmp(ctx->data_pathname, "https://", 8) == 0;
+    if (ctx->job_path) {
+        ctx->copy_job = load_job(ctx, ctx->job_path);
+        if (!ctx->copy_job)
+            return false;
+        ctx->data_fd = ctx->copy_job->segments[0].fd;
+        ctx->total_to_copy = ctx->copy_job->total;
+    } else if (http_image) {
+#ifdef HAVE_LIBCURL
+        // The image is read in ranges on several connections at once and
+        // put back in order by the prefetcher.
+        uint64_t image_size;
+        ctx->http = http_open(ctx->data_pathname, HTTP_CONNECTIONS, &image_size, &ctx->failure);
+        if (!ctx->http)
+            return false;
+        if (ctx->total_to_copy == 0 || image_size < ctx->total_to_copy)
+            ctx->total_to_copy = image_size;
+        ctx->image_prefetch = prefetch_start(ctx->prefetch_size ? ctx->prefetch_size : DEFAULT_HTTP_PREFETCH_SIZE,
+                                             HTTP_CONNECTIONS, http_fill, ctx->http, &ctx->failure);
+        if (!ctx->image_prefetch)
+            return false;
+#else
+        return fail(&ctx->failure, "mmccopy was built without libcurl, so it can't read %s.\n"
+                    "Pipe it from curl instead", ctx->data_pathname);
+#endif
+    } else if (strcmp(ctx->data_pathname, "-") != 0) {
+	if (ctx->read_from_mmc)
+	    ctx->data_fd = open(ctx->data_pathname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	else
+	    ctx->data_fd = open(ctx->data_pathname, O_RDONLY);
+        if (ctx->data_fd < 0)
+            return fail_errno(&ctx->failure, "%s", ctx->data_pathname);
+
+	// If writing to the MMC, cap the number of bytes to write to the file size.
+	// Compressed images are capped to the uncompressed size if it's known.
+	if (!ctx->read_from_mmc) {
+	    struct stat st;
+	    if (fstat(ctx->data_fd, &st))
+		return fail_errno(&ctx->failure, "fstat");
+
+	    uint64_t image_size = st.st_size;
+	    if (ctx->auto_decompress) {
+		ctx->image_decompressor = decompressor_open(ctx->data_fd, &image_size, &ctx->failure);
+		if (failed(&ctx->failure))
+		    return false;
+	    }
+
+	    // A cached image is used as is
+	    if (ctx->cache_dir && cache_open(ctx, ctx->cache_dir, &ctx->data_fd, ctx->image_decompressor != NULL)) {
+		if (ctx->image_decompressor) {
+		    decompressor_free(ctx->image_decompressor);
+		    ctx->image_decompressor = NULL;
+		}
+		if (fstat(ctx->data_fd, &st))
+		    return fail_errno(&ctx->failure, "fstat");
+		image_size = st.st_size;
+	    }
+	    if (failed(&ctx->failure))
+		return false;
+
+	    if ((image_size != 0 || !ctx->image_decompressor) &&
+	            (ctx->total_to_copy == 0 || image_size < ctx->total_to_copy))
+		ctx->total_to_copy = image_size;
+	}
+    } else {
+	// Reading from stdin or stdout.
+	if (ctx->read_from_mmc) {
+	    ctx->data_fd = STDOUT_FILENO;
+
+	    // Report progress on stderr so that it doesn't stomp on the data.
+	    ctx->progress_out = stderr;
+	} else
+	    ctx->data_fd = STDIN_FILENO;
+    }
+
+    // Regular files are already read ahead by the kernel, so only pipes
+    // and sockets go through the prefetcher.
+    struct stat data_st;
+    if (ctx->prefetch_size && !ctx->image_prefetch && !ctx->image_decompressor &&
+            fstat(ctx->data_fd, &data_st) == 0 && !S_ISREG(data_st.st_mode)) {
+        ctx->image_prefetch = prefetch_start_fd(ctx->data_fd, ctx->prefetch_size, &ctx->failure);
+        if (!ctx->image_prefetch)
+            return false;
+    }
+
+    if (ctx->read_from_mmc && ctx->output_compression) {
+        ctx->compressor = compressor_open(ctx->data_fd, ctx->output_compression, &ctx->failure);
+        if (!ctx->compressor)
+            return false;
+    }
+
+    if (ctx->bmap_path) {
+        ctx->data_map = load_range_map(ctx, ctx->bmap_path);
+        if (!ctx->data_map)
+            return false;
+    }
+    if (ctx->partition_list) {
+        ctx->data_map = partition_map(ctx, ctx->data_pathname, ctx->partition_list);
+        if (!ctx->data_map)
+            return false;
+    }
+
+    // The cache knows where the zeros are, so --sparse doesn't need to look
+    // for them. Images that aren't in the cache yet are stored as they're
+    // read unless only part of them is copied.
+    struct image_cache *cache = ctx->image_cache;
+    if (cache && cache->hit && ctx->sparse_write) {
+        ctx->data_map = cache->map;
+        ctx->sparse_write = false;
+    } else if (cache && !cache->hit && !ctx->size_given)
+        cache_start(cache);
+
+    // The block map knows how big the image is even when it comes
+    // through stdin.
+    if (ctx->data_map && (ctx->total_to_copy == 0 || ctx->total_to_copy > ctx->data_map->image_size))
+        ctx->total_to_copy = ctx->data_map->image_size;
+
+    if (ctx->numeric_progress && ctx->total_to_copy == 0)
+        return fail(&ctx->failure, "Specify input size to report numeric progress");
+    return true;
+}
+
+bool open_dest(struct copy_context *ctx, const char *mmc_device)
+{
+    // Get a memory card ready to be copied and add it to the context's
+    // destinations. Returns false after recording an error in the
+    // context's failure.
+
+    // Unmount everything so that our read and writes to the device are
+    // unaffected by file system caches or other concurrent activity.
+    if (!umount_all_on_dev(mmc_device, &ctx->failure))
+        return false;
+
+    // O_DIRECT writes need to read the surrounding blocks for unaligned
+    // offsets and --delta reads everything before writing, so the
+    // device is opened read/write in those modes. --coalesce reads
+    // partial blocks too and flushes once at the end instead of
+    // syncing every write.
+    int mmc_flags = O_RDONLY;
+    if (!ctx->read_from_mmc && (ctx->direct_io || ctx->raw_mmc))
+        mmc_flags = O_RDWR | O_DIRECT;
+    else if (!ctx->read_from_mmc && ctx->coalesce_writes)
+        mmc_flags = O_RDWR;
+    else if (!ctx->read_from_mmc)
+        mmc_flags = (ctx->delta_write ? O_RDWR : O_WRONLY) | O_SYNC;
+    if (!ctx->read_from_mmc && !unlock_boot_partition(ctx, mmc_device))
+        return false;
+    int mmc_fd = open_mmc(mmc_device, mmc_flags, &ctx->failure);
+    if (mmc_fd < 0) {
+        if (failed(&ctx->failure))
+            return false;
+        if (errno == EINVAL && ctx->direct_io)
+            return fail(&ctx->failure, "%s doesn't support O_DIRECT", mmc_device);
+        else if (errno == EROFS)
+            return fail(&ctx->failure, "%s isn't writable. Check permissions or write-protect switch", mmc_device);
+        else
+            return fail_errno(&ctx->failure, "%s", mmc_device);
+    }
+
+    // The destination owns the file descriptor from here on
+    struct copy_dest *dest = &ctx->dests[ctx->dest_count];
+    if (!dest_init(ctx, dest, mmc_device, mmc_fd)) {
+        close(mmc_fd);
+        return false;
+    }
+    ctx->dest_count++;
+
+    if (ctx->partition_list && !check_card_partitions(ctx, mmc_device, ctx->seek_offset))
+        return false;
+
+    // Don't TRIM what an interrupted copy already wrote
+    bool resuming = false;
+    if (ctx->resume_path) {
+        ctx->resume_journal = (struct resume_journal *) calloc(1, sizeof(struct resume_journal));
+        if (!ctx->resume_journal)
+            return fail_errno(&ctx->failure, "calloc");
+        resuming = resume_start(ctx, ctx->resume_journal, ctx->resume_path, ctx->data_fd, mmc_fd,
+                                ctx->seek_offset, ctx->total_to_copy);
+        if (failed(&ctx->failure))
+            return false;
+    }
+
+    if (ctx->trim_mmc_device && !resuming) {
+        if (!trim_mmc(mmc_fd, ctx->raw_mmc))
+            return fail_errno(&ctx->failure, "BLKDISCARD (TRIM command) failed");
+    } else if (ctx->trim_unused) {
+        dest->discards = discard_init(mmc_fd, &ctx->failure);
+        if (!dest->discards)
+            return false;
+    }
+
+    int j;
+    for (j = 0; ctx->copy_job && j < ctx->copy_job->count; j++) {
+        const struct job_segment *segment = &ctx->copy_job->segments[j];
+        if (segment->trim && !trim_range(mmc_fd, ctx->seek_offset + segment->offset, segment->size, ctx->raw_mmc))
+            return fail_errno(&ctx->failure, "Can't TRIM %s's region", segment->path);
+    }
+
+    off_t start = ctx->seek_offset + (resuming ? ctx->resume_journal->base : 0);
+    if (lseek(mmc_fd, start, SEEK_SET) == (off_t) -1)
+        return fail_errno(&ctx->failure, "lseek");
+    dest->offset = start;
+
+    if (ctx->raw_mmc) {
+        dest->emmc = emmc_open(mmc_fd);
+        if (!dest->emmc)
+            return fail(&ctx->failure, "%s can't take MMC commands. --raw-mmc needs a whole eMMC device or boot partition",
+                        mmc_device);
+    }
+
+    size_t erase_size = dest->erase_size;
+    if (!ctx->read_from_mmc && erase_size && ctx->seek_offset % erase_size) {
+        char sizestr[16];
+        pretty_size(erase_size, sizestr);
+        warning(ctx, "-o isn't a multiple of the %s erase block size of %s, so the first write will be slower",
+                sizestr, mmc_device);
+    }
+
+    // Write an erase block at a time unless -b picked something else
+    if (!ctx->read_from_mmc && !ctx->fixed_chunk_size && !ctx->adaptive_chunks && erase_size > ctx->chunk_size &&
+            erase_size <= TUNE_MAX_CHUNK_SIZE && erase_size % MIN_CHUNK_SIZE == 0) {
+        ctx->chunk_size = erase_size;
+        if (ctx->copy_buffer_size < ctx->chunk_size)
+            ctx->copy_buffer_size = ctx->chunk_size;
+    }
+    return true;
+}
+
+bool copy_image(struct copy_context *ctx)
+{
+    // Returns false after recording an error in the context's failure
+    struct copy_dest *dests = ctx->dests;
+    if (ctx->resume_journal) {
+        // Skip the part of the image that's already on the memory card.
+        // Compressed images still need to be decompressed up to there.
+        if (ctx->resume_journal->base > 0 &&
+                !resume_skip_image(ctx, ctx->data_fd, ctx->resume_journal->base, &ctx->total_to_copy))
+            return false;
+        report_progress(ctx, 0, ctx->total_to_copy);
+    }
+    if (ctx->dest_count > 1)
+        watch_dest_progress(ctx, dests, ctx->dest_count, ctx->total_to_copy);
+
+    if (ctx->read_from_mmc && ctx->reader_count > 1) {
+        struct compressor *compressor = ctx->compressor;
+        ctx->compressor = NULL;
+        return copy_parallel_read(ctx, dests[0].fd, ctx->data_fd, ctx->total_to_copy, compressor);
+    } else if (ctx->read_from_mmc) {
+        struct copy_dest out;
+        if (!dest_init(ctx, &out, ctx->data_pathname, ctx->data_fd))
+            return false;
+        out.compressor = ctx->compressor;
+        ctx->compressor = NULL;
+        return copy(ctx, dests[0].fd, &out, 1, ctx->total_to_copy);
+    }
+
+    // Use the fastest way of copying that supports the options and
+    // fall back to the buffered pipeline.
+    bool storing = ctx->image_cache && ctx->image_cache->storing;
+    if (ctx->dest_count == 1 && ctx->zero_copy && !ctx->mmap_input && !ctx->resume_journal &&
+            !ctx->copy_job && !ctx->coalesce_writes && !ctx->image_prefetch && !ctx->raw_mmc && !storing &&
+            copy_zero_copy(ctx, ctx->data_fd, &dests[0], ctx->total_to_copy))
+        return true;
+    if (failed(&ctx->failure))
+        return false;
+    if (ctx->dest_count == 1 && ctx->queue_depth > 0 && !ctx->delta_write && !ctx->adaptive_chunks &&
+            !ctx->mmap_input && !ctx->resume_journal && !ctx->coalesce_writes && !ctx->image_prefetch &&
+            !ctx->raw_mmc && copy_uring(ctx, ctx->data_fd, &dests[0], ctx->total_to_copy))
+        return true;
+    if (failed(&ctx->failure))
+        return false;
+    return copy(ctx, ctx->data_fd, dests, ctx->dest_count, ctx->total_to_copy);
+}
+
+void close_copy(struct copy_context *ctx)
+{
+    // Close everything that copy_run opened. This is also what cleans up
+    // after a copy that failed part way through.
+    int i;
+    for (i = 0; i < ctx->dest_count; i++) {
+        if (ctx->dests[i].discards)
+            discard_cancel(ctx->dests[i].discards);
+        if (ctx->dests[i].emmc)
+            emmc_free(ctx->dests[i].emmc);
+        close(ctx->dests[i].fd);
+    }
+    free(ctx->dests);
+    ctx->dests = NULL;
+    ctx->dest_count = 0;
+    restore_force_ro(ctx);
+
+    if (ctx->image_cache && ctx->data_map == ctx->image_cache->map)
+        ctx->data_map = NULL;
+    if (ctx->image_cache) {
+        cache_free(ctx->image_cache);
+        ctx->image_cache = NULL;
+    }
+    free_range_map(ctx->data_map);
+    ctx->data_map = NULL;
+    if (ctx->compressor) {
+        compressor_finish(ctx->compressor);
+        ctx->compressor = NULL;
+    }
+    if (ctx->image_decompressor) {
+        decompressor_free(ctx->image_decompressor);
+        ctx->image_decompressor = NULL;
+    }
+    if (ctx->image_prefetch) {
+        prefetch_free(ctx->image_prefetch);
+        ctx->image_prefetch = NULL;
+    }
+#ifdef HAVE_LIBCURL
+    if (ctx->http) {
+        http_close(ctx->http);
+        ctx->http = NULL;
+    }
+#endif
+    if (ctx->copy_job) {
+        free_job(ctx->copy_job);
+        ctx->copy_job = NULL;
+    } else if (ctx->data_fd > STDERR_FILENO)
+        close(ctx->data_fd);
+    ctx->data_fd = -1;
+
+    free(ctx->resume_journal);
+    ctx->resume_journal = NULL;
+    free(ctx->selected_partitions.partitions);
+    ctx->selected_partitions.partitions = NULL;
+    ctx->selected_partitions.count = 0;
+    free(ctx->found_device);
+    ctx->found_device = NULL;
+}
+
+bool find_dest(struct copy_context *ctx)
+{
+    // Use the only memory card when there's no -d. Returns false after
+    // recording an error in the context's failure.
+    ctx->found_device = ctx->wait_for_card ? wait_for_mmc_device(ctx) : find_mmc_device(&ctx->failure);
+    if (!ctx->found_device)
+        return false;
+    const char *mmc_device = ctx->found_device;
+    ctx->mmc_devices[ctx->mmc_device_count++] = mmc_device;
+    if (ctx->accept_found_device)
+        return true;
+
+    if (strcmp(ctx->data_pathname, "-") == 0 && !ctx->bench && !ctx->job_path)
+        return fail(&ctx->failure, "Cannot confirm use of %s when using stdin/stdout.\n"
+                    "Rerun with -y if location is correct.", mmc_device);
+
+    char sizestr[16];
+    pretty_size(device_size(mmc_device), sizestr);
+    fprintf(stderr, "Use %s memory card found at %s? [y/N] ", sizestr, mmc_device);
+    int response = fgetc(stdin);
+    if (response != 'y' && response != 'Y')
+        return fail(&ctx->failure, "aborted");
+    return true;
+}
+
+bool copy_run(struct copy_context *ctx)
+{
+    if (ctx->mmc_device_count == 0 && !find_dest(ctx)) {
+        close_copy(ctx);
+        return false;
+    }
+
+    if (ctx->bench) {
+        bool ok = umount_all_on_dev(ctx->mmc_devices[0], &ctx->failure) &&
+                  run_bench(ctx, ctx->mmc_devices[0], ctx->seek_offset,
+                            ctx->total_to_copy ? ctx->total_to_copy : BENCH_DEFAULT_SIZE);
+        close_copy(ctx);
+        return ok;
+    }
+
+    ctx->dests = (struct copy_dest *) calloc(ctx->mmc_device_count, sizeof(struct copy_dest));
+    if (!ctx->dests) {
+        fail_errno(&ctx->failure, "calloc");
+        return false;
+    }
+    if (!open_image(ctx)) {
+        close_copy(ctx);
+        return false;
+    }
+
+    // JSON progress is the telemetry written where the progress goes
+    if (ctx->json_progress && !ctx->quiet) {
+        fflush(ctx->progress_out);
+        ctx->telemetry.fd = fileno(ctx->progress_out);
+    }
+
+    struct telemetry *telemetry = &ctx->telemetry;
+    telemetry->start_time = monotonic_seconds();
+    telemetry->last_time = telemetry->start_time;
+    telemetry->next_time = telemetry->start_time + TELEMETRY_INTERVAL;
+
+    // Update the progress to 0% to give the user quick feedback
+    if (ctx->mmc_device_count == 1 && !ctx->resume_path)
+        report_progress(ctx, 0, ctx->total_to_copy);
+    bool ok = start_progress(ctx);
+
+    int i;
+    for (i = 0; ok && i < ctx->mmc_device_count; i++)
+        ok = open_dest(ctx, ctx->mmc_devices[i]);
+    if (ok)
+        ok = copy_image(ctx);
+
+    telemetry_end(telemetry);
+    finish_progress(ctx);
+    if (ok)
+        resume_finish(ctx);
+    if (ok && ctx->image_cache)
+        cache_finish(ctx->image_cache);
+    close_copy(ctx);
+    return ok;
+}
+
+void copy_cancel(struct copy_context *ctx)
+{
+    fail(&ctx->failure, "Canceled");
+}
+
+const char *copy_error(const struct copy_context *ctx)
+{
+    return failed(&ctx->failure) ? ctx->failure.message : "";
+}
+
+void copy_context_free(struct copy_context *ctx)
+{
+    close_copy(ctx);
+    pthread_cond_destroy(&ctx->progress.cond);
+    pthread_mutex_destroy(&ctx->progress.lock);
+    pthread_mutex_destroy(&ctx->telemetry.lock);
+    free(ctx);
 }
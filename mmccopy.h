@@ -0,0 +1,86 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Frank Hunleth
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef MMCCOPY_H
+#define MMCCOPY_H
+
+#include <stdbool.h>
+
+#include "failure.h"
+#include "libmmccopy.h"
+
+// The copy engine that the command line tool and libmmccopy's jobs share.
+// A copy is set up from command line options, run on the calling thread
+// and then freed. Errors are returned instead of exiting, so a copy that
+// fails or is canceled doesn't affect the others in the process.
+struct copy_context;
+
+enum copy_parse_result
+{
+    COPY_PARSE_RUN,     // Call copy_run
+    COPY_PARSE_DONE,    // Nothing to copy, like for -v
+    COPY_PARSE_USAGE,   // Unknown option or missing argument
+    COPY_PARSE_ERROR    // See copy_error
+};
+
+// Library copies never print or prompt. Returns NULL if out of memory.
+struct copy_context *copy_context_new(bool library);
+
+// Parse the command line options. The strings in argv need to stay around
+// until the copy is freed. getopt isn't reentrant, so parsing is
+// serialized between threads.
+enum copy_parse_result copy_parse_options(struct copy_context *ctx, int argc, char *argv[]);
+
+// Get the telemetry as it's produced. The callback is called on the copy's
+// progress thread.
+void copy_set_progress_callback(struct copy_context *ctx,
+                                void (*callback)(const struct mmccopy_progress *progress, void *arg),
+                                void *arg);
+
+// Returns false if the copy failed or was canceled
+bool copy_run(struct copy_context *ctx);
+
+// Make a running copy stop as soon as it can. Safe to call from any thread.
+void copy_cancel(struct copy_context *ctx);
+
+// The first error or "" if none
+const char *copy_error(const struct copy_context *ctx);
+
+// Close everything that the copy opened and free it
+void copy_context_free(struct copy_context *ctx);
+
+void print_usage(const char *argv0);
+
+// Memory card helpers. These return NULL or false after recording an
+// error in failure.
+char *find_mmc_device(struct failure *failure);
+bool umount_all_on_dev(const char *mmc_device, struct failure *failure);
+
+// Open a memory card exclusively. Returns -1 with errno set, or after
+// recording an error in failure if it's still in use.
+int open_mmc(const char *mmc_device, int flags, struct failure *failure);
+
+// Returns false with errno set on failure
+bool trim_mmc(int fd, bool raw_mmc);
+
+#endif // MMCCOPY_H
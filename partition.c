@@ -0,0 +1,212 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Frank Hunleth
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+#include "partition.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Partition tables are read through a callback so that they can come from
+// an image file, a compressed image or the memory card. Offsets are only
+// ever requested in increasing order so that compressed images never need
+// to go back.
+
+#define SECTOR_SIZE 512
+#define MBR_EXTENDED(type) ((type) == 0x05 || (type) == 0x0f || (type) == 0x85)
+#define MBR_GPT_PROTECTIVE 0xee
+#define MAX_PARTITIONS 256
+#define MAX_GPT_ENTRIES_SIZE (1024 * 1024)
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+    return (uint64_t) get_le32(p) | ((uint64_t) get_le32(p + 4) << 32);
+}
+
+static bool add_partition(struct partition_table *table, int number, uint64_t offset, uint64_t size,
+                          struct failure *failure)
+{
+    if (table->count == MAX_PARTITIONS)
+        return fail(failure, "Too many partitions");
+
+    struct partition *partitions = (struct partition *) realloc(table->partitions,
+                                   (table->count + 1) * sizeof(struct partition));
+    if (!partitions)
+        return fail_errno(failure, "realloc");
+    table->partitions = partitions;
+
+    struct partition *p = &table->partitions[table->count++];
+    memset(p, 0, sizeof(*p));
+    p->number = number;
+    p->offset = offset;
+    p->size = size;
+    return true;
+}
+
+static bool read_gpt(struct partition_table *table, partition_read_fn read, void *context,
+                     struct failure *failure)
+{
+    // The header is in the second sector. Entries usually follow it
+    // directly.
+    uint8_t header[SECTOR_SIZE];
+    if (!read(context, header, sizeof(header), SECTOR_SIZE) || memcmp(header, "EFI PART", 8) != 0)
+        return false;
+
+    uint64_t entries_lba = get_le64(header + 72);
+    uint32_t entry_count = get_le32(header + 80);
+    uint32_t entry_size = get_le32(header + 84);
+    if (entries_lba < 2 || entry_size < 128 || (uint64_t) entry_count * entry_size > MAX_GPT_ENTRIES_SIZE)
+        return fail(failure, "Corrupt GPT header");
+
+    size_t len = (size_t) entry_count * entry_size;
+    uint8_t *entries = (uint8_t *) malloc(len);
+    if (!entries)
+        return fail_errno(failure, "malloc");
+    if (!read(context, entries, len, entries_lba * SECTOR_SIZE)) {
+        free(entries);
+        return fail(failure, "Can't read GPT partition entries");
+    }
+
+    static const uint8_t unused[16] = {0};
+    uint32_t i;
+    for (i = 0; i < entry_count; i++) {
+        const uint8_t *e = entries + (size_t) i * entry_size;
+        if (memcmp(e, unused, sizeof(unused)) == 0)
+            continue;
+
+        uint64_t first = get_le64(e + 32);
+        uint64_t last = get_le64(e + 40);
+        if (last < first) {
+            free(entries);
+            return fail(failure, "Corrupt GPT partition entry %u", i + 1);
+        }
+        if (!add_partition(table, i + 1, first * SECTOR_SIZE, (last - first + 1) * SECTOR_SIZE, failure)) {
+            free(entries);
+            return false;
+        }
+
+        // Names are UTF-16. Anything outside of ASCII becomes a '?'.
+        struct partition *p = &table->partitions[table->count - 1];
+        int j;
+        for (j = 0; j < 36; j++) {
+            uint16_t c = e[56 + j * 2] | (e[57 + j * 2] << 8);
+            if (c == 0)
+                break;
+            p->name[j] = (c < 0x80) ? (char) c : '?';
+        }
+    }
+    free(entries);
+    table->type = "gpt";
+    return true;
+}
+
+static bool read_table(struct partition_table *table, partition_read_fn read, void *context,
+                     struct failure *failure)
+{
+    uint8_t mbr[SECTOR_SIZE];
+    if (!read(context, mbr, sizeof(mbr), 0) || mbr[510] != 0x55 || mbr[511] != 0xaa)
+        return false;
+
+    int i;
+    for (i = 0; i < 4; i++) {
+        if (mbr[446 + i * 16 + 4] == MBR_GPT_PROTECTIVE)
+            return read_gpt(table, read, context, failure);
+    }
+
+    // Primary partitions are 1 to 4 and logical partitions in the
+    // extended partition's chain of EBRs start at 5.
+    uint64_t extended = 0;
+    for (i = 0; i < 4; i++) {
+        const uint8_t *e = mbr + 446 + i * 16;
+        uint8_t type = e[4];
+        uint64_t start = (uint64_t) get_le32(e + 8) * SECTOR_SIZE;
+        uint64_t size = (uint64_t) get_le32(e + 12) * SECTOR_SIZE;
+        if (type == 0 || size == 0)
+            continue;
+        if (MBR_EXTENDED(type) && !extended)
+            extended = start;
+        if (!add_partition(table, i + 1, start, size, failure))
+            return false;
+    }
+
+    uint64_t ebr = extended;
+    int number = 5;
+    while (ebr) {
+        uint8_t sector[SECTOR_SIZE];
+        if (!read(context, sector, sizeof(sector), ebr) || sector[510] != 0x55 || sector[511] != 0xaa)
+            return fail(failure, "Can't read logical partition %d", number);
+
+        const uint8_t *e = sector + 446;
+        if (get_le32(e + 12) &&
+                !add_partition(table, number++, ebr + (uint64_t) get_le32(e + 8) * SECTOR_SIZE,
+                               (uint64_t) get_le32(e + 12) * SECTOR_SIZE, failure))
+            return false;
+
+        // The next EBR is relative to the start of the extended partition
+        // and always comes later.
+        uint64_t next = get_le32(e + 16 + 8) ? extended + (uint64_t) get_le32(e + 16 + 8) * SECTOR_SIZE : 0;
+        if (next && next <= ebr)
+            return fail(failure, "Corrupt extended partition");
+        ebr = next;
+    }
+
+    table->type = "mbr";
+    return true;
+}
+
+bool partition_table_read(struct partition_table *table, partition_read_fn read, void *context,
+                          struct failure *failure)
+{
+    // Returns false if there's no partition table or it's corrupt. The
+    // error is recorded in failure in the second case.
+    memset(table, 0, sizeof(*table));
+    if (read_table(table, read, context, failure))
+        return true;
+    partition_table_free(table);
+    return false;
+}
+
+const struct partition *partition_find(const struct partition_table *table, const char *selector)
+{
+    // Partitions are selected by number or GPT name.
+    char *end;
+    long number = strtol(selector, &end, 10);
+    int i;
+    for (i = 0; i < table->count; i++) {
+        const struct partition *p = &table->partitions[i];
+        if ((*end == '\0' && p->number == number) || (p->name[0] && strcmp(p->name, selector) == 0))
+            return p;
+    }
+    return NULL;
+}
+
+void partition_table_free(struct partition_table *table)
+{
+    free(table->partitions);
+    table->partitions = NULL;
+    table->count = 0;
+}
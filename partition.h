@@ -0,0 +1,57 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Frank Hunleth
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "failure.h"
+
+// MBR and GPT partition tables
+struct partition
+{
+    int number;         // Numbered like Linux does, starting at 1
+    uint64_t offset;    // Offsets and sizes are in bytes
+    uint64_t size;
+    char name[72];      // GPT partition name or "" for MBR
+};
+
+struct partition_table
+{
+    const char *type;   // "mbr" or "gpt"
+    struct partition *partitions;
+    int count;
+};
+
+// Read len bytes at offset. Returns false if they can't be read.
+typedef bool (*partition_read_fn)(void *context, void *buffer, size_t len, uint64_t offset);
+
+bool partition_table_read(struct partition_table *table, partition_read_fn read, void *context,
+                          struct failure *failure);
+const struct partition *partition_find(const struct partition_table *table, const char *selector);
+void partition_table_free(struct partition_table *table);
+
+#endif // PARTITION_H
@@ -0,0 +1,241 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Frank Hunleth
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+#include "prefetch.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct worker_arg
+{
+    struct prefetch *pf;
+    int worker;
+};
+
+static void *prefetch_worker(void *arg)
+{
+    struct worker_arg *w = (struct worker_arg *) arg;
+    struct prefetch *pf = w->pf;
+    int worker = w->worker;
+    free(w);
+
+    pthread_mutex_lock(&pf->lock);
+    for (;;) {
+        // A block's slot is free once the reader is past the block that
+        // used it before.
+        while (!pf->stop && pf->next_fill < pf->end_block &&
+               pf->next_fill >= pf->next_read + pf->block_count)
+            pthread_cond_wait(&pf->cond, &pf->lock);
+        if (pf->stop || pf->next_fill >= pf->end_block || failed(pf->failure))
+            break;
+
+        uint64_t number = pf->next_fill++;
+        struct prefetch_block *block = &pf->blocks[number % pf->block_count];
+        pthread_mutex_unlock(&pf->lock);
+
+        ssize_t len = pf->fill(pf->ctx, worker, block->data, PREFETCH_BLOCK_SIZE,
+                               number * PREFETCH_BLOCK_SIZE);
+
+        pthread_mutex_lock(&pf->lock);
+        if (len < 0)
+            break;
+        block->number = number;
+        block->len = len;
+        block->ready = true;
+        if (len < PREFETCH_BLOCK_SIZE && number < pf->end_block)
+            pf->end_block = number + 1;
+        pthread_cond_broadcast(&pf->cond);
+    }
+
+    // Wake up the reader in case it's waiting for a block that this
+    // worker won't fill because the copy failed
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+struct prefetch *prefetch_start(size_t budget, int workers, prefetch_fill_fn fill, void *ctx,
+                                struct failure *failure)
+{
+    // Returns NULL after recording an error in failure
+    struct prefetch *pf = (struct prefetch *) calloc(1, sizeof(struct prefetch));
+    if (!pf) {
+        fail_errno(failure, "calloc");
+        return NULL;
+    }
+    pf->fill = fill;
+    pf->ctx = ctx;
+    pf->failure = failure;
+    pf->end_block = UINT64_MAX;
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+
+    // Every worker needs a block to fill and the reader needs one to read
+    int block_count = budget / PREFETCH_BLOCK_SIZE;
+    if (block_count < workers + 1)
+        block_count = workers + 1;
+    pf->blocks = (struct prefetch_block *) calloc(block_count, sizeof(struct prefetch_block));
+    pf->workers = (pthread_t *) calloc(workers, sizeof(pthread_t));
+    if (!pf->blocks || !pf->workers) {
+        fail_errno(failure, "calloc");
+        prefetch_free(pf);
+        return NULL;
+    }
+    for (; pf->block_count < block_count; pf->block_count++) {
+        pf->blocks[pf->block_count].data = (char *) malloc(PREFETCH_BLOCK_SIZE);
+        if (!pf->blocks[pf->block_count].data) {
+            fail_errno(failure, "malloc");
+            prefetch_free(pf);
+            return NULL;
+        }
+    }
+
+    for (; pf->worker_count < workers; pf->worker_count++) {
+        struct worker_arg *w = (struct worker_arg *) malloc(sizeof(struct worker_arg));
+        if (!w) {
+            fail_errno(failure, "malloc");
+            prefetch_free(pf);
+            return NULL;
+        }
+        w->pf = pf;
+        w->worker = pf->worker_count;
+        if (pthread_create(&pf->workers[pf->worker_count], NULL, prefetch_worker, w)) {
+            free(w);
+            fail(failure, "Can't start prefetch thread");
+            prefetch_free(pf);
+            return NULL;
+        }
+    }
+    return pf;
+}
+
+struct fd_source
+{
+    int fd;
+    struct failure *failure;
+};
+
+static ssize_t fill_from_fd(void *ctx, int worker, char *buffer, size_t len, uint64_t offset)
+{
+    // Pipes return whatever is there, so keep reading until the block is
+    // full or the image ends.
+    (void) worker;
+    (void) offset;
+    struct fd_source *source = (struct fd_source *) ctx;
+    size_t total = 0;
+    while (total < len) {
+        ssize_t amount_read = read(source->fd, buffer + total, len - total);
+        if (amount_read < 0) {
+            if (errno == EINTR)
+                continue;
+            fail_errno(source->failure, "read");
+            return -1;
+        }
+        if (amount_read == 0)
+            break;
+        total += amount_read;
+    }
+    return total;
+}
+
+struct prefetch *prefetch_start_fd(int fd, size_t budget, struct failure *failure)
+{
+    // Reading a pipe is sequential, so there's only one worker
+    struct fd_source *source = (struct fd_source *) malloc(sizeof(struct fd_source));
+    if (!source) {
+        fail_errno(failure, "malloc");
+        return NULL;
+    }
+    source->fd = fd;
+    source->failure = failure;
+    struct prefetch *pf = prefetch_start(budget, 1, fill_from_fd, source, failure);
+    if (!pf) {
+        free(source);
+        return NULL;
+    }
+    pf->owns_ctx = true;
+    return pf;
+}
+
+ssize_t prefetch_read(struct prefetch *pf, char *out, size_t len)
+{
+    // Returns the number of bytes, which is only less than len at the end
+    // of the image, or -1 if the copy failed.
+    size_t total = 0;
+    pthread_mutex_lock(&pf->lock);
+    while (total < len && pf->next_read < pf->end_block) {
+        if (failed(pf->failure)) {
+            pthread_mutex_unlock(&pf->lock);
+            return -1;
+        }
+
+        struct prefetch_block *block = &pf->blocks[pf->next_read % pf->block_count];
+        if (!block->ready || block->number != pf->next_read) {
+            pthread_cond_wait(&pf->cond, &pf->lock);
+            continue;
+        }
+
+        // The block is the reader's until next_read moves past it
+        pthread_mutex_unlock(&pf->lock);
+        size_t n = block->len - pf->read_pos;
+        if (n > len - total)
+            n = len - total;
+        memcpy(out + total, block->data + pf->read_pos, n);
+        total += n;
+        pf->read_pos += n;
+        pthread_mutex_lock(&pf->lock);
+
+        if (pf->read_pos == block->len) {
+            block->ready = false;
+            pf->next_read++;
+            pf->read_pos = 0;
+            pthread_cond_broadcast(&pf->cond);
+        }
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return total;
+}
+
+void prefetch_free(struct prefetch *pf)
+{
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = true;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+
+    int i;
+    for (i = 0; i < pf->worker_count; i++)
+        pthread_join(pf->workers[i], NULL);
+    for (i = 0; i < pf->block_count; i++)
+        free(pf->blocks[i].data);
+    free(pf->blocks);
+    free(pf->workers);
+    if (pf->owns_ctx)
+        free(pf->ctx);
+    pthread_cond_destroy(&pf->cond);
+    pthread_mutex_destroy(&pf->lock);
+    free(pf);
+}
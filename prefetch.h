@@ -0,0 +1,82 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Frank Hunleth
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "failure.h"
+
+#define PREFETCH_BLOCK_SIZE (1024 * 1024)
+
+// Fill out buffer with up to len bytes of the image starting at offset.
+// Returns the number of bytes, which is only less than len at the end of
+// the image, or -1 after recording an error in the prefetcher's failure.
+// Each worker thread passes its own worker number so that it can keep its
+// own connection.
+typedef ssize_t (*prefetch_fill_fn)(void *ctx, int worker, char *buffer, size_t len, uint64_t offset);
+
+struct prefetch_block
+{
+    char *data;
+    uint64_t number;    // Which block of the image this holds
+    size_t len;
+    bool ready;         // Filled and not read yet
+};
+
+// Reads the image ahead of the copy into a fixed pool of blocks so that
+// stalls in a pipe or network source don't stall the memory card.
+// Workers fill blocks in any order and they're read back in order.
+struct prefetch
+{
+    prefetch_fill_fn fill;
+    void *ctx;
+    bool owns_ctx;          // Free ctx along with the prefetcher
+    struct failure *failure;    // The workers stop once the copy fails
+
+    struct prefetch_block *blocks;
+    int block_count;
+    uint64_t next_fill;     // Next block for a worker to fill
+    uint64_t next_read;     // Block being read
+    size_t read_pos;        // Position in that block
+    uint64_t end_block;     // First block past the end of the image
+    bool stop;
+
+    pthread_t *workers;
+    int worker_count;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+struct prefetch *prefetch_start(size_t budget, int workers, prefetch_fill_fn fill, void *ctx,
+                                struct failure *failure);
+struct prefetch *prefetch_start_fd(int fd, size_t budget, struct failure *failure);
+ssize_t prefetch_read(struct prefetch *pf, char *out, size_t len);
+void prefetch_free(struct prefetch *pf);
+
+#endif // PREFETCH_H